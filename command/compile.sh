@@ -1,17 +1,22 @@
 ####  此脚本应该在command目录下执行
+####  用法: ./compile.sh [程序名], 不带参数时编译prog_no_arg
 
-BIN="prog_no_arg"
+BIN=${1:-"prog_no_arg"}
 CFLAGS="-Wall -m32 -c -fno-builtin -W -Wstrict-prototypes \
       -Wmissing-prototypes -Wsystem-headers"
-LIB="../lib/"
+LIB="-I ../lib/ -I ../lib/user/ -I ../lib/kernel/ -I ../kernel/ \
+      -I ../device/ -I ../thread/ -I ../fs/ -I ../shell/"
 OBJS="../build/string.o ../build/syscall.o \
-      ../build/stdio.o ../build/assert.o"
+      ../build/stdio.o ../build/assert.o ../build/malloc.o"
 DD_IN=$BIN
 DD_OUT="/home/linhao/bochs/hd60M.img" 
 
-gcc $CFLAGS -I $LIB -o $BIN".o" $BIN".c"
+gcc $CFLAGS $LIB -o $BIN".o" $BIN".c"
 ld -m elf_i386 -e main $BIN".o" $OBJS -o $BIN
-SEC_CNT=10
+# 扇区数按程序大小算出, kernel/main.c中的file_size和文件名要改成与之对应
+FILE_SIZE=$(stat -c %s $BIN)
+SEC_CNT=$(( (FILE_SIZE + 511) / 512 ))
+echo "$BIN: $FILE_SIZE bytes"
 
 
 dd if=./$DD_IN of=$DD_OUT bs=512 count=$SEC_CNT seek=300 conv=notrunc
\ No newline at end of file
@@ -0,0 +1,63 @@
+#include "syscall.h"
+#include "stdio.h"
+#include "string.h"
+/* 把参数文件整个映射进来, 打印内容后就地把其中字母的大小写互换, 经msync写回文件
+ * 再运行一次可以看到文件内容已被改写, 运行两次即恢复原样 */
+int main(int argc, char** argv) {
+   if (argc != 2) {
+      printf("mmap_demo: usage: mmap_demo file\n");
+      exit(-2);
+   }
+
+   char abs_path[512] = {0};  // 存储参数的绝对路径
+   // 处理参数文件的路径, 将其转换为绝对路径后存入abs_path数组
+   if (argv[1][0] != '/') {
+      getcwd(abs_path, 512);
+      strcat(abs_path, "/");
+      strcat(abs_path, argv[1]);
+   } else {
+      strcpy(abs_path, argv[1]);
+   }
+
+   struct stat file_stat;
+   if (stat(abs_path, &file_stat) == -1 || file_stat.st_size == 0) {
+      printf("mmap_demo: %s is missing or empty\n", argv[1]);
+      return -1;
+   }
+   // 映射区的访问权限跟随打开方式, 要改写文件就须以读写方式打开
+   int fd = open(abs_path, O_RDWR);
+   if (fd == -1) {
+      printf("mmap_demo: open %s failed\n", argv[1]);
+      return -1;
+   }
+   uint32_t size = file_stat.st_size;
+   char* map = mmap(fd, 0, size);
+   if (map == NULL) {
+      printf("mmap_demo: mmap %s failed\n", argv[1]);
+      close(fd);
+      return -1;
+   }
+   // 映射区持有文件的打开计数, 关闭fd后映射依然有效
+   close(fd);
+
+   // 第一次访问时才由缺页处理程序从页缓存映射进来
+   write(1, map, size);
+
+   uint32_t idx;
+   for (idx = 0; idx < size; idx++) {
+      if (map[idx] >= 'a' && map[idx] <= 'z') {
+         map[idx] -= 'a' - 'A';
+      } else if (map[idx] >= 'A' && map[idx] <= 'Z') {
+         map[idx] += 'a' - 'A';
+      }
+   }
+   if (msync(map, size) == -1) {
+      printf("mmap_demo: msync failed\n");
+   }
+   if (munmap(map) == -1) {
+      printf("mmap_demo: munmap failed\n");
+      return -1;
+   }
+   printf("\nmmap_demo: case of %s swapped\n", argv[1]);
+   return 0;
+}
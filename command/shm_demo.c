@@ -0,0 +1,49 @@
+#include "syscall.h"
+#include "stdio.h"
+#include "string.h"
+#include "shm.h"
+/* 父子进程经共享内存段传递一句话: 段在fork前映射, 子进程继承映射后写入, 父进程等子进程退出后读出 */
+int main(void) {
+   int shmid = shmget(IPC_PRIVATE, 4096);
+   if (shmid == -1) {
+      printf("shm_demo: shmget failed\n");
+      return -1;
+   }
+   char* shm = shmat(shmid);
+   if (shm == NULL) {
+      printf("shm_demo: shmat failed\n");
+      shmrm(shmid);
+      return -1;
+   }
+   shm[0] = '\0';
+
+   int16_t pid = fork();
+   if (pid == -1) {
+      printf("shm_demo: fork failed\n");
+      shmrm(shmid);
+      shmdt(shm);
+      return -1;
+   }
+   if (pid == 0) {   // 子进程: 映射随fork继承, 写入的是与父进程相同的页框
+      sprintf(shm, "hello from child %d", getpid());
+      shmdt(shm);
+      exit(0);
+   }
+
+   int32_t status;
+   wait(&status);
+   printf("shm_demo: parent %d read \"%s\"\n", getpid(), shm);
+   // 还映射着时删除: 段不再能被映射, 等本进程解除映射时才真正销毁
+   if (shmrm(shmid) == -1) {
+      printf("shm_demo: shmrm failed\n");
+      shmdt(shm);
+      return -1;
+   }
+   if (shmat(shmid) != NULL) {
+      printf("shm_demo: segment %d still attachable after shmrm\n", shmid);
+      return -1;
+   }
+   shmdt(shm);
+   printf("shm_demo: segment %d removed\n", shmid);
+   return 0;
+}
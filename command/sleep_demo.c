@@ -0,0 +1,49 @@
+#include "syscall.h"
+#include "stdio.h"
+#include "string.h"
+/* 用nanosleep睡眠参数指定的毫秒数(默认500), 以单调时钟量出实际睡了多久, 并打印rem中的剩余时间
+ * 睡眠不会被提前打断, rem应当总是0 */
+int main(int argc, char** argv) {
+   if (argc > 2) {
+      printf("sleep_demo: usage: sleep_demo [ms]\n");
+      exit(-2);
+   }
+   uint32_t ms = 500;
+   if (argc == 2) {
+      ms = 0;
+      char* p = argv[1];
+      while (*p >= '0' && *p <= '9') {
+         ms = ms * 10 + (*p - '0');
+         p++;
+      }
+   }
+
+   struct timespec req, rem, start, end;
+   req.tv_sec = ms / 1000;
+   req.tv_nsec = (ms % 1000) * 1000000;
+   rem.tv_sec = rem.tv_nsec = 0xffffffff;    // 填上非0值, 看内核是否填回了剩余时间
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   if (nanosleep(&req, &rem) == -1) {
+      printf("sleep_demo: nanosleep failed\n");
+      return -1;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   // 只用32位运算, 内核不链接libgcc, 用户程序也一样
+   uint32_t slept_ms = (end.tv_sec - start.tv_sec) * 1000;
+   if (end.tv_nsec >= start.tv_nsec) {
+      slept_ms += (end.tv_nsec - start.tv_nsec) / 1000000;
+   } else {
+      slept_ms = slept_ms - 1000 + (1000000000 + end.tv_nsec - start.tv_nsec) / 1000000;
+   }
+   printf("sleep_demo: asked %dms, slept %dms, rem %ds %dns\n", ms, slept_ms, rem.tv_sec, rem.tv_nsec);
+
+   // tv_nsec不小于10亿是非法参数, 应当立即返回-1
+   req.tv_sec = 0;
+   req.tv_nsec = 1000000000;
+   if (nanosleep(&req, NULL) != -1) {
+      printf("sleep_demo: invalid tv_nsec accepted\n");
+      return -1;
+   }
+   return 0;
+}
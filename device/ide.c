@@ -10,6 +10,8 @@
 #include "timer.h"
 #include "string.h"
 #include "list.h"
+#include "slab.h"
+#include "softirq.h"
 
 /* 定义宏 用于表示硬盘各寄存器的端口号 */
 #define reg_data(channel)	     (channel->port_base + 0)
@@ -48,6 +50,8 @@ struct ide_channel channels[2]; // 表示有两个ide通道
 int32_t ext_lba_base = 0;       // 用于记录总拓展分区的起始lba, 初始为0, partition_scan时以此为标记
 uint8_t p_no = 0, l_no = 0;     // 用来记录硬盘主分区和逻辑分区的下标
 struct list partition_list;     // 分区队列
+static struct kmem_cache* boot_sector_cache;    // partition_scan读入MBR/EBR所用的扇区缓冲区
+static uint32_t hd_done_mask;                   // 第i位为1表示第i个通道的硬盘已发出完成中断, 等待软中断唤醒驱动程序
 
 /* 构建1个16字节大小的结构体, 用于存分区表项 */
 struct partition_table_entry {
@@ -232,9 +236,25 @@ void intr_hd_handler(uint8_t irq_no) {
     // 不必担心此次中断是否对应的就是最近一次的expecting_intr, 通道锁保证了这一点(不存在很久之前硬盘发出中断，现在才处理的情况)
     if(channel->expecting_intr){
         channel->expecting_intr = false;
-        sema_up(&channel->disk_done);
         // 读取状态寄存器使得硬盘控制器认为此次中断已被处理, 从而硬盘可以产生新的中断
         inb(reg_status(channel));
+        // 唤醒驱动程序留给块设备软中断
+        hd_done_mask |= 1 << ch_no;
+        raise_softirq(SOFTIRQ_BLOCK);
+    }
+}
+
+/* 块设备软中断: 唤醒等待硬盘操作完成的驱动程序 */
+static void hd_softirq(void) {
+    enum intr_status old_status = intr_disable();
+    uint32_t done = hd_done_mask;
+    hd_done_mask = 0;
+    intr_set_status(old_status);
+    uint8_t ch_no;
+    for (ch_no = 0; ch_no < channel_cnt; ch_no++) {
+        if (done & (1 << ch_no)) {
+            sema_up(&channels[ch_no].disk_done);
+        }
     }
 }
 
@@ -282,7 +302,7 @@ static void identify_disk(struct disk* hd) {
 
 /* 分区表扫描函数：扫描硬盘hd中"起始地址为ext_lba的一扇区"中的所有分区 */
 static void partition_scan(struct disk* hd, uint32_t ext_lba) {
-    struct boot_sector* bs = sys_malloc(sizeof(struct boot_sector));    // "动态"申请一扇区大小的内存来存储分区表所在的扇区
+    struct boot_sector* bs = kmem_cache_alloc(boot_sector_cache);    // "动态"申请一扇区大小的内存来存储分区表所在的扇区
     ide_read(hd, ext_lba, bs, 1);    // 将引导扇区的内容读取bs中缓存
     uint8_t part_idx = 0;
     struct partition_table_entry* p = bs->partition_table;    // 令指针p指向分区表数组起始地址
@@ -303,6 +323,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
                 hd->prim_parts[p_no].start_lba = ext_lba + p->start_lba;
                 hd->prim_parts[p_no].sec_cnt = p->sec_cnt;
                 hd->prim_parts[p_no].my_disk = hd;
+                hd->prim_parts[p_no].fs_type = p->fs_type;
                 list_append(&partition_list, &hd->prim_parts[p_no].part_tag);
                 sprintf(hd->prim_parts[p_no].name, "%s%d", hd->name, p_no + 1);
                 p_no++;
@@ -311,6 +332,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
                 hd->logic_parts[l_no].start_lba = ext_lba + p->start_lba;
                 hd->logic_parts[l_no].sec_cnt = p->sec_cnt;
                 hd->logic_parts[l_no].my_disk = hd;
+                hd->logic_parts[l_no].fs_type = p->fs_type;
                 list_append(&partition_list, &hd->logic_parts[l_no].part_tag);
                 sprintf(hd->logic_parts[l_no].name, "%s%d", hd->name, l_no + 5);	 // 逻辑分区数字是从5开始,主分区是1～4.
                 l_no++;
@@ -320,7 +342,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
         }
         p++;
     }
-    sys_free(bs);
+    kmem_cache_free(boot_sector_cache, bs);
 }
 
 /* 打印分区信息: 被用在list_traversal中作为回调函数调用, 必须有2个参数 */
@@ -338,7 +360,10 @@ void ide_init(){
     uint8_t hd_cnt = *((uint8_t*)(0x475));    // 获取硬盘数量, BIOS将硬盘数量写入到了0x475地址中
     ASSERT(hd_cnt > 0);
     list_init(&partition_list);
+    boot_sector_cache = kmem_cache_create("boot_sector", sizeof(struct boot_sector), NULL);
+    ASSERT(boot_sector_cache != NULL);
     channel_cnt = DIV_ROUND_UP(hd_cnt, 2);    // 一个ide通道上有两个硬盘, 根据硬盘数量反推有几个ide通道
+    open_softirq(SOFTIRQ_BLOCK, hd_softirq);
 
     struct ide_channel* channel;
     uint8_t channel_no = 0, dev_no = 0;
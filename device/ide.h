@@ -12,12 +12,15 @@ struct partition {
     struct disk* my_disk;        // 表示此分区属于哪个硬盘
     struct list_elem part_tag;   // 本分区的标记, 将来会将该分区汇总到队列中
     char name[8];                // 分区名称
+    uint8_t fs_type;             // 分区表项中的分区类型, 只在内存中
     struct super_block* sb;      // 本分区的超级块
     struct bitmap block_bitmap;  // 块位图
     struct bitmap inode_bitmap;  // i节点位图
     struct list open_inodes;     // 本分区打开的i节点队列
 };
 
+#define PART_TYPE_SWAP 0x82    // 交换分区的分区类型, 不建文件系统, 由swap_init用作交换空间
+
 struct disk {
     char name[8];                       // 本硬盘的名称, 如sda、sdb等
     struct ide_channel* my_channel;     // 用于表示此块硬盘插在那个通道上(primary? Secondary?)
@@ -4,8 +4,10 @@
 #include "io.h"
 #include "global.h"
 #include "ioqueue.h"
+#include "softirq.h"
 
 #define KBD_BUF_PORT 0x60    // 键盘buffer寄存器端口号为0x60
+#define KBD_RAW_SIZE 64      // 原始扫描码环形缓冲区的大小, 须为2的幂
 
 /* 用转义字符定义"部分"控制字符 */
 #define esc          '\033'  // 八进制表示字符,也可以用十六进制'\x1b'
@@ -40,6 +42,10 @@ struct ioqueue kbd_buf;
 /* 用以下变量记录相应的键是否被按下, 其中ext_scancode用于记录通码是否义0xe0开头 */
 static bool ctrl_status, shift_status, alt_status, caps_lock_status, ext_scancode;
 
+/* 中断处理程序读到的原始扫描码, 由键盘软中断取出解码; head和tail只增不减, 用下标时对KBD_RAW_SIZE取模 */
+static uint8_t kbd_raw[KBD_RAW_SIZE];
+static uint32_t kbd_raw_head, kbd_raw_tail;
+
 // 通码作索引
 static char keymap[][2] = {
 /* 扫描码   未与shift组合  与shift组合*/
@@ -106,16 +112,14 @@ static char keymap[][2] = {
 /*其它按键暂不处理*/
 };
 
-/* 键盘中断处理程序 */
-static void intr_keyboard_handler(void) {
-    // 本次中断发生前的上一次中断是否有ctrl, shift, capslock键被按下?
+/* 解码一个扫描码scancode, 更新控制键状态, 可见字符放入键盘缓冲区 */
+static void kbd_decode(uint16_t scancode) {
+    // 本扫描码之前是否有ctrl, shift, capslock键被按下?
     bool ctrl_down_last = ctrl_status;
     bool shift_down_last = shift_status;
     bool caps_lock_last = caps_lock_status;
 
     bool break_code;    // 用于判断当前按键扫描码是否为断码
-    // 从"输出缓存寄存器"中读入扫描码(1字节)
-    uint16_t scancode = inb(KBD_BUF_PORT);
 
     // 判断扫描码是否以e0开头, 若以e0开头则表示刚刚按下的键产生了多个扫描码, 故马上结束此次中断处理函数, 等待下一个扫描码进来
     if (scancode == 0xe0) {
@@ -191,10 +195,12 @@ static void intr_keyboard_handler(void) {
                  cur_char -= 'a';
              }
 
-            // 若kbd_buf未满且待加入的cur_char不为0, 则将其加入到缓冲区kbd_buf中
+            // 若kbd_buf未满且待加入的cur_char不为0, 则将其加入到缓冲区kbd_buf中; 软中断是开着中断执行的, 操作缓冲区时要关中断
+            enum intr_status old_status = intr_disable();
             if(!ioq_full(&kbd_buf)){
                 ioq_putchar(&kbd_buf, cur_char); // 将字符放置到环形输入缓冲区中
             }
+            intr_set_status(old_status);
             return;
         }
 
@@ -215,10 +221,35 @@ static void intr_keyboard_handler(void) {
     }
 }
 
+/* 键盘中断处理程序: 只读出扫描码, 解码留给键盘软中断 */
+static void intr_keyboard_handler(void) {
+    // 从"输出缓存寄存器"中读入扫描码(1字节), 不读的话键盘不会再发中断
+    uint8_t scancode = inb(KBD_BUF_PORT);
+    if (kbd_raw_head - kbd_raw_tail < KBD_RAW_SIZE) {    // 满了就丢弃, 软中断迟迟得不到处理时按键本来也无人读取
+        kbd_raw[kbd_raw_head++ % KBD_RAW_SIZE] = scancode;
+    }
+    raise_softirq(SOFTIRQ_KBD);
+}
+
+/* 键盘软中断: 逐个解码中断处理程序读到的扫描码 */
+static void kbd_softirq(void) {
+    while (true) {
+        enum intr_status old_status = intr_disable();
+        if (kbd_raw_tail == kbd_raw_head) {
+            intr_set_status(old_status);
+            break;
+        }
+        uint8_t scancode = kbd_raw[kbd_raw_tail++ % KBD_RAW_SIZE];
+        intr_set_status(old_status);
+        kbd_decode(scancode);
+    }
+}
+
 /* 键盘初始化 */
 void keyboard_init() {
     put_str("keyboard init start\n");
     ioqueue_init(&kbd_buf);
+    open_softirq(SOFTIRQ_KBD, kbd_softirq);
     register_handler(0x21, intr_keyboard_handler);
     put_str("keyboard init done!\n");
 }
\ No newline at end of file
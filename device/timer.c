@@ -4,6 +4,8 @@
 #include "interrupt.h"
 #include "thread.h"
 #include "debug.h"
+#include "smp.h"
+#include "softirq.h"
 
 #define IRQ0_FREQUENCY	   100
 #define INPUT_FREQUENCY	   1193180
@@ -13,11 +15,26 @@
 #define COUNTER_MODE	   2
 #define READ_WRITE_LATCH   3
 #define PIT_CONTROL_PORT   0x43
+#define ONESHOT_MODE       0       // 方式0: 计数到0时发一次中断, 之后不再重复
+#define COUNTER2_PORT      0x42
+#define COUNTER2_NO        2
+#define PIT_GATE_PORT      0x61    // 位0控制计数器2的GATE, 位1控制扬声器, 位5反映计数器2的OUT
+#define PIT_OUT2           0x20
+#define PIT_COUNT_MAX      0xffff  // 计数初值为16位, 单次定时最长约55毫秒
+
+#define NS_PER_TICK        (1000000000 / IRQ0_FREQUENCY)
+#define CALIBRATE_MS       10      // 用计数器2校准TSC的时长
 
 #define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)
+#define SLEEP_TICKS_MAX    0x7fffffff    // 一次睡眠最多的ticks数, 再多时间轮就会把它当作已经过期
 
 uint32_t ticks;    // ticks是内核自中断开启以来总共的嘀嗒数
 
+static uint32_t tsc_khz;          // 校准出的TSC频率(每毫秒的周期数), 为0表示没有可用的TSC
+static uint32_t tsc_mult;         // 周期数换算为纳秒的乘数: ns = cycles * tsc_mult >> 24
+static uint64_t tsc_boot;         // 校准结束时的TSC, 作为单调时钟的零点
+static bool clock_oneshot;        // 是否已切换为单次定时: 有可用的TSC时, 时钟中断只在下一个到期时刻发生
+
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器并赋予初始值counter_value */
 static void frequency_set(uint8_t counter_port, uint8_t counter_no, uint8_t rwl, uint8_t counter_mode, uint16_t counter_value) {
 /* 往控制字寄存器端口0x43中写入控制字 */
@@ -25,36 +42,278 @@ static void frequency_set(uint8_t counter_port, uint8_t counter_no, uint8_t rwl,
 /* 先写入counter_value的低8位 */
    outb(counter_port, (uint8_t)counter_value);
 /* 再写入counter_value的高8位 */
-   outb(counter_port, (uint8_t)counter_value >> 8);
+   outb(counter_port, (uint8_t)(counter_value >> 8));
 }
 
-/* 时钟的中断处理程序 */
-static void intr_timer_handler(void){
-    // 先通过running_thread()获取当前正在运行的线程的pcb的起始虚拟地址
-    struct task_struct* cur_thread = running_thread();
-    // 检查栈是否溢出, 破坏了线程信息
-    ASSERT(cur_thread->stack_magic == 0x19980924);
+/* 读取时间戳计数器 */
+static inline uint64_t rdtsc(void) {
+    uint64_t tsc;
+    asm volatile ("rdtsc" : "=A"(tsc));
+    return tsc;
+}
 
-    cur_thread->elapsed_ticks++;    // 记录此线程占用的cpu时间
-    ticks++;
+/* 64位的*n除以32位的base, 商存回*n, 返回余数; 内核不链接libgcc, 不能直接做64位除法 */
+static uint32_t div64_u32(uint64_t* n, uint32_t base) {
+    uint32_t high = (uint32_t)(*n >> 32);
+    uint32_t q_high = high / base;
+    uint32_t rem = high % base;    // 余数小于base, 保证divl的商不会溢出
+    uint32_t q_low;
+    asm ("divl %4" : "=a"(q_low), "=d"(rem) : "a"((uint32_t)*n), "d"(rem), "rm"(base) : "cc");
+    *n = ((uint64_t)q_high << 32) | q_low;
+    return rem;
+}
 
-    if(cur_thread->ticks == 0) {    // 若进程时间片用完, 就开始调度新的进程上cpu
-        schedule();
-    }else{
-        cur_thread->ticks--;
+/* 用计数器2定时CALIBRATE_MS毫秒, 数出这段时间内TSC走过的周期数, 得到TSC的频率 */
+static void tsc_calibrate(void) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & 0x10)) {    // CPUID.1:EDX第4位为0, 处理器不支持TSC
+        return;
     }
+    // 打开计数器2的GATE并关掉扬声器, 以方式0从CALIBRATE_MS毫秒对应的初值开始减
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+    frequency_set(COUNTER2_PORT, COUNTER2_NO, READ_WRITE_LATCH, ONESHOT_MODE, INPUT_FREQUENCY / 1000 * CALIBRATE_MS);
+    uint64_t start = rdtsc();
+    uint32_t spin = 0;
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT2)) {    // 计数到0时OUT变为高电平
+        if (++spin == 0x10000000) {    // 计数器2不工作, 放弃使用TSC
+            return;
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    div64_u32(&cycles, CALIBRATE_MS);
+    if (cycles >> 32 || (uint32_t)cycles <= 1000000 >> 8) {    // 频率高得离谱或低到换算乘数会溢出, 都视为不可用
+        return;
+    }
+    tsc_khz = (uint32_t)cycles;
+    uint64_t mult = (uint64_t)1000000 << 24;
+    div64_u32(&mult, tsc_khz);
+    tsc_mult = (uint32_t)mult;
+    tsc_boot = rdtsc();
 }
 
-/* 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式 */
-static void ticks_to_sleep(uint32_t sleep_ticks) {
-    uint32_t start_tick = ticks;
+/* 返回单调时钟的纳秒数: 有TSC时精确到纳秒级, 否则只能精确到tick */
+uint64_t clock_ns(void) {
+    if (tsc_khz == 0) {
+        return (uint64_t)ticks * NS_PER_TICK;
+    }
+    uint64_t cycles = rdtsc() - tsc_boot;
+    uint32_t high = (uint32_t)(cycles >> 32);
+    uint32_t low = (uint32_t)cycles;
+    // 把cycles拆成高低32位分别与乘数相乘, 避免96位的中间结果
+    return ((uint64_t)high * tsc_mult << 8) + ((uint64_t)low * tsc_mult >> 24);
+}
+
+/* 单调时钟当前所在的tick */
+static uint32_t clock_ticks(void) {
+    uint64_t ns = clock_ns();
+    div64_u32(&ns, NS_PER_TICK);
+    return (uint32_t)ns;
+}
+
+/* 单次定时模式下, 让计数器0在第deadline个tick开始的时刻发中断, 超出计数器的量程就定到量程的尽头 */
+static void clock_arm(uint32_t deadline) {
+    uint64_t now = clock_ns();
+    uint64_t target = (uint64_t)deadline * NS_PER_TICK;
+    uint32_t count = 1;
+    if (target > now) {
+        uint64_t delta = target - now;
+        if (delta >= (uint64_t)NS_PER_TICK * 6) {    // 6个tick(60毫秒)已超出量程, 免得乘法溢出
+            count = PIT_COUNT_MAX;
+        } else {
+            delta = delta * INPUT_FREQUENCY;
+            div64_u32(&delta, 1000000000);
+            count = delta + 1 > PIT_COUNT_MAX ? PIT_COUNT_MAX : (uint32_t)delta + 1;    // 多计1下, 保证中断到来时已跨进deadline
+        }
+    }
+    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, count);
+}
+
+/* 时间轮: 第1级256个槽, 每槽1个tick; 第2至5级各64个槽, 每槽覆盖的ticks依次是上一级一整圈的长度.
+ * 定时器按距离到期的远近放入不同的级, 远处的定时器随时间推移逐级下放(cascade)到第1级, 添加、删除和每个tick的处理都是O(1)的 */
+#define TVR_BITS   8
+#define TVN_BITS   6
+#define TVR_SIZE   (1 << TVR_BITS)
+#define TVN_SIZE   (1 << TVN_BITS)
+#define TVR_MASK   (TVR_SIZE - 1)
+#define TVN_MASK   (TVN_SIZE - 1)
+#define TVN_CNT    4    // 第2至5级, 8 + 6 * 4 = 32, 正好覆盖整个32位的ticks
+
+static struct list tv1[TVR_SIZE];
+static struct list tvn[TVN_CNT][TVN_SIZE];
+static uint32_t timer_ticks;    // 时间轮下一个要处理的tick, 小于它的定时器都已到期处理过
+
+/* 第n级(n从0起, 对应第2级)中timer_ticks所在的槽 */
+#define TVN_INDEX(n) ((timer_ticks >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+/* 按到期时间把定时器t放入时间轮中合适的槽, 须关中断调用 */
+static void timer_enqueue(struct timer* t) {
+    uint32_t expires = t->expires;
+    uint32_t delta = expires - timer_ticks;
+    struct list* slot;
+    if ((int32_t)delta < 0) {    // 已经过期的放到下一个要处理的槽, 下个tick就执行
+        slot = &tv1[timer_ticks & TVR_MASK];
+    } else if (delta < TVR_SIZE) {
+        slot = &tv1[expires & TVR_MASK];
+    } else {
+        uint32_t n = 0;
+        while (n < TVN_CNT - 1 && delta >= (uint32_t)1 << (TVR_BITS + (n + 1) * TVN_BITS)) {
+            n++;
+        }
+        slot = &tvn[n][(expires >> (TVR_BITS + n * TVN_BITS)) & TVN_MASK];
+    }
+    list_append(slot, &t->timer_tag);
+}
+
+/* 把第n级第idx个槽中的定时器重新按到期时间放入时间轮(下放到更低的级), 返回idx */
+static uint32_t cascade(uint32_t n, uint32_t idx) {
+    struct list* slot = &tvn[n][idx];
+    while (!list_empty(slot)) {
+        struct timer* t = elem2entry(struct timer, timer_tag, list_pop(slot));
+        timer_enqueue(t);
+    }
+    return idx;
+}
+
+/* 处理截至当前ticks已到期的定时器, 在时钟软中断中调用
+ * 时间轮只在关中断时操作, 回调则在开中断时执行, 回调耗时再长也不会推迟时钟中断 */
+static void timer_run(void) {
+    struct list work_list;
+    enum intr_status old_status = intr_disable();
+    while ((int32_t)(ticks - timer_ticks) >= 0) {
+        uint32_t idx = timer_ticks & TVR_MASK;
+        // 第1级转完一圈, 就把上一级的下一个槽下放, 上一级也转完一圈时再继续往上
+        if (idx == 0) {
+            uint32_t n = 0;
+            while (n < TVN_CNT && cascade(n, TVN_INDEX(n)) == 0) {
+                n++;
+            }
+        }
+        timer_ticks++;
+        // 先把到期的定时器摘到work_list上再逐个执行, 回调中新加入的定时器不会被误当作本轮到期的
+        list_init(&work_list);
+        while (!list_empty(&tv1[idx])) {
+            list_append(&work_list, list_pop(&tv1[idx]));
+        }
+        while (!list_empty(&work_list)) {
+            struct timer* t = elem2entry(struct timer, timer_tag, list_pop(&work_list));
+            t->pending = false;
+            intr_set_status(old_status);
+            t->func(t->arg);
+            intr_disable();
+        }
+    }
+    intr_set_status(old_status);
+}
+
+/* 从下一个待处理的tick起最多看max个tick, 返回第一个有定时器到期的tick距当前tick的tick数, 都没有则返回max
+ * 第1级转完一圈时要下放上一级的定时器, 所以最远只看到第1级这一圈的结尾 */
+static uint32_t timer_next_delta(uint32_t max) {
+    uint32_t delta;
+    for (delta = 1; delta < max; delta++) {
+        uint32_t tick = ticks + delta;
+        if ((tick & TVR_MASK) == 0 || !list_empty(&tv1[tick & TVR_MASK])) {
+            break;
+        }
+    }
+    return delta;
+}
+
+/* 设定下一次时钟中断: 有任务要按时间片调度时定在下个tick, 只剩idle时定在下一个定时器到期时 */
+static void clock_program_next(bool idle) {
+    if (!clock_oneshot) {
+        return;
+    }
+    uint32_t delta = idle ? timer_next_delta(PIT_COUNT_MAX / (INPUT_FREQUENCY / IRQ0_FREQUENCY) + 1) : 1;
+    clock_arm(ticks + delta);
+}
 
-    /* 若间隔的ticks数不够便让出cpu */
-    while (ticks - start_tick < sleep_ticks) {
-        thread_yield();
+/* 离开idle时由schedule调用: idle期间时钟中断可能被推迟到了很久以后, 要恢复按tick发中断, 以便给任务计时间片
+ * PIT只向BSP发中断, AP用各自的本地APIC定时器计时间片, 它们空闲时定时器是停掉的 */
+void timer_resume_tick(void) {
+    if (this_cpu()->id == 0) {
+        clock_program_next(false);
+    } else {
+        lapic_timer_enable(true);
     }
 }
 
+/* 初始化定时器t, 到期时调用func(arg) */
+void timer_setup(struct timer* t, void (*func)(void*), void* arg) {
+    t->func = func;
+    t->arg = arg;
+    t->pending = false;
+}
+
+/* 让定时器t在ticks到达expires时到期, t已在等待中则改为新的到期时间 */
+void timer_add(struct timer* t, uint32_t expires) {
+    enum intr_status old_status = intr_disable();
+    if (t->pending) {
+        list_remove(&t->timer_tag);
+    }
+    t->expires = expires;
+    t->pending = true;
+    timer_enqueue(t);
+    intr_set_status(old_status);
+}
+
+/* 取消定时器t, t尚未到期返回true, 否则返回false */
+bool timer_del(struct timer* t) {
+    enum intr_status old_status = intr_disable();
+    bool pending = t->pending;
+    if (pending) {
+        list_remove(&t->timer_tag);
+        t->pending = false;
+    }
+    intr_set_status(old_status);
+    return pending;
+}
+
+/* 是否可以把下次时钟中断推迟到下一个定时器到期时: 只剩idle可运行时才行
+ * 有多个处理器时, 别的处理器随时可能加入更早到期的定时器, 仍按tick发中断 */
+static bool clock_idle(void) {
+    return running_thread() == this_cpu()->idle && thread_ready_empty() && cpu_cnt == 1;
+}
+
+/* 时钟的中断处理程序: 只推进ticks、设定下次中断和计时间片, 到期定时器留给时钟软中断处理 */
+static void intr_timer_handler(void){
+    // 单次定时时两次中断之间可能隔了多个tick, 以单调时钟为准算出经过的tick数
+    uint32_t elapsed = clock_oneshot ? clock_ticks() - ticks : 1;
+    ticks += elapsed;
+    raise_softirq(SOFTIRQ_TIMER);
+    clock_program_next(clock_idle());
+    thread_tick(elapsed);
+}
+
+/* 时钟软中断: 执行到期的定时器 */
+static void timer_softirq(void) {
+    timer_run();
+    // 回调可能加入了更早到期的定时器, 下次中断已被推迟时要按新的到期时间重设
+    enum intr_status old_status = intr_disable();
+    if (clock_idle()) {
+        clock_program_next(true);
+    }
+    intr_set_status(old_status);
+}
+
+/* sleep定时器的回调: 唤醒睡眠的线程 */
+static void sleep_timeout(void* arg) {
+    thread_unblock((struct task_struct*)arg);
+}
+
+/* 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式 */
+static void ticks_to_sleep(uint32_t sleep_ticks) {
+    struct timer sleep_timer;
+    timer_setup(&sleep_timer, sleep_timeout, running_thread());
+    // 要在关中断的状态下加入定时器并阻塞, 以免定时器在阻塞之前就到期而错过唤醒
+    enum intr_status old_status = intr_disable();
+    timer_add(&sleep_timer, ticks + sleep_ticks);
+    thread_block(TASK_BLOCKED);
+    // 被定时器以外的原因唤醒时定时器还在时间轮中, 它在本函数的栈上, 返回前必须取下
+    timer_del(&sleep_timer);
+    intr_set_status(old_status);
+}
+
 /* 以毫秒为单位的sleep   1秒= 1000毫秒 */
 void mtime_sleep(uint32_t m_seconds) {
     uint32_t sleep_ticks = DIV_ROUND_UP(m_seconds, mil_seconds_per_intr);
@@ -62,11 +321,58 @@ void mtime_sleep(uint32_t m_seconds) {
     ticks_to_sleep(sleep_ticks);
 }
 
+/* 睡眠req指定的时间, 成功返回0, 参数非法返回-1; 睡眠不会被提前打断, rem不为NULL时剩余时间总是填0
+ * 时间轮按有符号差值判断是否到期, 睡眠的ticks数不能达到2^31, 即最长约248天 */
+int32_t sys_nanosleep(const struct timespec* req, struct timespec* rem) {
+    if (req == NULL || req->tv_nsec >= 1000000000 || req->tv_sec > (SLEEP_TICKS_MAX - IRQ0_FREQUENCY) / IRQ0_FREQUENCY) {
+        return -1;
+    }
+    uint32_t ns_per_tick = mil_seconds_per_intr * 1000000;
+    uint32_t sleep_ticks = req->tv_sec * IRQ0_FREQUENCY + DIV_ROUND_UP(req->tv_nsec, ns_per_tick);
+    if (sleep_ticks > 0) {
+        ticks_to_sleep(sleep_ticks);
+    }
+    if (rem != NULL) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    return 0;
+}
+
+/* 读取时钟clock_id的当前时间到tp, 目前只支持单调时钟, 成功返回0, 失败返回-1 */
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp) {
+    if (clock_id != CLOCK_MONOTONIC || tp == NULL) {
+        return -1;
+    }
+    uint64_t ns = clock_ns();
+    tp->tv_nsec = div64_u32(&ns, 1000000000);
+    tp->tv_sec = (uint32_t)ns;
+    return 0;
+}
+
 /* 初始化PIT8253 */
 void timer_init() {
     put_str("timer_init start\n");
-    /* 设置8253的定时周期,也就是发中断的周期 */
-    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+    tsc_calibrate();
+    if (tsc_khz != 0) {
+        // 有TSC作为时间基准, 计数器0改为单次定时, 每次中断时按需设定下一次
+        clock_oneshot = true;
+        clock_arm(ticks + 1);
+    } else {
+        /* 设置8253的定时周期,也就是发中断的周期 */
+        frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+    }
+    uint32_t idx, n;
+    for (idx = 0; idx < TVR_SIZE; idx++) {
+        list_init(&tv1[idx]);
+    }
+    for (n = 0; n < TVN_CNT; n++) {
+        for (idx = 0; idx < TVN_SIZE; idx++) {
+            list_init(&tvn[n][idx]);
+        }
+    }
+    timer_ticks = ticks;
+    open_softirq(SOFTIRQ_TIMER, timer_softirq);
     // 注册时钟中断处理程序
     register_handler(0x20, intr_timer_handler);
     put_str("timer_init done\n");
@@ -1,7 +1,34 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "stdint.h"
+#include "global.h"
+#include "list.h"
+
+/* 内核定时器: 在ticks到达expires时, 由时钟中断处理程序以关中断的状态调用func(arg) */
+struct timer {
+    struct list_elem timer_tag;    // 用于加入时间轮的槽
+    uint32_t expires;              // 到期时的ticks
+    void (*func)(void* arg);       // 到期时调用的回调函数, 运行在中断上下文, 不能阻塞
+    void* arg;
+    bool pending;                  // 是否已加入时间轮且尚未到期
+};
+
+#define CLOCK_MONOTONIC 1    // 单调时钟: 自开机起流逝的时间, 不受校时影响
+
+/* nanosleep和clock_gettime的时间参数 */
+struct timespec {
+    uint32_t tv_sec;     // 秒
+    uint32_t tv_nsec;    // 纳秒, 须小于10亿
+};
+
+extern uint32_t ticks;
 void timer_init(void);
+void timer_setup(struct timer* t, void (*func)(void*), void* arg);
+void timer_add(struct timer* t, uint32_t expires);
+bool timer_del(struct timer* t);
+void timer_resume_tick(void);
+uint64_t clock_ns(void);
 void mtime_sleep(uint32_t m_seconds);
+int32_t sys_nanosleep(const struct timespec* req, struct timespec* rem);
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp);
 #endif
-
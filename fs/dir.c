@@ -10,8 +10,10 @@
 #include "string.h"
 #include "interrupt.h"
 #include "super_block.h"
+#include "slab.h"
 
 struct dir root_dir;    // 分区的根目录
+struct kmem_cache* dir_cache;    // 已打开目录的对象缓存, struct dir含512字节的dir_buf, 用sys_malloc会落入1024字节的规格
 
 /* 打开分区part的根目录 */
 void open_root_dir(struct partition* part) {
@@ -21,7 +23,7 @@ void open_root_dir(struct partition* part) {
 
 /* 在分区part上打开编号为inode_no的的目录文件并返回目录指针*/
 struct dir* dir_open(struct partition* part, uint32_t inode_no){
-    struct dir* pdir = (struct dir*)sys_malloc(sizeof(struct dir));
+    struct dir* pdir = (struct dir*)kmem_cache_alloc(dir_cache);
     pdir->inode = inode_open(part, inode_no);
     pdir->dir_pos = 0;
     return pdir;
@@ -95,7 +97,7 @@ void dir_close(struct dir* dir){
         return;
     }
     inode_close(dir->inode);
-    sys_free(dir);
+    kmem_cache_free(dir_cache, dir);
 }
 
 /* 在内存中初始化目录项p_de */
@@ -10,6 +10,8 @@
 #include "thread.h"
 #include "global.h"
 #include "ioqueue.h"
+#include "slab.h"
+#include "mmap.h"
 
 #define DEFAULT_SECS 1
 
@@ -112,11 +114,11 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
       return -1;
    }
 
-/* 此inode要从堆中申请内存,不可生成局部变量(函数退出时会释放)
- * 因为file_table数组中的文件描述符的inode指针要指向它.*/
-   struct inode* new_file_inode = (struct inode*)sys_malloc(sizeof(struct inode)); 
+/* 此inode要从inode_cache中申请内存,不可生成局部变量(函数退出时会释放)
+ * 因为file_table数组中的文件描述符的inode指针要指向它, 且它会加入所有任务共享的open_inodes链表.*/
+   struct inode* new_file_inode = (struct inode*)kmem_cache_alloc(inode_cache); 
    if (new_file_inode == NULL) {
-      printk("file_create: sys_malloc for inode failded\n");
+      printk("file_create: kmem_cache_alloc for inode failded\n");
       rollback_step = 1;
       goto rollback;
    }
@@ -173,7 +175,7 @@ rollback:
 	 /* 失败时,将file_table中的相应位清空 */
 	 memset(&file_table[fd_idx], 0, sizeof(struct file)); 
       case 2:
-	 sys_free(new_file_inode);
+	 kmem_cache_free(inode_cache, new_file_inode);
       case 1:
 	 /* 如果新文件的i结点创建失败,之前位图中分配的inode_no也要恢复 */
 	 bitmap_set(&cur_part->inode_bitmap, inode_no, 0);
@@ -396,11 +398,15 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
       /* 判断此次写入硬盘的数据大小 */
       chunk_size = size_left < sec_left_bytes ? size_left : sec_left_bytes;
       if (first_write_block) {
-	 ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
+	 /* 该扇区若在页缓存中, 缓存里可能有经文件映射写入但尚未写回的数据, 以缓存为准 */
+	 if (!page_cache_read(file->fd_inode, sec_idx * BLOCK_SIZE, io_buf, BLOCK_SIZE)) {
+	    ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
+	 }
 	 first_write_block = false;
       }
       memcpy(io_buf + sec_off_bytes, src, chunk_size);
       ide_write(cur_part->my_disk, sec_lba, io_buf, 1);
+      page_cache_write(file->fd_inode, file->fd_inode->i_size, src, chunk_size);   // 映射了该文件的进程也要看到新数据
 
       src += chunk_size;   // 将指针推移到下个新数据
       file->fd_inode->i_size += chunk_size;  // 更新文件大小
@@ -496,7 +502,10 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
       chunk_size = size_left < sec_left_bytes ? size_left : sec_left_bytes;	     // 待读入的数据大小
 
       memset(io_buf, 0, BLOCK_SIZE);
-      ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
+      /* 页缓存中的数据比硬盘上的新, 命中时不必读硬盘 */
+      if (!page_cache_read(file->fd_inode, sec_idx * BLOCK_SIZE, io_buf, BLOCK_SIZE)) {
+	 ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
+      }
       memcpy(buf_dst, io_buf + sec_off_bytes, chunk_size);
 
       buf_dst += chunk_size;
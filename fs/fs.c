@@ -15,6 +15,8 @@
 #include "keyboard.h"
 #include "ioqueue.h"
 #include "pipe.h"
+#include "slab.h"
+#include "mmap.h"
 
 struct partition* cur_part;	 // 默认情况下操作的是哪个分区
 
@@ -849,13 +851,21 @@ void sys_putchar(char char_asci) {
 
 /* 显示系统支持的内部命令 */
 void sys_help(void) {
-    printk("buildin commands:\n ls: show directory or file information\n cd: change current work directory\n mkdir: create a directory\n rmdir: remove a empty directory\n rm: remove a regular file\n pwd: show current work directory\n ps: show process information\n clear: clear screen\n shortcut key:\n ctrl+l: clear screen\n ctrl+u: clear input\n");
+    printk("buildin commands:\n ls: show directory or file information\n cd: change current work directory\n mkdir: create a directory\n rmdir: remove a empty directory\n rm: remove a regular file\n pwd: show current work directory\n ps: show process information\n meminfo: show memory usage\n clear: clear screen\n shortcut key:\n ctrl+l: clear screen\n ctrl+u: clear input\n");
 }
 
 /* 文件系统初始化函数：在磁盘上搜索文件系统, 若没有则格式化分区创建文件系统 */
 void filesys_init(){
     uint8_t channel_no = 0, dev_no = 0, part_idx = 0;
 
+    /* 创建inode和目录的对象缓存, 挂载分区时打开根目录就要用到 */
+    inode_cache = kmem_cache_create("inode", sizeof(struct inode), NULL);
+    dir_cache = kmem_cache_create("dir", sizeof(struct dir), NULL);
+    if (inode_cache == NULL || dir_cache == NULL) {
+        PANIC("create kmem_cache failed!");
+    }
+    mmap_init();
+
     /* sb_buf用来存储从硬盘上读入的超级块 */
     struct super_block* sb_buf = (struct super_block*)sys_malloc(SECTOR_SIZE);
 
@@ -883,7 +893,7 @@ void filesys_init(){
 
                 // channels数组是全局变量, 默认值为0, disk属于其嵌套结构, partition又为disk的嵌套结构,partition中的成员默认也为0
                 // 若partition未初始化, 则partition中的成员仍为0
-                if(part->sec_cnt != 0) {    // 如果分区存在
+                if(part->sec_cnt != 0 && part->fs_type != PART_TYPE_SWAP) {    // 如果分区存在, 交换分区不建文件系统
                     memset(sb_buf, 0, SECTOR_SIZE);
                     // 读出分区的超级块, 根据魔数是否正确来判断是否存在文件系统
                     ide_read(hd, part->start_lba + 1, sb_buf, 1);
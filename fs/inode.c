@@ -9,6 +9,10 @@
 #include "stdio-kernel.h"
 #include "string.h"
 #include "super_block.h"
+#include "slab.h"
+#include "mmap.h"
+
+struct kmem_cache* inode_cache;    // 内存中inode的对象缓存, 所有任务共享
 
 /* 用于存储(定位)inode位置 */
 struct inode_position {
@@ -89,15 +93,8 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no){
     struct inode_position inode_pos;
     inode_locate(part, inode_no, &inode_pos); // 将inode位置信息存入inode_pos中
 
-    /* 为使通过sys_malloc创建的新inode被所有任务共享, 需将inode至于内核空间, 故需要临时将cur_pcb->pgdir置为NULL */
-    struct task_struct* cur = running_thread();
-    uint32_t * cur_pagedir_bak = cur->pgdir;  // 将当前任务(无论进程还是线程统一处理, 不再进行额外判断)的页目录表地址备份到变量cur_pagedir_bak中
-    cur->pgdir  = NULL;
-
-    // 上面三行代码完成后, 下面分配的内存将位于"内核区"
-    inode_found = (struct inode*)sys_malloc(sizeof(struct inode));
-    // 恢复pgdir
-    cur->pgdir = cur_pagedir_bak;
+    // 新inode要被所有任务共享, inode_cache的对象都位于内核空间, 无需再临时切换pgdir
+    inode_found = (struct inode*)kmem_cache_alloc(inode_cache);
 
     char* inode_buf;
     if(inode_pos.two_sec){    // 考虑跨扇区的情况
@@ -124,12 +121,12 @@ void inode_close(struct inode* inode){
     enum intr_status old_status = intr_disable();
     if(--inode->i_open_cnts == 0){
         list_remove(&inode->inode_tag);  // 将i节点从part->open_inodes列表中去掉
-        // inode_open时为实现inode被所有进程共享,已经在sys_malloc为inode分配了内核空间,释放inode时也要确保释放的是内核内存池
-        struct task_struct* cur = running_thread();
-        uint32_t* cur_pagedir_bak = cur->pgdir;
-        cur->pgdir = NULL;
-        sys_free(inode);
-        cur->pgdir = cur_pagedir_bak;
+        intr_set_status(old_status);
+        // 先摘链再释放缓存页: page_cache_release要拿cache_lock, 可能睡眠, 不能在关中断时做,
+        // 摘链后inode_open已找不到这个inode, 不会再有人把计数加回来
+        page_cache_release(inode);    // 映射区持有打开计数, 走到这里时文件的缓存页都已没有映射者
+        kmem_cache_free(inode_cache, inode);
+        return;
     }
     intr_set_status(old_status);
 }
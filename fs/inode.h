@@ -16,6 +16,7 @@ struct inode {
     struct list_elem inode_tag;  // 此inode的一个标志, 用于加入内存缓存中的“已打开inode队列”,避免下次打开同一文件时重复从较慢的磁盘中载入inode
 };
 
+extern struct kmem_cache* inode_cache;
 struct inode* inode_open(struct partition* part, uint32_t inode_no);
 void inode_sync(struct partition* part, struct inode* inode, void* io_buf);
 void inode_init(uint32_t inode_no, struct inode* new_inode);
@@ -0,0 +1,367 @@
+#include "mmap.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "memory.h"
+#include "slab.h"
+#include "string.h"
+#include "sync.h"
+#include "thread.h"
+#include "inode.h"
+#include "file.h"
+#include "fs.h"
+#include "pipe.h"
+#include "ide.h"
+#include "super_block.h"
+
+#define BLOCKS_PER_PAGE (PG_SIZE / BLOCK_SIZE)    // 一页容纳的块数
+#define PAGE_HASH_CNT   64                        // 页缓存散列表的桶数
+
+/* 页缓存中的一页: 文件inode的第pg_idx页, 页框来自内核内存池, 通过直接映射区访问
+ * 页缓存持有页框本身, 每个把它映射进用户空间的页表项使页框的共享计数加1 */
+struct cache_page {
+    struct list_elem hash_tag;    // 用于加入page_hash的桶
+    struct inode* inode;
+    uint32_t pg_idx;
+    void* vaddr;                  // 页框在直接映射区中的虚拟地址
+};
+
+/* 页缓存以(inode, 页号)散列, 不在struct inode中加链表是因为struct inode会原样写入硬盘 */
+static struct list page_hash[PAGE_HASH_CNT];
+static uint32_t cached_pages;                 // 页缓存中的页数, 为0时关闭inode不必扫描散列表
+static struct lock cache_lock;                // 页缓存和文件映射区的读写互斥
+static uint32_t indirect_buf[BLOCK_SIZE / 4]; // 读一级间接块表用, 受cache_lock保护
+static struct kmem_cache* cache_page_cache;
+static struct kmem_cache* mmap_area_cache;
+
+/* 初始化页缓存和文件映射 */
+void mmap_init(void) {
+    uint32_t idx;
+    for (idx = 0; idx < PAGE_HASH_CNT; idx++) {
+        list_init(&page_hash[idx]);
+    }
+    cached_pages = 0;
+    lock_init(&cache_lock);
+    cache_page_cache = kmem_cache_create("cache_page", sizeof(struct cache_page), NULL);
+    mmap_area_cache = kmem_cache_create("mmap_area", sizeof(struct mmap_area), NULL);
+    if (cache_page_cache == NULL || mmap_area_cache == NULL) {
+        PANIC("mmap_init: create kmem_cache failed!");
+    }
+}
+
+/* 返回(inode, pg_idx)所在的散列桶 */
+static struct list* page_hash_bucket(struct inode* inode, uint32_t pg_idx) {
+    return &page_hash[(((uint32_t)inode >> 4) + pg_idx) % PAGE_HASH_CNT];
+}
+
+/* 在页缓存中查找inode的第pg_idx页, 没有则返回NULL, 调用者须持有cache_lock */
+static struct cache_page* page_cache_find(struct inode* inode, uint32_t pg_idx) {
+    struct list* bucket = page_hash_bucket(inode, pg_idx);
+    struct list_elem* elem = bucket->head.next;
+    while (elem != &bucket->tail) {
+        struct cache_page* cp = elem2entry(struct cache_page, hash_tag, elem);
+        if (cp->inode == inode && cp->pg_idx == pg_idx) {
+            return cp;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+/* 返回inode第blk_idx块的扇区地址, 用到间接块时先把间接块表读进indirect_buf, 调用者须持有cache_lock
+ * indirect_loaded记录indirect_buf中是否已是本inode的间接块表, 免得一页之内重复读 */
+static uint32_t block_lba(struct inode* inode, uint32_t blk_idx, bool* indirect_loaded) {
+    if (blk_idx < 12) {
+        return inode->i_blocks[blk_idx];
+    }
+    ASSERT(inode->i_blocks[12] != 0);
+    if (!*indirect_loaded) {
+        ide_read(cur_part->my_disk, inode->i_blocks[12], indirect_buf, 1);
+        *indirect_loaded = true;
+    }
+    return indirect_buf[blk_idx - 12];
+}
+
+/* 在页缓存页cp与硬盘之间传送文件大小以内的块, write为true时写硬盘, 否则读硬盘
+ * 扇区地址连续的块合并成一次ide操作, 调用者须持有cache_lock */
+static void cache_page_io(struct cache_page* cp, bool write) {
+    bool indirect_loaded = false;
+    uint32_t blk_start = cp->pg_idx * BLOCKS_PER_PAGE;
+    uint32_t blk_end = DIV_ROUND_UP(cp->inode->i_size, BLOCK_SIZE);
+    if (blk_end > blk_start + BLOCKS_PER_PAGE) {
+        blk_end = blk_start + BLOCKS_PER_PAGE;
+    }
+    uint32_t blk_idx = blk_start;
+    while (blk_idx < blk_end) {
+        uint32_t lba = block_lba(cp->inode, blk_idx, &indirect_loaded);
+        uint32_t sec_cnt = 1;
+        while (blk_idx + sec_cnt < blk_end && block_lba(cp->inode, blk_idx + sec_cnt, &indirect_loaded) == lba + sec_cnt) {
+            sec_cnt++;
+        }
+        void* buf = (uint8_t*)cp->vaddr + (blk_idx - blk_start) * BLOCK_SIZE;
+        if (write) {
+            ide_write(cur_part->my_disk, lba, buf, sec_cnt);
+        } else {
+            ide_read(cur_part->my_disk, lba, buf, sec_cnt);
+        }
+        blk_idx += sec_cnt;
+    }
+}
+
+/* 返回inode第pg_idx页的页缓存, 不在缓存中时从硬盘读入, 文件末尾之后的部分为0, 失败返回NULL, 调用者须持有cache_lock */
+static struct cache_page* page_cache_get(struct inode* inode, uint32_t pg_idx) {
+    struct cache_page* cp = page_cache_find(inode, pg_idx);
+    if (cp != NULL) {
+        return cp;
+    }
+    cp = kmem_cache_alloc(cache_page_cache);
+    if (cp == NULL) {
+        return NULL;
+    }
+    cp->vaddr = get_kernel_pages(1);    // 已清0
+    if (cp->vaddr == NULL) {
+        kmem_cache_free(cache_page_cache, cp);
+        return NULL;
+    }
+    cp->inode = inode;
+    cp->pg_idx = pg_idx;
+    cache_page_io(cp, false);
+    list_push(page_hash_bucket(inode, pg_idx), &cp->hash_tag);
+    cached_pages++;
+    return cp;
+}
+
+/* 若文件inode中[pos, pos + count)所在的页在页缓存中, 就从缓存复制到buf并返回true, 否则返回false
+ * 该区间不能跨页, file_read按扇区读, 扇区不会跨页 */
+bool page_cache_read(struct inode* inode, uint32_t pos, void* buf, uint32_t count) {
+    ASSERT(pos / PG_SIZE == (pos + count - 1) / PG_SIZE);
+    if (cached_pages == 0) {
+        return false;
+    }
+    lock_acquire(&cache_lock);
+    struct cache_page* cp = page_cache_find(inode, pos / PG_SIZE);
+    if (cp != NULL) {
+        memcpy(buf, (uint8_t*)cp->vaddr + pos % PG_SIZE, count);
+    }
+    lock_release(&cache_lock);
+    return cp != NULL;
+}
+
+/* file_write写硬盘的同时调用: 把写入文件[pos, pos + count)的数据同样写进缓存中的页, 使映射了文件的进程看到新内容 */
+void page_cache_write(struct inode* inode, uint32_t pos, const void* buf, uint32_t count) {
+    if (cached_pages == 0) {
+        return;
+    }
+    lock_acquire(&cache_lock);
+    const uint8_t* src = buf;
+    while (count > 0) {
+        uint32_t chunk = PG_SIZE - pos % PG_SIZE;
+        if (chunk > count) {
+            chunk = count;
+        }
+        struct cache_page* cp = page_cache_find(inode, pos / PG_SIZE);
+        if (cp != NULL) {
+            memcpy((uint8_t*)cp->vaddr + pos % PG_SIZE, src, chunk);
+        }
+        src += chunk;
+        pos += chunk;
+        count -= chunk;
+    }
+    lock_release(&cache_lock);
+}
+
+/* inode最后一次关闭时调用: 丢弃它在页缓存中的所有页. 此时已没有映射区(映射区持有inode的打开计数), 页都已写回 */
+void page_cache_release(struct inode* inode) {
+    if (cached_pages == 0) {
+        return;
+    }
+    lock_acquire(&cache_lock);
+    uint32_t idx;
+    for (idx = 0; idx < PAGE_HASH_CNT; idx++) {
+        struct list_elem* elem = page_hash[idx].head.next;
+        while (elem != &page_hash[idx].tail) {
+            struct cache_page* cp = elem2entry(struct cache_page, hash_tag, elem);
+            elem = elem->next;
+            if (cp->inode == inode) {
+                list_remove(&cp->hash_tag);
+                free_kernel_pages(cp->vaddr, 1);
+                kmem_cache_free(cache_page_cache, cp);
+                cached_pages--;
+            }
+        }
+    }
+    lock_release(&cache_lock);
+}
+
+/* 在当前进程中找到包含vaddr的映射区, 没有则返回NULL */
+static struct mmap_area* mmap_area_find(uint32_t vaddr) {
+    struct list* mmap_list = &running_thread()->mmap_list;
+    struct list_elem* elem = mmap_list->head.next;
+    while (elem != &mmap_list->tail) {
+        struct mmap_area* area = elem2entry(struct mmap_area, area_tag, elem);
+        if (vaddr >= area->vaddr_start && vaddr < area->vaddr_start + area->pg_cnt * PG_SIZE) {
+            return area;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+/* 把映射区area中[vaddr_start, vaddr_end)内被写过的页写回文件, 调用者须持有cache_lock */
+static void mmap_area_sync(struct mmap_area* area, uint32_t vaddr_start, uint32_t vaddr_end) {
+    uint32_t vaddr;
+    for (vaddr = vaddr_start; vaddr < vaddr_end; vaddr += PG_SIZE) {
+        if (!page_test_clear_dirty(vaddr)) {
+            continue;
+        }
+        uint32_t pg_idx = area->pg_offset + (vaddr - area->vaddr_start) / PG_SIZE;
+        struct cache_page* cp = page_cache_find(area->inode, pg_idx);
+        ASSERT(cp != NULL);    // 映射着的页一定在缓存中
+        cache_page_io(cp, true);
+    }
+}
+
+/* 把当前进程已打开的文件fd从offset(须按页对齐)起的length字节映射到用户空间, 返回映射区的起始地址, 失败返回NULL
+ * 映射区内的页在第一次访问时才从页缓存中映射进来, 多个进程映射同一文件时共享同一份页框
+ * 只能映射文件已有的内容, 不能借映射区扩大文件; 以只读方式打开的文件映射为只读 */
+void* sys_mmap(int32_t fd, uint32_t offset, uint32_t length) {
+    struct task_struct* cur = running_thread();
+    if (cur->pgdir == NULL || fd <= stderr_no || fd >= MAX_FILES_OPEN_PER_PROC || cur->fd_table[fd] == -1 || is_pipe(fd)) {
+        return NULL;
+    }
+    struct file* file = &file_table[fd_local2global(fd)];
+    if (length == 0 || offset % PG_SIZE != 0 || offset >= file->fd_inode->i_size) {
+        return NULL;
+    }
+    if (length > file->fd_inode->i_size - offset) {
+        length = file->fd_inode->i_size - offset;
+    }
+    uint32_t pg_cnt = DIV_ROUND_UP(length, PG_SIZE);
+
+    struct mmap_area* area = kmem_cache_alloc(mmap_area_cache);
+    if (area == NULL) {
+        return NULL;
+    }
+    void* vaddr = get_user_pages(pg_cnt);    // 只占下虚拟地址, 缺页时由mmap_fault映射
+    if (vaddr == NULL) {
+        kmem_cache_free(mmap_area_cache, area);
+        return NULL;
+    }
+    area->vaddr_start = (uint32_t)vaddr;
+    area->pg_cnt = pg_cnt;
+    area->inode = inode_open(cur_part, file->fd_inode->i_no);    // 文件关闭后映射区仍然有效
+    area->pg_offset = offset / PG_SIZE;
+    area->writable = (file->fd_flag & (O_WRONLY | O_RDWR)) != 0;
+    lock_acquire(&cache_lock);
+    list_append(&cur->mmap_list, &area->area_tag);
+    lock_release(&cache_lock);
+    return vaddr;
+}
+
+/* 解除映射区area: 写回被写过的页, 解除页表映射并释放虚拟地址, 最后关闭inode, 调用者须持有cache_lock */
+static void mmap_area_unmap(struct mmap_area* area) {
+    mmap_area_sync(area, area->vaddr_start, area->vaddr_start + area->pg_cnt * PG_SIZE);
+    list_remove(&area->area_tag);
+    free_user_pages((void*)area->vaddr_start, area->pg_cnt);
+    inode_close(area->inode);
+    kmem_cache_free(mmap_area_cache, area);
+}
+
+/* 解除sys_mmap返回的以addr起始的整个映射区, 成功返回0, 失败返回-1 */
+int32_t sys_munmap(void* addr) {
+    lock_acquire(&cache_lock);
+    struct mmap_area* area = mmap_area_find((uint32_t)addr);
+    if (area == NULL || area->vaddr_start != (uint32_t)addr) {
+        lock_release(&cache_lock);
+        return -1;
+    }
+    mmap_area_unmap(area);
+    lock_release(&cache_lock);
+    return 0;
+}
+
+/* 把addr所在映射区中[addr, addr + length)内被写过的页写回文件, 成功返回0, 失败返回-1 */
+int32_t sys_msync(void* addr, uint32_t length) {
+    lock_acquire(&cache_lock);
+    struct mmap_area* area = mmap_area_find((uint32_t)addr);
+    if (area == NULL) {
+        lock_release(&cache_lock);
+        return -1;
+    }
+    uint32_t area_end = area->vaddr_start + area->pg_cnt * PG_SIZE;
+    uint32_t vaddr_end = (uint32_t)addr + length;
+    if (vaddr_end > area_end || vaddr_end < (uint32_t)addr) {
+        vaddr_end = area_end;
+    }
+    mmap_area_sync(area, (uint32_t)addr & 0xfffff000, vaddr_end);
+    lock_release(&cache_lock);
+    return 0;
+}
+
+/* 缺页处理程序调用: 若vaddr_page落在当前进程的映射区中, 就把页缓存中相应的页映射进来
+ * 返回1表示已映射, 0表示不是映射区中的地址, -1表示是映射区中的地址但内存不足 */
+int32_t mmap_fault(uint32_t vaddr_page) {
+    struct task_struct* cur = running_thread();
+    if (list_empty(&cur->mmap_list)) {
+        return 0;
+    }
+    lock_acquire(&cache_lock);
+    struct mmap_area* area = mmap_area_find(vaddr_page);
+    if (area == NULL) {
+        lock_release(&cache_lock);
+        return 0;
+    }
+    uint32_t pg_idx = area->pg_offset + (vaddr_page - area->vaddr_start) / PG_SIZE;
+    struct cache_page* cp = page_cache_get(area->inode, pg_idx);
+    if (cp == NULL) {
+        lock_release(&cache_lock);
+        return -1;
+    }
+    page_map_shared(vaddr_page, addr_v2p((uint32_t)cp->vaddr), area->writable);
+    lock_release(&cache_lock);
+    return 1;
+}
+
+/* fork时调用: 子进程的pcb是父进程的副本, 为它复制一份映射区链表, 已映射的页由copy_page_tables_cow共享给子进程
+ * 成功返回0, 内存不足返回-1 */
+int32_t mmap_fork(struct task_struct* child) {
+    struct task_struct* parent = running_thread();
+    list_init(&child->mmap_list);
+    lock_acquire(&cache_lock);
+    struct list_elem* elem = parent->mmap_list.head.next;
+    while (elem != &parent->mmap_list.tail) {
+        struct mmap_area* area = elem2entry(struct mmap_area, area_tag, elem);
+        struct mmap_area* child_area = kmem_cache_alloc(mmap_area_cache);
+        if (child_area == NULL) {
+            lock_release(&cache_lock);
+            return -1;
+        }
+        memcpy(child_area, area, sizeof(struct mmap_area));
+        area->inode->i_open_cnts++;
+        list_append(&child->mmap_list, &child_area->area_tag);
+        elem = elem->next;
+    }
+    lock_release(&cache_lock);
+    return 0;
+}
+
+/* fork失败时调用: 释放mmap_fork为子进程复制的映射区记录(可能只复制了一部分), 页表项由调用者另行撤销 */
+void mmap_fork_abort(struct task_struct* child) {
+    lock_acquire(&cache_lock);
+    while (!list_empty(&child->mmap_list)) {
+        struct mmap_area* area = elem2entry(struct mmap_area, area_tag, list_pop(&child->mmap_list));
+        inode_close(area->inode);
+        kmem_cache_free(mmap_area_cache, area);
+    }
+    lock_release(&cache_lock);
+}
+
+/* 进程退出或exec时调用: 写回并解除当前进程所有的映射区 */
+void mmap_release(void) {
+    struct task_struct* cur = running_thread();
+    lock_acquire(&cache_lock);
+    while (!list_empty(&cur->mmap_list)) {
+        mmap_area_unmap(elem2entry(struct mmap_area, area_tag, cur->mmap_list.head.next));
+    }
+    lock_release(&cache_lock);
+}
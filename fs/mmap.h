@@ -0,0 +1,30 @@
+#ifndef __FS_MMAP_H
+#define __FS_MMAP_H
+#include "stdint.h"
+#include "list.h"
+#include "inode.h"
+
+struct task_struct;
+
+/* 进程地址空间中的一段文件映射区 */
+struct mmap_area {
+    struct list_elem area_tag;    // 用于加入进程的mmap_list
+    uint32_t vaddr_start;         // 起始虚拟地址
+    uint32_t pg_cnt;              // 页数
+    struct inode* inode;          // 被映射的文件, 映射期间持有它的一次打开计数
+    uint32_t pg_offset;           // 映射区第一页对应文件中的第几页
+    bool writable;                // 以可写方式打开的文件才能写映射区
+};
+
+void mmap_init(void);
+void* sys_mmap(int32_t fd, uint32_t offset, uint32_t length);
+int32_t sys_munmap(void* addr);
+int32_t sys_msync(void* addr, uint32_t length);
+int32_t mmap_fault(uint32_t vaddr_page);
+int32_t mmap_fork(struct task_struct* child);
+void mmap_fork_abort(struct task_struct* child);
+void mmap_release(void);
+bool page_cache_read(struct inode* inode, uint32_t pos, void* buf, uint32_t count);
+void page_cache_write(struct inode* inode, uint32_t pos, const void* buf, uint32_t count);
+void page_cache_release(struct inode* inode);
+#endif
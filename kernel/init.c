@@ -10,6 +10,9 @@
 #include "syscall-init.h"
 #include "ide.h"
 #include "fs.h"
+#include "shm.h"
+#include "smp.h"
+#include "workqueue.h"
 
 /*负责初始化所有模块 */
 void init_all() {
@@ -22,7 +25,11 @@ void init_all() {
    keyboard_init();  // 键盘初始化
    tss_init();       // tss初始化
    syscall_init();   // 初始化系统调用
+   shm_init();       // 初始化共享内存
+   workqueue_init(); // 创建默认工作队列的工作线程
    intr_enable();    // 后面的ide_init需要打开中断
    ide_init();	     // 初始化硬盘
    filesys_init();   // 初始化文件系统
+   swap_init();      // 启用交换分区, 要在ide_init扫描出分区之后
+   smp_init();       // 启动其余处理器, 放在最后是因为要用到单调时钟计时, 且其余各模块都已就绪
 }
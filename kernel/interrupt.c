@@ -182,6 +182,12 @@ enum intr_status intr_get_status(){
     // 判断当前Eflags寄存器状态的IF位是否为1
     return (EFLAGS_IF & eflags)? INTR_ON : INTR_OFF;
 }
+/* 加载idt, 各处理器共用同一张idt, AP启动时也要加载 */
+void idt_load(void) {
+   uint64_t idt_operand = ((sizeof(idt) - 1) | ((uint64_t)(uint32_t)idt << 16));
+   asm volatile("lidt %0" : : "m" (idt_operand));
+}
+
 /*完成有关中断的所有初始化工作*/
 void idt_init() {
    put_str("idt_init start\n");
@@ -190,8 +196,7 @@ void idt_init() {
    pic_init();		   // 初始化8259A
 
    /* 加载idt */
-   uint64_t idt_operand = ((sizeof(idt) - 1) | ((uint64_t)(uint32_t)idt << 16));
-   asm volatile("lidt %0" : : "m" (idt_operand));
+   idt_load();
    put_str("idt_init done\n");
 }
 
@@ -3,6 +3,7 @@
 #include "stdint.h"
 typedef void* intr_handler;
 void idt_init(void); 
+void idt_load(void);
 
 /* 定义中断的两种状态 ：INTR_OFF 0表示关中断，INTR_ON 1表示开中断*/
 enum intr_status{
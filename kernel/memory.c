@@ -7,21 +7,74 @@
 #include "string.h"
 #include "sync.h"
 #include "interrupt.h"
+#include "slab.h"
+#include "process.h"
+#include "mmap.h"
+#include "ide.h"
+#include "wait_exit.h"
+#include "workqueue.h"
 
 
-#define MEM_BITMAP_BASE 0xc009a000
-/* 0xc0000000是内核从虚拟地址3G起, 0x100000意为跨过低端1MB内存，使虚拟地址在逻辑上连续, 即0xc0100000是堆的起始虚拟地址 */
-#define K_HEAP_START 0xc0100000
+/* 0xc0000000是内核从虚拟地址3G起, 也是直接映射区的起点: 从物理地址0起到内核内存池末尾, 虚拟地址 = 物理地址 + KERNEL_VBASE */
+#define KERNEL_VBASE 0xc0000000
+#define ZERO_POOL_MAX 32    // 每个内存池最多预先清0的页框数
+#define TLB_FLUSH_ALL_PAGES 32    // 一次解除映射的页数超过此值时重新加载cr3刷新整个tlb, 否则逐页invlpg
+#define LOW_MEM_END 0x200000      // 低端1MB以及loader建好的页目录表和256个页表, 其后才是可分配的物理内存
+#define DIRECT_MAP_MAX 0x30000000    // 直接映射区最多768MB, 剩下的内核虚拟地址留给按页映射的区域
+#define POOL_LEND_ORDER 8            // 内存池之间每次至少借还2^8页即1MB
+#define KMAP_SIZE 0x400000           // 直接映射区之后的4MB由kernel_vaddr管理, 用于临时映射窗口等, 其后直到页表自映射区为vmalloc区
+#define VMALLOC_MIN_PAGES 8          // sys_malloc超过这么多页的大块内存改从vmalloc区分配, 不再要求物理连续
+
+/* loader用BIOS中断0x15的0xe820子功能获取的内存布局: ARDS结构依次存放在0xb0a处, 个数存放在0xbfe处 */
+#define ARDS_BUF_ADDR 0xb0a
+#define ARDS_NR_ADDR  0xbfe
+#define ARDS_MAX      12    // loader中ards_buf只有244字节
+#define E820_TYPE_RAM 1     // 可被操作系统使用的内存
+
+/* 缺页异常错误码的各位 */
+#define PF_ERR_P    1    // 为1表示页存在但访问违反了保护属性, 为0表示页不存在
+#define PF_ERR_W    2    // 为1表示写操作引起
+#define PF_ERR_U    4    // 为1表示在特权级3引起
+#define STACK_GROW_SLACK 32    // 用户栈顶以下多少字节内的缺页仍算作栈的增长
 
 #define PDE_IDX(addr) ((addr & 0xffc00000) >> 22)
 #define PTE_IDX(addr) ((addr & 0x003ff000) >> 12)
 
-/* 物理内存池结构, 用于支持生成两个实例用于管理内核物理内存池和用户物理内存池 */
+/* 物理内存池结构, 用于支持生成两个实例用于管理内核物理内存池和用户物理内存池
+ * 物理页框用伙伴系统(buddy system)管理: free_area[i]链接着所有大小为2^i页的空闲块
+ * 一个池用尽时可以向另一个池成块地借空闲页框, 借来的块再次整块空闲且本池宽裕时归还 */
 struct pool {
-    struct bitmap pool_bitmap;    // 本内存池用到的位图结构, 用于管理物理内存
-    uint32_t phy_addr_start;      // 本内存池所管理的物理内存的起始地址
-    uint32_t pool_size;           // 本内存池字节容量
-    struct lock lock;             // 申请内存时互斥
+    uint32_t phy_addr_start;                    // 本内存池所管理的物理内存的起始地址
+    uint32_t pool_size;                         // 本内存池字节容量
+    uint32_t total_pages;                       // 本内存池中可用的页框数, 不含空洞
+    uint32_t free_pages;                        // 本内存池当前空闲的页框数(含借来的)
+    struct list free_area[BUDDY_ORDER_CNT];     // 各阶空闲块链表
+    struct list zero_list;                      // idle线程预先清0的页框, 用页框描述符的free_elem链接
+    uint32_t zero_cnt;                          // zero_list中的页框数
+    struct lock lock;                           // 申请内存时互斥
+
+    /* 两个池之间借还页框 */
+    uint32_t low_wmark;                         // 低水位: 借出后本池的空闲页框不能低于此值
+    uint32_t high_wmark;                        // 高水位: 归还后本池的空闲页框仍不低于此值时, 才把空闲的借来块还回去
+    uint32_t lent_pages;                        // 借给另一个池尚未收回的页框数
+    uint32_t borrowed_pages;                    // 从另一个池借来尚未归还的页框数
+    uint32_t borrow_cnt;                        // 累计借入次数
+    uint32_t return_cnt;                        // 累计归还次数
+};
+
+/* 地址范围描述符(Address Range Descriptor Structure) */
+struct ards {
+    uint32_t base_low;
+    uint32_t base_high;
+    uint32_t length_low;
+    uint32_t length_high;
+    uint32_t type;
+};
+
+/* 一段可用的物理内存[start, end), 均按页对齐 */
+struct mem_range {
+    uint32_t start;
+    uint32_t end;
 };
 
 /* 内存仓库 */
@@ -33,13 +86,58 @@ struct arena {
 struct mem_block_desc k_block_descs[DESC_CNT]; // 内核的”内存块描述符“数组
 
 struct pool kernel_pool, user_pool;    // 生成两个实例用于管理内核内存池和用户内存池
-struct virtual_addr kernel_vaddr;      // 此结构用来给"内核"分配虚拟地址
+struct virtual_addr kernel_vaddr;      // 此结构用来给"内核"分配直接映射区之后的虚拟地址, 这部分按页映射
+static struct page* mem_map;           // 两个内存池共用的页框描述符数组, 下标为页框相对内核内存池起始地址的序号
+static uint32_t mem_map_cnt;           // mem_map中描述符的个数
+static uint32_t lend_limit;            // 只有物理地址低于此值(处在直接映射区内)的页框才能借给内核内存池
+static uint32_t zero_window;           // idle线程清0页框时临时映射页框所用的一页内核虚拟地址
+static uint32_t cow_window;            // fork和写时复制时临时映射页框所用的一页内核虚拟地址, 仅在关中断时使用
+static uint32_t kernel_pte_global;     // 处理器支持全局页时为PG_G_1, 否则为0, 内核空间的页表项都带上它
+static uint32_t identity_pt;           // 第0个pde与第768个pde共用的页表的物理地址, 这张页表中的表项不能是全局页
+static uint32_t kernel_tlb_gen;        // 内核空间的映射每被解除一次加1, 别的处理器据此得知自己的tlb中可能还缓存着旧的表项
+static uint8_t kmap_bits[KMAP_SIZE / PG_SIZE / 8];    // kernel_vaddr的位图, 只管4MB, 直接放在内核bss中
+
+/* vmalloc区中的一段虚拟地址, 占用中的区域末尾多留一页不映射的保护页, 越界访问会立即触发缺页异常 */
+struct vm_area {
+    struct list_elem area_tag;    // 用于加入vm_free_list或vm_busy_list
+    uint32_t vaddr_start;         // 起始虚拟地址
+    uint32_t pg_cnt;              // 页数, 占用中的区域含保护页
+};
+static uint32_t vmalloc_start;         // vmalloc区的起始虚拟地址, 结束于页表自映射区0xffc00000
+static struct list vm_free_list;       // 空闲区域, 按地址升序排列, 相邻的空闲区域总是合并在一起
+static struct list vm_busy_list;       // 已分配出去的区域
+static struct kmem_cache* vm_area_cache;    // 分配vm_area结构的对象缓存
+static uint32_t vmalloc_pages;         // vmalloc区中映射着的页数
+
+/* 交换: 用户内存池不够用时, 把用户页换出到交换分区, 页表项改为记录交换槽号的交换项 */
+#define SWAP_SLOT_SECTS  (PG_SIZE / 512)    // 一个交换槽存一页, 占8个扇区
+#define SWAP_CLUSTER     32                 // kswapd和直接回收每次换出的页数
+#define SWAP_SCAN_BATCH  1024               // 关中断扫描一个进程时一次最多查看的页表项数, 限制关中断的时长
+static struct partition* swap_part;    // 交换分区, 为NULL时不换页
+static uint16_t* swap_map;             // 各交换槽被多少个页表项引用, 为0表示空闲, fork后父子可能共用一个槽
+static uint32_t swap_slot_cnt;         // 交换槽总数
+static uint32_t swap_free_slots;       // 空闲的交换槽数
+static uint32_t swap_hint;             // next-fit提示: 下次从此槽开始找空闲槽
+static uint32_t swap_window;           // 换入换出时临时映射用户页框所用的一页内核虚拟地址, 持有swap_lock时使用
+static struct lock swap_lock;          // 换入换出的I/O以及时钟指针的互斥
+static pid_t clock_pid;                // 时钟指针所在的用户进程
+static uint32_t clock_vaddr;           // 时钟指针在该进程中指向的用户页
+static struct workqueue kswapd_wq;     // kswapd专用的工作队列, 换出要等硬盘, 不能占住默认工作队列的工作线程
+static struct work kswapd_work;        // 后台回收(kswapd), 在kswapd_wq中执行
+static uint32_t swap_out_cnt, swap_in_cnt;
+
+static void page_table_pte_remove(uint32_t vaddr);
+static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+static bool vresize(void* _vaddr, uint32_t pg_cnt);
+static bool user_vaddr_extend(uint32_t vaddr, uint32_t pg_cnt);
+static void* user_palloc(void);
+static void swap_slot_dup(uint32_t slot);
+static void swap_slot_put(uint32_t slot);
 
 /* 在pf表示的虚拟地址池中申请pg_cnt个虚拟页, 成功则返回虚拟页的起始地址, 失败则返回NULL */
 static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
     int vaddr_start = 0, bit_idx_start = -1;
 
-    uint32_t cnt = 0;
     // 如果是在内核虚拟地址池中申请虚拟地址
     if(pf == PF_KERNEL) {
         bit_idx_start = bitmap_scan(&kernel_vaddr.vaddr_bitmap, pg_cnt);
@@ -47,10 +145,7 @@ static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
             return NULL;
         }
         // 运行到这里说明申请到了连续pg_cnt个虚拟地址, 那么就要将"从虚拟地址池中申请到的地址"在位图的对应的位置设为1
-        while (cnt < pg_cnt){
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt, 1);
-            cnt++;
-        }
+        bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 1);
         // 要返回的"所申请到的这一大片连续虚拟地址"的起始地址
         vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
     }else{
@@ -60,10 +155,7 @@ static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
         if(bit_idx_start == -1){
             return NULL;
         }
-        while (cnt < pg_cnt) {
-            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt, 1);
-            cnt++;
-        }
+        bitmap_set_range(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 1);
         // 返回申请到的连续虚拟地址空间的起始地址
         vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
 
@@ -87,18 +179,218 @@ uint32_t* pde_ptr(uint32_t vaddr) {
     return pde;
 }
 
+/* 返回物理页框pg_phy_addr的页框描述符 */
+static struct page* phy2page(uint32_t pg_phy_addr) {
+    return &mem_map[(pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE];
+}
+
+/* 返回页框描述符pg对应的物理地址 */
+static uint32_t page2phy(struct page* pg) {
+    return kernel_pool.phy_addr_start + (pg - mem_map) * PG_SIZE;
+}
+
+/* 返回页框pg当前所属的物理内存池: 一般是其地址所在的池, 借出后则属于另一个池 */
+static struct pool* page2pool(struct page* pg) {
+    bool in_user = page2phy(pg) >= user_pool.phy_addr_start;
+    if (pg->flags & PAGE_LENT) {
+        in_user = !in_user;
+    }
+    return in_user ? &user_pool : &kernel_pool;
+}
+
+/* 把m_pool中从free_area[cur_order]上的空闲块pg摘下, 拆分到刚好2^order页, 多余的部分挂回低阶链表. 调用者须已关中断 */
+static void buddy_take(struct pool* m_pool, struct page* pg, uint32_t cur_order, uint32_t order) {
+    list_remove(&pg->free_elem);
+    pg->flags &= ~PAGE_BUDDY;
+    // 块比需要的大, 就一分为二, 把后一半作为低一阶的空闲块挂回去, 直到大小刚好为2^order
+    while (cur_order > order) {
+        cur_order--;
+        struct page* half = pg + (1 << cur_order);
+        half->order = cur_order;
+        half->flags |= PAGE_BUDDY;
+        list_push(&m_pool->free_area[cur_order], &half->free_elem);
+    }
+    m_pool->free_pages -= (1 << order);
+}
+
+/* 把从pg起2^order页的块的所属关系在两个池之间翻转: 借出时置上PAGE_LENT, 借来的块再借回原主时清掉, 同时更新借还统计
+ * from为块原先所属的池, to为块之后所属的池. 调用者须已关中断 */
+static void pool_transfer(struct page* pg, uint32_t order, struct pool* from, struct pool* to) {
+    uint32_t pg_cnt = 1 << order, pg_idx;
+    if (pg->flags & PAGE_LENT) {    // 块本是to借给from的, 这是归还
+        from->borrowed_pages -= pg_cnt;
+        to->lent_pages -= pg_cnt;
+        from->return_cnt++;
+    } else {
+        from->lent_pages += pg_cnt;
+        to->borrowed_pages += pg_cnt;
+        to->borrow_cnt++;
+    }
+    // 空闲块中的页框要么都在同一个池的地址范围内, 要么都是借来的, 故整体翻转即可
+    for (pg_idx = 0; pg_idx < pg_cnt; pg_idx++) {
+        pg[pg_idx].flags ^= PAGE_LENT;
+    }
+}
+
+/* m_pool中没有2^order页的空闲块了, 从另一个内存池借一个2^max(order, POOL_LEND_ORDER)页的空闲块过来
+ * 借出方的空闲页框不能因此低于其低水位, 借给内核内存池的块还必须在直接映射区内. 调用者须已关中断, 成功返回true */
+static bool pool_borrow(struct pool* m_pool, uint32_t order) {
+    struct pool* lender = m_pool == &kernel_pool ? &user_pool : &kernel_pool;
+    uint32_t lend_order = order > POOL_LEND_ORDER ? order : POOL_LEND_ORDER;
+    uint32_t lend_cnt = 1 << lend_order;
+    if (lender->free_pages < lend_cnt + lender->low_wmark) {
+        return false;
+    }
+    uint32_t cur_order;
+    for (cur_order = lend_order; cur_order < BUDDY_ORDER_CNT; cur_order++) {
+        struct list_elem* elem = lender->free_area[cur_order].head.next;
+        while (elem != &lender->free_area[cur_order].tail) {
+            struct page* pg = elem2entry(struct page, free_elem, elem);
+            if (m_pool != &kernel_pool || page2phy(pg) + lend_cnt * PG_SIZE <= lend_limit) {
+                buddy_take(lender, pg, cur_order, lend_order);
+                pool_transfer(pg, lend_order, lender, m_pool);
+                // 直接挂到本池的空闲链表上, 不经过buddy_free, 免得本池空闲页框多(只是太零碎)时又被立即归还
+                pg->order = lend_order;
+                pg->flags |= PAGE_BUDDY;
+                list_push(&m_pool->free_area[lend_order], &pg->free_elem);
+                m_pool->free_pages += lend_cnt;
+                return true;
+            }
+            elem = elem->next;
+        }
+    }
+    return false;
+}
+
+/* 在m_pool中分配一个大小为2^order页的物理连续块, 成功则返回块首页框的物理地址, 失败则返回NULL
+ * 本池没有足够大的空闲块时向另一个池借 */
+static void* buddy_alloc(struct pool* m_pool, uint32_t order) {
+    ASSERT(order < BUDDY_ORDER_CNT);
+    // 谨记：操作空闲链表要保证原子操作(有些释放路径并不持有池锁)
+    enum intr_status old_status = intr_disable();
+
+    // 从order阶开始向上找第一个非空的空闲链表
+    uint32_t cur_order = order;
+    while (cur_order < BUDDY_ORDER_CNT && list_empty(&m_pool->free_area[cur_order])) {
+        cur_order++;
+    }
+    if (cur_order == BUDDY_ORDER_CNT) {
+        if (!pool_borrow(m_pool, order)) {
+            intr_set_status(old_status);
+            return NULL;
+        }
+        cur_order = order;    // 借来的块至少有2^order页
+        while (list_empty(&m_pool->free_area[cur_order])) {
+            cur_order++;
+        }
+    }
+    struct page* pg = elem2entry(struct page, free_elem, m_pool->free_area[cur_order].head.next);
+    buddy_take(m_pool, pg, cur_order, order);
+    intr_set_status(old_status);
+
+    return (void*)page2phy(pg);
+}
+
+/* 将以pg_phy_addr起始、大小为2^order页的块归还给m_pool, 并尽可能与伙伴块合并
+ * 合并出的块若是整块借来的, 且归还后本池仍在高水位之上, 就还给原主 */
+static void buddy_free(struct pool* m_pool, uint32_t pg_phy_addr, uint32_t order) {
+    uint32_t pg_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+    ASSERT(order < BUDDY_ORDER_CNT && pg_idx + (1 << order) <= mem_map_cnt);
+
+    enum intr_status old_status = intr_disable();
+    ASSERT(!(mem_map[pg_idx].flags & PAGE_BUDDY));    // 不能重复释放
+    m_pool->free_pages += (1 << order);
+
+    while (order < BUDDY_ORDER_CNT - 1) {
+        // 同阶的伙伴块与本块只在第order位上不同
+        uint32_t buddy_idx = pg_idx ^ (1 << order);
+        if (buddy_idx + (1 << order) > mem_map_cnt) {    // 内存的大小不是2的幂, 末尾的块可能没有伙伴
+            break;
+        }
+        struct page* buddy = &mem_map[buddy_idx];
+        // 伙伴不是同阶的空闲块, 或者属于另一个池(借出去了, 或本就在另一个池), 都无法合并
+        if (!(buddy->flags & PAGE_BUDDY) || buddy->order != order || page2pool(buddy) != m_pool) {
+            break;
+        }
+        list_remove(&buddy->free_elem);
+        buddy->flags &= ~PAGE_BUDDY;
+        pg_idx &= ~(1 << order);    // 合并后的块以两者中地址较低的为首
+        order++;
+    }
+    struct page* pg = &mem_map[pg_idx];
+    if ((pg->flags & PAGE_LENT) && order >= POOL_LEND_ORDER && m_pool->free_pages >= m_pool->high_wmark + (1 << order)) {
+        struct pool* owner = m_pool == &kernel_pool ? &user_pool : &kernel_pool;
+        m_pool->free_pages -= (1 << order);
+        pool_transfer(pg, order, m_pool, owner);
+        buddy_free(owner, page2phy(pg), order);
+        intr_set_status(old_status);
+        return;
+    }
+    pg->order = order;
+    pg->flags |= PAGE_BUDDY;
+    list_push(&m_pool->free_area[order], &pg->free_elem);
+    intr_set_status(old_status);
+}
+
+/* 将虚拟地址vaddr起始的一页清0, 按4字节一次写入, 比逐字节的memset快 */
+static void page_zero(void* vaddr) {
+    uint32_t cnt = PG_SIZE / 4;
+    asm volatile ("cld; rep stosl" : "+D"(vaddr), "+c"(cnt) : "a"(0) : "memory");
+}
+
+/* 从m_pool中取一个idle线程预先清0的页框, 成功则返回页框的物理地址, 没有则返回NULL */
+static void* palloc_prezeroed(struct pool* m_pool) {
+    void* page_phyaddr = NULL;
+    enum intr_status old_status = intr_disable();
+    if (!list_empty(&m_pool->zero_list)) {
+        struct page* pg = elem2entry(struct page, free_elem, list_pop(&m_pool->zero_list));
+        m_pool->zero_cnt--;
+        page_phyaddr = (void*)page2phy(pg);
+    }
+    intr_set_status(old_status);
+    return page_phyaddr;
+}
+
 /* 在m_pool指向的"物理内存池"中分配1个物理页, 成功则返回页框的物理地址, 失败则返回NULL */
 static void* palloc(struct pool* m_pool){
-    // 谨记：扫描或设置位图要保证原子操作
-    int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1);
-    if(bit_idx == -1){
+    void* page_phyaddr = buddy_alloc(m_pool, 0);
+    if (page_phyaddr == NULL) {    // 伙伴系统已空, 预先清0的页框也可以用
+        page_phyaddr = palloc_prezeroed(m_pool);
+    }
+    return page_phyaddr;
+}
+
+/* 在m_pool中分配pg_cnt个物理地址连续的页框, 成功则返回首页框的物理地址, 失败则返回NULL */
+static void* palloc_contig(struct pool* m_pool, uint32_t pg_cnt) {
+    ASSERT(pg_cnt > 0);
+    // 先向上取整到2的幂申请一整块
+    uint32_t order = 0;
+    while ((1U << order) < pg_cnt) {
+        order++;
+    }
+    if (order >= BUDDY_ORDER_CNT) {
         return NULL;
     }
-    // 运行到这说明申请1个页面成功, 将其位图中对应的位置设为1
-    bitmap_set(&m_pool->pool_bitmap, bit_idx, 1);
-    uint32_t page_phyaddr = (m_pool->phy_addr_start + (bit_idx * PG_SIZE));
+    uint32_t page_phyaddr = (uint32_t)buddy_alloc(m_pool, order);
+    if (page_phyaddr == 0) {
+        return NULL;
+    }
+    // 再把用不上的尾部按对齐所允许的最大块归还
+    uint32_t pg_idx = pg_cnt, blk_pg_cnt = 1 << order;
+    while (pg_idx < blk_pg_cnt) {
+        uint32_t free_order = 0;
+        while (!(pg_idx & (1 << free_order))) {
+            free_order++;
+        }
+        buddy_free(m_pool, page_phyaddr + pg_idx * PG_SIZE, free_order);
+        pg_idx += (1 << free_order);
+    }
+    return (void*)page_phyaddr;
+}
 
-    return (void*) page_phyaddr;
+/* 返回物理地址pg_phy_addr当前所属的物理内存池 */
+static struct pool* phy_addr2pool(uint32_t pg_phy_addr) {
+    return page2pool(phy2page(pg_phy_addr));
 }
 
 /* 在页表中添加虚拟地址vaddr 与 物理地址page_phyaddr 的映射*/
@@ -108,6 +400,11 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr){
     // 获得虚拟地址vaddr对应的页目录项pde 以及 页表项pte的"虚拟地址", 均保存在指针变量中
     uint32_t* pde = pde_ptr(vaddr);
     uint32_t* pte = pte_ptr(vaddr);
+    // 内核空间的映射在所有进程中都相同, 标记为全局页, 切换页表时不必刷出tlb; 兼作低端恒等映射的那张页表除外
+    bool global = vaddr >= 0xc0000000 && (identity_pt == 0 || (*pde & 0xfffff000) != identity_pt);
+    uint32_t pte_attr = PG_US_U | PG_RW_W | PG_P_1 | (global ? kernel_pte_global : 0);
+    // 用户空间的映射都建在当前任务的页表中, 计入它的驻留页数和页表数
+    struct task_struct* cur = vaddr < 0xc0000000 ? running_thread() : NULL;
 
     // ！！！先在页目录内判断目录项的P位是否为1
     if(*pde & 0x00000001) {
@@ -115,71 +412,117 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr){
         ASSERT(!(*pte & 0x00000001));
 
         if(!(*pte & 0x00000001)){    // 再次判断一下pte不存在
-            *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+            *pte = (page_phyaddr | pte_attr);
         }else{ // 目前不会执行到这，因为上面的ASSERT会先执行
             PANIC("pte repeat");
-            *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+            *pte = (page_phyaddr | pte_attr);
         }
     } else{    // 页目录项不存在, 所以要先创建页目录项再创建页表项
-        uint32_t pde_phyaddr = (uint32_t) palloc(&kernel_pool); // 页目录表用到的页框一律从内核空间分配, 故申请一页内核物理页作为页表
+        // 页目录表用到的页框一律从内核空间分配, 故申请一页内核物理页作为页表, 优先用预先清0的页框
+        uint32_t pde_phyaddr = (uint32_t) palloc_prezeroed(&kernel_pool);
+        bool zeroed = pde_phyaddr != 0;
+        if (!zeroed) {
+            pde_phyaddr = (uint32_t) palloc(&kernel_pool);
+        }
         *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);      // 设置好该页目录项的内容
+        if (cur != NULL) {
+            cur->pt_pages++;
+        }
 
         // 将分配到的页表物理页地址pde_phyaddr对应的物理内存清0, pte的高20位保留, 其余低12位为0, (pte & 0xfffff000)指向的是页表的"起始虚拟地址" 
         //  也就得到了刚刚申请的新物理页对应的虚拟地址（ 其实就是相当于将页表中的所有页表项均清0先）
-        memset((void*)((int)pte & 0xfffff000), 0, PG_SIZE);
+        if (!zeroed) {
+            page_zero((void*)((int)pte & 0xfffff000));
+        }
         ASSERT(!(*pte & 0x00000001));
 
-        *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);    // 设置vaddr对应的页表项(pte)的内容
+        *pte = (page_phyaddr | pte_attr);    // 设置vaddr对应的页表项(pte)的内容
+    }
+    if (cur != NULL) {
+        cur->rss_pages++;
     }
 }
 
-/* 分配pg_cnt个页空间, 成功则返回起始虚拟地址, 失败时返回NULL */
-void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+/* 分配pg_cnt个页空间, 成功则返回起始虚拟地址, 失败时返回NULL
+ * zero为true时返回的页已清0: 单页时优先用idle线程预先清0的页框, 没有了才现清0 */
+static void* malloc_page_zero(enum pool_flags pf, uint32_t pg_cnt, bool zero) {
     ASSERT(pg_cnt > 0 && pg_cnt < 3840);
-    /* 注意看：该函数的原理是三个动作的合成 */
-    void* vaddr_start = vaddr_get(pf, pg_cnt);    // 1. 在虚拟地址池中申请连续pg_cnt页的虚拟地址, 返回这片虚拟地址的起始虚拟地址
-    if(vaddr_start == NULL){
-        return NULL;
+
+    // 用户空间采用按需分页: 这里只占下虚拟地址, 物理页框等第一次访问时由缺页处理程序分配(已清0)
+    if(pf == PF_USER){
+        return vaddr_get(pf, pg_cnt);
     }
 
-    uint32_t vaddr = (uint32_t)vaddr_start, cnt = pg_cnt;
-    struct pool* mem_pool = pf & PF_KERNEL? &kernel_pool : &user_pool;    // 判断从哪个物理内存池中分配物理页
-    // 因为虚拟地址是连续的，但物理地址可以是不连续的，所以逐一分别作映射
-    while (cnt-- > 0){
-        void* page_phyaddr = palloc(mem_pool);    // 2. 从相应的物理内存池中申请一个物理页
-        if(page_phyaddr == NULL){
-            /*... 这里省略了一下内容：失败时要将曾经已申请的虚拟地址和物理页全部回滚，在将来完成内存回收时再补充 */
-            return NULL;
+    // 内核页一律取物理地址连续的页框, 直接用它在直接映射区中的虚拟地址, 不必申请虚拟地址也不必填页表项
+    void* page_phyaddr = (zero && pg_cnt == 1) ? palloc_prezeroed(&kernel_pool) : NULL;
+    bool zeroed = page_phyaddr != NULL;
+    if(!zeroed){
+        page_phyaddr = pg_cnt == 1 ? palloc(&kernel_pool) : palloc_contig(&kernel_pool, pg_cnt);
+    }
+    if(page_phyaddr == NULL){
+        return NULL;
+    }
+    uint32_t vaddr_start = (uint32_t)page_phyaddr + KERNEL_VBASE;
+    if(zero && !zeroed){
+        uint32_t cnt;
+        for(cnt = 0; cnt < pg_cnt; cnt++){
+            page_zero((void*)(vaddr_start + cnt * PG_SIZE));
         }
-        page_table_add((void*)vaddr, page_phyaddr);    // 3. 构建虚拟地址到物理地址的映射，即在页表中作映射(填充页表项)
-        vaddr += PG_SIZE;    // 下一个虚拟页
     }
-    return vaddr_start;
+    return (void*)vaddr_start;
+}
+
+/* 分配pg_cnt个页空间, 页的内容不做清0, 成功则返回起始虚拟地址, 失败时返回NULL */
+void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+    return malloc_page_zero(pf, pg_cnt, false);
 }
 
 /* 从内核物理内存池中申请以页为单位的内存，成功则返回其起始虚拟地址，失败则返回NULL */
 void* get_kernel_pages(uint32_t pg_cnt){
 	lock_acquire(&kernel_pool.lock);
-    void* vaddr = malloc_page(PF_KERNEL, pg_cnt);
-    if(vaddr != NULL){    // 若分配的地址不为空, 将页框清0后返回
-        memset(vaddr, 0, pg_cnt * PG_SIZE);
-    }
+    void* vaddr = malloc_page_zero(PF_KERNEL, pg_cnt, true);    // 返回的页框已清0
 	lock_release(&kernel_pool.lock);
 	
     return vaddr;
 }
 
+/* 同get_kernel_pages, 但不将页框清0, 供马上会整页覆盖的场合使用(如fork复制pcb, 管道缓冲区) */
+void* get_kernel_pages_nozero(uint32_t pg_cnt) {
+    lock_acquire(&kernel_pool.lock);
+    void* vaddr = malloc_page(PF_KERNEL, pg_cnt);
+    lock_release(&kernel_pool.lock);
+    return vaddr;
+}
+
+/* 释放get_kernel_pages申请的以vaddr起始的pg_cnt个内核页 */
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt) {
+    lock_acquire(&kernel_pool.lock);
+    mfree_page(PF_KERNEL, vaddr, pg_cnt);
+    lock_release(&kernel_pool.lock);
+}
+
+/* 从内核物理内存池中申请pg_cnt个"物理地址连续"的页, 供DMA缓冲区、大页表等必须物理连续的场合使用
+ * 成功则返回其起始虚拟地址(用addr_v2p得到物理地址), 失败则返回NULL, 用mfree_page释放
+ * 内核页都来自直接映射区, 本来就是物理连续的, 保留此接口是为了让调用者表明对物理连续的要求 */
+void* get_kernel_pages_contig(uint32_t pg_cnt) {
+    return get_kernel_pages(pg_cnt);
+}
+
 /* 从用户物理内存池中申请以页为单位的内存，成功则返回其起始虚拟地址，失败则返回NULL*/
 void* get_user_pages(uint32_t pg_cnt) {
     lock_acquire(&user_pool.lock);
-    void* vaddr = malloc_page(PF_USER, pg_cnt);
-    if(vaddr != NULL) {
-        memset(vaddr, 0, pg_cnt * PG_SIZE);
-    }
+    void* vaddr = malloc_page_zero(PF_USER, pg_cnt, true);
     lock_release(&user_pool.lock);
     return vaddr;
 }
 
+/* 释放get_user_pages申请的以vaddr起始的pg_cnt个用户页 */
+void free_user_pages(void* vaddr, uint32_t pg_cnt) {
+    lock_acquire(&user_pool.lock);
+    mfree_page(PF_USER, vaddr, pg_cnt);
+    lock_release(&user_pool.lock);
+}
+
 /* 可以指定虚拟地址vaddr与pf池中的物理地址关联(绑定到该物理地址), 仅支持一页空间分配 */
 void* get_a_page(enum pool_flags pf, uint32_t vaddr){
     struct pool* mem_pool = pf & PF_KERNEL? &kernel_pool : &user_pool;
@@ -204,7 +547,7 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr){
         PANIC("get_a_page: not allow kernel alloc userspace or user alloc kernelspace by get_a_page");
     }
     // 分配一页物理内存
-    void* page_phyaddr = palloc(mem_pool);
+    void* page_phyaddr = pf == PF_USER ? user_palloc() : palloc(mem_pool);
     if(page_phyaddr == NULL){
         lock_release(&mem_pool->lock);
         return NULL;
@@ -220,7 +563,7 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr){
 void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr) {
     struct pool* mem_pool = pf & PF_KERNEL? &kernel_pool : &user_pool;
     lock_acquire(&mem_pool->lock);
-    void* page_phyaddr = palloc(mem_pool);
+    void* page_phyaddr = pf == PF_USER ? user_palloc() : palloc(mem_pool);
     if (page_phyaddr == NULL) {
         lock_release(&mem_pool->lock);
         return NULL;
@@ -232,71 +575,271 @@ void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr) {
     return (void*)vaddr;
 }
 
+/* 判断当前页表中虚拟地址vaddr所在的页是否已映射了物理页框, 已换出到交换分区的页也算, 访问时会被换回 */
+bool vaddr_is_mapped(uint32_t vaddr) {
+    // 先判断pde, pde不存在时pte_ptr得到的地址是无法访问的, pde是4MB大页时也没有pte
+    uint32_t pde = *pde_ptr(vaddr);
+    return (pde & PG_P_1) && ((pde & PG_PS_1) || (*pte_ptr(vaddr) & (PG_P_1 | PG_SWAP_1)));
+}
+
+/* 只在当前用户进程的虚拟地址池中占下vaddr所在的页, 不分配物理页框, 第一次访问时由缺页处理程序分配 */
+void user_page_reserve(uint32_t vaddr) {
+    struct task_struct* cur = running_thread();
+    ASSERT(cur->pgdir != NULL && vaddr >= cur->userprog_vaddr.vaddr_start && vaddr < 0xc0000000);
+    bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE, 1);
+}
+
+/* 为当前进程建立只含一页预留页的用户堆, exec时原来的堆整个释放掉 */
+void user_heap_init(void) {
+    struct task_struct* cur = running_thread();
+    ASSERT(cur->pgdir != NULL);
+    if (cur->brk != 0) {
+        lock_acquire(&user_pool.lock);
+        mfree_page(PF_USER, (void*)USER_HEAP_START, DIV_ROUND_UP(cur->brk - USER_HEAP_START, PG_SIZE));
+        lock_release(&user_pool.lock);
+    }
+    user_page_reserve(USER_HEAP_START);
+    cur->brk = USER_HEAP_START + PG_SIZE;
+}
+
+/* 把当前进程的堆顶设为new_brk, 返回设置后的堆顶; new_brk越界或虚拟地址已被占用时堆顶不变, 故new_brk为0可用于查询
+ * 堆的第一页是user_heap_init留给malloc的控制页, 堆顶不能缩进这一页
+ * 扩大时只在虚拟地址位图中占下新增的页, 页框等第一次访问时由缺页处理程序分配(已清0) */
+uint32_t sys_brk(uint32_t new_brk) {
+    struct task_struct* cur = running_thread();
+    if (cur->pgdir == NULL || new_brk < USER_HEAP_START + PG_SIZE || new_brk > USER_STACK_BOTTOM) {
+        return cur->brk;
+    }
+    uint32_t old_end = DIV_ROUND_UP(cur->brk, PG_SIZE) * PG_SIZE;
+    uint32_t new_end = DIV_ROUND_UP(new_brk, PG_SIZE) * PG_SIZE;
+    lock_acquire(&user_pool.lock);
+    if (new_end > old_end) {
+        // sys_malloc等从位图中分配的虚拟地址可能已落在这里, 位图说了算
+        if (!user_vaddr_extend(old_end, (new_end - old_end) / PG_SIZE)) {
+            lock_release(&user_pool.lock);
+            return cur->brk;
+        }
+    } else if (new_end < old_end) {
+        mfree_page(PF_USER, (void*)new_end, (old_end - new_end) / PG_SIZE);
+    }
+    lock_release(&user_pool.lock);
+    cur->brk = new_brk;
+    return new_brk;
+}
+
 /* 得到虚拟地址映射到的物理地址 */
 uint32_t addr_v2p(uint32_t vaddr){
+    // 4MB大页(直接映射区)没有页表, 物理地址由页目录项的高10位加上vaddr的低22位组成
+    uint32_t pde = *pde_ptr(vaddr);
+    if (pde & PG_PS_1) {
+        return (pde & 0xffc00000) + (vaddr & 0x003fffff);
+    }
     // 获得虚拟地址vaddr对应的页表项所在的虚拟地址
     uint32_t* pte = pte_ptr(vaddr);
     // (*pte)的值就是页表项的内容, 高20位是虚拟地址vaddr对应的物理页框地址, 低12位是该物理页的属性
     return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
 }
 
-/* 初始化物理内存池 和 虚拟地址池, 根据内存容量all_mem的大小初始化物理内存池的相关结构 */
-static void mem_pool_init(uint32_t all_mem){
-    put_str("   mem_pool_init start\n");
-    uint32_t page_table_size = PG_SIZE * 256;
-    uint32_t used_mem = page_table_size + 0x100000;	  // 0x100000为低端1M内存
+/* 把m_pool中落在可用内存区域ranges内的页框作为空闲块挂到伙伴系统的各阶链表上, 并据此定下借还页框的水位
+ * 空洞中的页框描述符保持全0, 既不会被分配, 也不会被当作空闲的伙伴合并 */
+static void buddy_init(struct pool* m_pool, struct mem_range* ranges, uint32_t range_cnt) {
+    uint32_t order;
+    for (order = 0; order < BUDDY_ORDER_CNT; order++) {
+        list_init(&m_pool->free_area[order]);
+    }
+    m_pool->free_pages = 0;
+    list_init(&m_pool->zero_list);
+    m_pool->zero_cnt = 0;
+    m_pool->lent_pages = m_pool->borrowed_pages = 0;
+    m_pool->borrow_cnt = m_pool->return_cnt = 0;
+    m_pool->low_wmark = m_pool->high_wmark = 0;    // 初始化期间不借还
 
-    uint32_t free_mem = all_mem - used_mem;
-    // 1页为4k,不管总内存是不是4k的倍数,对于以页为单位的内存分配策略，不足1页的内存不用考虑了。
-    uint16_t all_free_pages = free_mem / PG_SIZE;
-    // 内核与用户各平分剩余内存
-    uint16_t kernel_free_pages = all_free_pages / 2;
-    uint16_t user_free_pages = all_free_pages - kernel_free_pages;
+    uint32_t pool_end = m_pool->phy_addr_start + m_pool->pool_size, range_idx;
+    for (range_idx = 0; range_idx < range_cnt; range_idx++) {
+        uint32_t start = ranges[range_idx].start > m_pool->phy_addr_start ? ranges[range_idx].start : m_pool->phy_addr_start;
+        uint32_t end = ranges[range_idx].end < pool_end ? ranges[range_idx].end : pool_end;
+        if (start >= end) {
+            continue;
+        }
+        // 区域的大小不一定是2的幂, 从头开始每次切出按当前位置对齐的最大块, 对齐以mem_map的下标为准
+        uint32_t pg_idx = (start - kernel_pool.phy_addr_start) / PG_SIZE;
+        uint32_t pg_end = (end - kernel_pool.phy_addr_start) / PG_SIZE;
+        while (pg_idx < pg_end) {
+            order = BUDDY_ORDER_CNT - 1;
+            while ((pg_idx & ((1 << order) - 1)) || pg_idx + (1 << order) > pg_end) {
+                order--;
+            }
+            buddy_free(m_pool, kernel_pool.phy_addr_start + pg_idx * PG_SIZE, order);
+            pg_idx += (1 << order);
+        }
+    }
+    // 留1/32的空闲页框给本池自己用, 借来的块在本池空闲页框达到1/16以上时才归还, 两者拉开距离以免反复借还
+    m_pool->low_wmark = m_pool->free_pages / 32;
+    m_pool->high_wmark = m_pool->free_pages / 16;
+    m_pool->total_pages = m_pool->free_pages;
+}
+
+/* 把物理地址[0, phy_end)以KERNEL_VBASE为偏移映射到内核空间, 返回直接映射区的结束虚拟地址(按4MB对齐)
+ * 处理器支持PSE时用4MB大页: 每个页目录项映射4MB, 不占页表, 整个区域只需少量tlb表项;
+ * 否则退回4KB页, 填在loader建好的内核页表中. 内核空间的页属性全都相同, 无需按属性拆分 */
+static uint32_t direct_map_init(uint32_t phy_end) {
+    uint32_t pde_cnt = DIV_ROUND_UP(phy_end, 0x400000);
+    ASSERT(pde_cnt < 254);    // 最后一个pde用于页表自映射, 还要给按页映射的内核虚拟地址池至少留出一个页表
+
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (edx & (1 << 3)) {    // cpuid功能号1返回的edx第3位为PSE
+        asm volatile ("movl %%cr4, %%eax; orl $0x10, %%eax; movl %%eax, %%cr4" : : : "eax", "memory");
+        uint32_t pde_idx;
+        for (pde_idx = 0; pde_idx < pde_cnt; pde_idx++) {
+            // 低端4MB原先由4KB页映射, 物理地址和属性都不变, 换成大页后刷新tlb即可
+            *pde_ptr(KERNEL_VBASE + pde_idx * 0x400000) = (pde_idx * 0x400000) | PG_PS_1 | PG_US_U | PG_RW_W | PG_P_1;
+        }
+        asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+    } else {
+        put_str("   4MB pages not supported\n");
+        uint32_t phy_addr;
+        for (phy_addr = 0x100000; phy_addr < pde_cnt * 0x400000; phy_addr += PG_SIZE) {    // 低端1MB在loader中已映射
+            page_table_add((void*)(phy_addr + KERNEL_VBASE), (void*)phy_addr);
+        }
+    }
+    return KERNEL_VBASE + pde_cnt * 0x400000;
+}
+
+/* 从loader留下的E820内存布局中取出4GB以下所有可用的内存区域, 按起始地址排好序存入ranges, 返回区域个数
+ * 低于LOW_MEM_END的部分已被低端1MB和页表占用, 一并去掉 */
+static uint32_t mem_ranges_get(struct mem_range* ranges) {
+    struct ards* ards = (struct ards*)ARDS_BUF_ADDR;
+    uint16_t ards_nr = *(uint16_t*)ARDS_NR_ADDR;
+    uint32_t range_cnt = 0;
+
+    if (ards_nr == 0 || ards_nr > ARDS_MAX) {    // e820失败时loader改用0xe801或0x88, 只得到一个总容量
+        ranges[0].start = LOW_MEM_END;
+        ranges[0].end = (*(uint32_t*)(0xb00)) & 0xfffff000;
+        return ranges[0].end > ranges[0].start ? 1 : 0;
+    }
+
+    uint32_t ards_idx;
+    for (ards_idx = 0; ards_idx < ards_nr; ards_idx++) {
+        struct ards* ar = &ards[ards_idx];
+        if (ar->type != E820_TYPE_RAM || ar->base_high != 0) {    // 32位分页下访问不到4GB以上的内存
+            continue;
+        }
+        uint32_t start = (ar->base_low + PG_SIZE - 1) & 0xfffff000;
+        uint32_t end = ar->base_low + ar->length_low;
+        if (ar->length_high != 0 || end < ar->base_low) {    // 跨过了4GB, 截断
+            end = 0xfffff000;
+        }
+        end &= 0xfffff000;
+        if (start < LOW_MEM_END) {
+            start = LOW_MEM_END;
+        }
+        if (start >= end) {
+            continue;
+        }
+        // BIOS返回的区域不保证有序, 按起始地址插入
+        uint32_t pos = range_cnt;
+        while (pos > 0 && ranges[pos - 1].start > start) {
+            ranges[pos] = ranges[pos - 1];
+            pos--;
+        }
+        ranges[pos].start = start;
+        ranges[pos].end = end;
+        range_cnt++;
+    }
 
-/* 为简化位图操作，余数不处理，坏处是这样做会丢内存。
-好处是不用做内存的越界检查,因为位图表示的内存少于实际物理内存*/
-    uint32_t kbm_length = kernel_free_pages / 8;			  // Kernel BitMap的长度,位图中的一位表示一页,以字节为单位
-    uint32_t ubm_length = user_free_pages / 8;			  // User BitMap的长度.
+    // 合并相互重叠或首尾相接的区域, 免得同一页框两次交给伙伴系统
+    uint32_t range_idx, merged_cnt = 0;
+    for (range_idx = 0; range_idx < range_cnt; range_idx++) {
+        if (merged_cnt > 0 && ranges[range_idx].start <= ranges[merged_cnt - 1].end) {
+            if (ranges[range_idx].end > ranges[merged_cnt - 1].end) {
+                ranges[merged_cnt - 1].end = ranges[range_idx].end;
+            }
+        } else {
+            ranges[merged_cnt++] = ranges[range_idx];
+        }
+    }
+    return merged_cnt;
+}
 
-    uint32_t kp_start = used_mem;				  // Kernel Pool start,内核内存池的起始地址
-    uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE;	  // User Pool start,用户内存池的起始地址
+/* 初始化物理内存池 和 虚拟地址池, 根据E820给出的可用内存区域ranges初始化物理内存池的相关结构
+ * 内核内存池取第一个区域的开头, 必须落在直接映射区内; 之后直到最后一个区域末尾都属于用户内存池, 中间的空洞不交给伙伴系统 */
+static void mem_pool_init(struct mem_range* ranges, uint32_t range_cnt){
+    put_str("   mem_pool_init start\n");
+    ASSERT(range_cnt > 0);
+    uint32_t mem_end = ranges[range_cnt - 1].end;
+
+    // 伙伴系统需要为每个页框准备一个描述符, 描述符数组本身所占的页框从第一个区域的开头划出
+    uint32_t page_desc_start = ranges[0].start;                             // 页框描述符数组所在的物理地址
+    uint32_t page_desc_pg_cnt = DIV_ROUND_UP((mem_end - page_desc_start) / PG_SIZE * sizeof(struct page), PG_SIZE);
+    uint32_t kp_start = page_desc_start + page_desc_pg_cnt * PG_SIZE;     // Kernel Pool start,内核内存池的起始地址
+    ASSERT(kp_start < ranges[0].end);
+
+    // 1页为4k,不管总内存是不是4k的倍数,对于以页为单位的内存分配策略，不足1页的内存不用考虑了。
+    uint32_t all_free_pages = 0, range_idx;
+    for (range_idx = 0; range_idx < range_cnt; range_idx++) {
+        uint32_t start = ranges[range_idx].start > kp_start ? ranges[range_idx].start : kp_start;
+        if (ranges[range_idx].end > start) {
+            all_free_pages += (ranges[range_idx].end - start) / PG_SIZE;
+        }
+    }
+    // 内核与用户各平分剩余内存, 但内核内存池既要整个放进直接映射区, 又不能跨过第一个区域的末尾
+    // 两池的分界按最大块(2^10页)对齐, 这样任何一个伙伴块都不会跨过分界, 借出的块也能按块整体归属
+    uint32_t kernel_free_pages = all_free_pages / 2;
+    if (kernel_free_pages > (DIRECT_MAP_MAX - kp_start) / PG_SIZE) {
+        kernel_free_pages = (DIRECT_MAP_MAX - kp_start) / PG_SIZE;
+    }
+    if (kernel_free_pages > (ranges[0].end - kp_start) / PG_SIZE) {
+        kernel_free_pages = (ranges[0].end - kp_start) / PG_SIZE;
+    }
+    kernel_free_pages &= ~((1 << (BUDDY_ORDER_CNT - 1)) - 1);
+    ASSERT(kernel_free_pages > 0);
+    uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE;	          // User Pool start,用户内存池的起始地址
 
     kernel_pool.phy_addr_start = kp_start;
     user_pool.phy_addr_start   = up_start;
 
     kernel_pool.pool_size = kernel_free_pages * PG_SIZE;
-    user_pool.pool_size	 = user_free_pages * PG_SIZE;
-
-    kernel_pool.pool_bitmap.btmp_bytes_len = kbm_length;
-    user_pool.pool_bitmap.btmp_bytes_len	  = ubm_length;
+    user_pool.pool_size	 = mem_end - up_start;    // 含区域间的空洞
 
+    // 内核镜像、页表、页框描述符数组和整个内核内存池都放进直接映射区, 内核页不再逐页建立映射
+    // 用户内存池中处在直接映射区内的部分, 在内核内存池用尽时可以借给内核
+    uint32_t direct_map_end = direct_map_init(mem_end < DIRECT_MAP_MAX ? mem_end : DIRECT_MAP_MAX);
+    lend_limit = direct_map_end - KERNEL_VBASE;
 
-    // 内核使用的最高地址是0xc009f000,这是主线程的栈地址.(内核的大小预计为70K左右)
-    // 32M内存占用的位图是1k.内核内存池的位图先定在MEM_BITMAP_BASE(0xc009a000)处.
-    kernel_pool.pool_bitmap.bits = (void*)MEM_BITMAP_BASE;
+    mem_map = (struct page*)(page_desc_start + KERNEL_VBASE);
+    mem_map_cnt = (mem_end - kp_start) / PG_SIZE;
+    memset(mem_map, 0, mem_map_cnt * sizeof(struct page));
 
-    // 用户内存池的位图紧跟在内核内存池位图之后
-    user_pool.pool_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length);
     /******************** 输出内存池信息 **********************/
-    put_str("      kernel_pool_bitmap_start:");put_int((int)kernel_pool.pool_bitmap.bits);
-    put_str(" kernel_pool_phy_addr_start:");put_int(kernel_pool.phy_addr_start);
+    put_str("      mem_ranges:");put_int(range_cnt);
+    put_str(" mem_end:");put_int(mem_end);
+    put_str(" free_pages:");put_int(all_free_pages);
     put_str("\n");
-    put_str("      user_pool_bitmap_start:");put_int((int)user_pool.pool_bitmap.bits);
+    put_str("      page_desc_start:");put_int((int)mem_map);
+    put_str(" page_desc_pages:");put_int(page_desc_pg_cnt);
+    put_str("\n");
+    put_str("      kernel_pool_phy_addr_start:");put_int(kernel_pool.phy_addr_start);
     put_str(" user_pool_phy_addr_start:");put_int(user_pool.phy_addr_start);
     put_str("\n");
+    put_str("      direct_map_end:");put_int(direct_map_end);
+    put_str("\n");
+
+    // 将内核内存池 和 用户内存池中所有可用的页框交给伙伴系统
+    buddy_init(&kernel_pool, ranges, range_cnt);
+    buddy_init(&user_pool, ranges, range_cnt);
 
-    // 初始化内核内存池 和 用户内存池位图，置0
-    bitmap_init(&kernel_pool.pool_bitmap);
-    bitmap_init(&user_pool.pool_bitmap);
-	
 	lock_init(&kernel_pool.lock);
     lock_init(&user_pool.lock);
-    // 初始化内核虚拟地址的位图,管理虚拟地址分配的情况，按实际物理内存大小生成数组，用于维护内核堆的虚拟地址,所以要和内核内存池大小一致
-    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;
-    // 位图的数组指向一块未使用的内存,目前定位在内核内存池和用户内存池之外
-    kernel_vaddr.vaddr_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length + ubm_length);
-    kernel_vaddr.vaddr_start = K_HEAP_START;
+
+    // 直接映射区之后按页映射的内核虚拟地址分成两块, 其页表在loader中已全部建好:
+    // 前KMAP_SIZE字节由kernel_vaddr的位图管理(临时映射窗口等), 剩下的直到页表自映射区之前是vmalloc区
+    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = sizeof(kmap_bits);
+    kernel_vaddr.vaddr_bitmap.bits = kmap_bits;
+    kernel_vaddr.vaddr_start = direct_map_end;
     bitmap_init(&kernel_vaddr.vaddr_bitmap);
+    vmalloc_start = direct_map_end + KMAP_SIZE;
+    ASSERT(vmalloc_start < 0xffc00000);
 
     put_str("   mem_pool_init done\n");
 }
@@ -309,23 +852,17 @@ void block_desc_init(struct mem_block_desc* desc_array) {
         desc_array[desc_idx].block_size = block_size;
         desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;
         list_init(&desc_array[desc_idx].free_list);
+        desc_array[desc_idx].empty_arenas = 0;
+        desc_array[desc_idx].arena_cnt = 0;
+        desc_array[desc_idx].free_cnt = 0;
         // 继续初始化下一个规格的mem_block_desc
         block_size *= 2;
     }
 }
 
-/* main退出时, 进程结束, 调用exit,根据物理页框地址pg_phy_addr在相应的物理内存池的位图清0, 不改动页表 */
+/* main退出时, 进程结束, 调用exit,根据物理页框地址pg_phy_addr将其归还到相应的物理内存池, 不改动页表 */
 void free_a_phy_page(uint32_t pg_phy_addr) {
-    struct pool* mem_pool;
-    uint32_t bit_idx = 0;
-    if(pg_phy_addr >= user_pool.phy_addr_start) {    // 判断该物理地址属于用户物理内存池还是内核物理内存池
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
-    } else {
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
-    }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
+    pfree(pg_phy_addr);
 }
 
 /* 返回arena中第idx个内存块的地址 */
@@ -333,12 +870,139 @@ static struct mem_block* arena2block(struct arena* a, uint32_t idx){
     return (struct mem_block*) ((uint32_t)a + sizeof(struct arena) + idx * a->desc->block_size);
 }
 
-/* 返回内存块b所在的arena地址 */
+/* 返回内存块b所在的arena地址
+ * 按页对齐分配的大内存从arena之后的第二页开始, b正好在页首, 故取b前一个字节所在的页 */
 static struct arena* block2arena(struct mem_block* b){
-    return (struct arena*) ((uint32_t)b & 0xfffff000);
+    return (struct arena*) (((uint32_t)b - 1) & 0xfffff000);
+}
+
+/* 为大内存分配page_cnt页(已清0)并填好arena元信息, 失败返回NULL, 调用者须持有相应内存池的锁
+ * contig为false时内核的大块内存从vmalloc区分配, 直接映射区里凑不出连续页框时也退到vmalloc区 */
+static struct arena* large_alloc(enum pool_flags PF, uint32_t page_cnt, bool contig) {
+    struct arena* a = NULL;
+    if(PF == PF_USER || contig || page_cnt <= VMALLOC_MIN_PAGES){
+        a = malloc_page_zero(PF, page_cnt, true);
+    }
+    if(a == NULL && PF == PF_KERNEL && !contig){
+        a = vmalloc(page_cnt);
+    }
+    if(a != NULL){
+        a->desc = NULL;
+        a->large = true;
+        a->cnt = page_cnt;
+    }
+    return a;
+}
+
+/* 在当前进程的虚拟地址池中占下从vaddr起始的pg_cnt个虚拟页, 其中有页已被占用时返回false */
+static bool user_vaddr_extend(uint32_t vaddr, uint32_t pg_cnt) {
+    struct virtual_addr* vaddr_pool = &running_thread()->userprog_vaddr;
+    uint32_t bit_idx_start = (vaddr - vaddr_pool->vaddr_start) / PG_SIZE, idx;
+    if(bit_idx_start + pg_cnt > vaddr_pool->vaddr_bitmap.btmp_bytes_len * 8){
+        return false;
+    }
+    for(idx = 0; idx < pg_cnt; idx++){
+        if(bitmap_scan_test(&vaddr_pool->vaddr_bitmap, bit_idx_start + idx)){
+            return false;
+        }
+    }
+    bitmap_set_range(&vaddr_pool->vaddr_bitmap, bit_idx_start, pg_cnt, 1);
+    return true;
+}
+
+/* 把大内存a原地调整为page_cnt页, 成功返回true, 调用者须持有相应内存池的锁 */
+static bool large_resize(enum pool_flags PF, struct arena* a, uint32_t page_cnt) {
+    uint32_t vaddr = (uint32_t)a;
+    if(page_cnt == a->cnt){
+        return true;
+    }
+    if(PF == PF_KERNEL && vaddr >= vmalloc_start){
+        if(!vresize(a, page_cnt)){
+            return false;
+        }
+    }else if(page_cnt < a->cnt){    // 缩小: 直接释放尾部的页
+        mfree_page(PF, (void*)(vaddr + page_cnt * PG_SIZE), a->cnt - page_cnt);
+    }else if(PF == PF_USER){    // 用户页按需分配, 只需占下紧随其后的虚拟地址
+        if(!user_vaddr_extend(vaddr + a->cnt * PG_SIZE, page_cnt - a->cnt)){
+            return false;
+        }
+    }else{    // 直接映射区的页框是按伙伴块分配的, 无法原地扩大
+        return false;
+    }
+    a->cnt = page_cnt;
+    return true;
+}
+
+/* 从descs[desc_idx]的free_list中取出一个内存块, free_list为空时创建新的arena, 失败返回NULL
+ * 调用者须持有相应内存池的锁 */
+static struct mem_block* block_get(enum pool_flags PF, struct mem_block_desc* descs, uint8_t desc_idx) {
+    struct arena* a;
+    struct mem_block* b;
+    // 若desc_idx所指向的mem_block_desc的free_list中已没有可用的mem_block, 就创建新的arena提供mem_block
+    if(list_empty(&descs[desc_idx].free_list)){
+        a = malloc_page(PF, 1);   // 拓展一页框作为arena, 内存块在分配出去时才清0, 故此处不必清0
+        if(a == NULL){
+            return NULL;
+        }
+        // 对于新创建的arena, 将desc置为相应的内存块描述符
+        a->desc = &descs[desc_idx];
+        a->large = false;
+        a->cnt = descs[desc_idx].blocks_per_arena;
+
+        // 开始要将arena拆分成内存块, 并添加到内存描述符的free_list中, 新arena先算作一个空arena
+        uint32_t block_idx;
+        enum intr_status old_status = intr_disable();    // 关中断, 保证原子操作
+
+        for(block_idx = 0; block_idx < descs[desc_idx].blocks_per_arena; block_idx++){
+            b = arena2block(a, block_idx);    // 拆分出第block_idx块内存块
+            list_append(&a->desc->free_list, &b->free_elem);
+        }
+        intr_set_status(old_status);    // 恢复中断状态
+        descs[desc_idx].empty_arenas++;
+        descs[desc_idx].arena_cnt++;
+        descs[desc_idx].free_cnt += descs[desc_idx].blocks_per_arena;
+    }
+    // 走到这步, 即已经有内存块可供分配
+    b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list))); // 从链表中弹出的是mem_block的free_elem的地址
+
+    a = block2arena(b);  // 获取内存块b所在的arena的地址
+    if(a->cnt == descs[desc_idx].blocks_per_arena){    // 从空arena中分出第一块, 它不再是空arena
+        descs[desc_idx].empty_arenas--;
+    }
+    a->cnt--;            // 表示此arena中的空闲内存块数-1
+    descs[desc_idx].free_cnt--;
+    return b;
+}
+
+/* 将内存块b归还到其arena对应的free_list中, 调用者须持有相应内存池的锁
+ * arena中的内存块都已空闲时, 同规格的空arena不超过ARENA_EMPTY_MAX个就留着备用, 否则释放arena
+ * 这样同一规格反复申请释放一块内存时, 不会每次都释放页框再重新拆分arena */
+static void block_put(enum pool_flags PF, struct mem_block* b) {
+    struct arena* a = block2arena(b);  // 获得该内存块对应的arena(b只是该arena中的某个内存块罢了)
+    list_append(&a->desc->free_list, &b->free_elem);  // 先将内存块回收到arena对应的"内存块描述符“free_list中
+    (a->cnt)++;
+    a->desc->free_cnt++;
+
+    // 再判断此arena中的内存块是否都是空闲
+    if(a->cnt == a->desc->blocks_per_arena) {
+        if(a->desc->empty_arenas < ARENA_EMPTY_MAX) {
+            a->desc->empty_arenas++;
+            return;
+        }
+        // 内存块都在free_list中, 双向链表直接摘除即可, 无需在链表中查找
+        uint32_t block_idx;
+        for(block_idx = 0; block_idx < a->desc->blocks_per_arena; block_idx++) {
+            list_remove(&arena2block(a, block_idx)->free_elem);
+        }
+        a->desc->arena_cnt--;
+        a->desc->free_cnt -= a->desc->blocks_per_arena;
+        mfree_page(PF, a, 1);
+    }
 }
 
-/* 在堆中申请size字节内存, 动态创建arena */
+/* 在堆中申请size字节内存, 动态创建arena
+ * 小内存块优先从当前任务的弹匣(magazine)中取, 弹匣只属于当前任务, 故无需加锁也无需关中断,
+ * 弹匣空了才加锁从mem_block_desc中成批补充 */
 void* sys_malloc(uint32_t size) {
     enum pool_flags PF;
     struct pool* mem_pool;
@@ -366,149 +1030,518 @@ void* sys_malloc(uint32_t size) {
 
     struct arena* a;
     struct mem_block* b;
-    lock_acquire(&mem_pool->lock);    // 访问内存池需要加锁
 
     // 如果申请的内存超过内存块最大尺寸1024，则直接分配页框
     if(size > 1024) {
+        lock_acquire(&mem_pool->lock);    // 访问内存池需要加锁
         uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);
-        a = malloc_page(PF, page_cnt);
-        if(a != NULL){
-            memset(a, 0, page_cnt * PG_SIZE);    // 将分配的内存清0
-        // 开始初始化arena的元信息
-        a->desc = NULL;
-        a->large = true;
-        a->cnt = page_cnt;
+        a = large_alloc(PF, page_cnt, false);
         lock_release(&mem_pool->lock);
-        return (void*)(a+1);
-        }else{
-            lock_release(&mem_pool->lock);
-            return NULL;
-        }
+        return a != NULL ? (void*)(a+1) : NULL;
     }else{    // 否则就可以在各种规格的mem_block_desc中去适配
         uint8_t desc_idx;
         // 遍历内存块描述符，从中找出匹配申请最合适的内存块“规格”
         for(desc_idx = 0; desc_idx < DESC_CNT; desc_idx++){
             if(size <= descs[desc_idx].block_size) break;    // 找到后就退出
         }
-        // 若desc_idx所指向的mem_block_desc的free_list中已没有可用的mem_block, 就创建新的arena提供mem_block
-        if(list_empty(&descs[desc_idx].free_list)){
-            a = malloc_page(PF, 1);   // 拓展一页框作为arena
-            if(a == NULL){
-                lock_release(&mem_pool->lock);
-                return NULL;
+        struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+        // 弹匣空了, 加锁一次补充MAG_BATCH个内存块
+        if(mag->cnt == 0){
+            lock_acquire(&mem_pool->lock);
+            while(mag->cnt < MAG_BATCH){
+                b = block_get(PF, descs, desc_idx);
+                if(b == NULL){
+                    break;
+                }
+                mag->blocks[mag->cnt++] = b;
             }
-            memset(a, 0, PG_SIZE);
-            // 对于新创建的arena, 将desc置为相应的内存块描述符
-            a->desc = &descs[desc_idx];
-            a->large = false;
-            a->cnt = descs[desc_idx].blocks_per_arena;
-
-            // 开始要将arena拆分成内存块, 并添加到内存描述符的free_list中
-            uint32_t block_idx;
-            enum intr_status old_status = intr_disable();    // 关中断, 保证原子操作
-
-            for(block_idx = 0; block_idx < descs[desc_idx].blocks_per_arena; block_idx++){
-                b = arena2block(a, block_idx);    // 拆分出第block_idx块内存块
-                ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-                list_append(&a->desc->free_list, &b->free_elem);
+            lock_release(&mem_pool->lock);
+            if(mag->cnt == 0){
+                return NULL;
             }
-            intr_set_status(old_status);    // 恢复中断状态
         }
-        // 走到这步, 即已经有内存块可供分配
-        b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list))); // 从链表中弹出的是mem_block的free_elem的地址
+        b = mag->blocks[--mag->cnt];
         memset(b, 0, descs[desc_idx].block_size);
 
-        a = block2arena(b);  // 获取内存块b所在的arena的地址
-        a->cnt--;            // 表示此arena中的空闲内存块数-1
+        return (void*)b; // 返回分配的内存块
+    }
+}
+
+/* 返回当前任务所用的堆内存池 */
+static enum pool_flags heap_pool(struct pool** mem_pool) {
+    if(running_thread()->pgdir == NULL){
+        *mem_pool = &kernel_pool;
+        return PF_KERNEL;
+    }
+    *mem_pool = &user_pool;
+    return PF_USER;
+}
+
+/* 把ptr指向的内存调整为size字节, 返回调整后的地址, 失败返回NULL且原内存不变
+ * 大内存尽量原地缩小或扩大(紧随其后的虚拟页空闲时), 做不到时才另行分配并复制, 新增的部分不保证清0 */
+void* sys_realloc(void* ptr, uint32_t size) {
+    if(ptr == NULL){
+        return sys_malloc(size);
+    }
+    if(size == 0){
+        sys_free(ptr);
+        return NULL;
+    }
+    struct pool* mem_pool;
+    enum pool_flags PF = heap_pool(&mem_pool);
+    struct arena* a = block2arena(ptr);
+    uint32_t old_size;
+    if(a->desc != NULL){    // 小内存块, 块内还放得下就不动
+        old_size = a->desc->block_size;
+        if(size <= old_size){
+            return ptr;
+        }
+    }else{
+        uint32_t offset = (uint32_t)ptr - (uint32_t)a;    // 按对齐分配的内存与arena之间可能隔着不止一个arena头
+        old_size = a->cnt * PG_SIZE - offset;
+        uint32_t page_cnt = DIV_ROUND_UP(size + offset, PG_SIZE);
+        lock_acquire(&mem_pool->lock);
+        bool resized = large_resize(PF, a, page_cnt);
         lock_release(&mem_pool->lock);
+        if(resized){
+            return ptr;
+        }
+    }
+    void* new_ptr = sys_malloc(size);
+    if(new_ptr == NULL){
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    sys_free(ptr);
+    return new_ptr;
+}
 
-        return (void*)b; // 返回分配的内存块
+/* 分配size字节、起始地址按align字节对齐的已清0内存, 失败返回NULL, 用sys_free释放
+ * align须是2的幂且不超过一页, 如整扇区读写用的512或页对齐的4096; 内核中分配到的内存物理连续, 可直接用作DMA缓冲区 */
+void* sys_malloc_aligned(uint32_t size, uint32_t align) {
+    ASSERT(align > 0 && (align & (align - 1)) == 0 && align <= PG_SIZE);
+    if(align <= 4){    // 小内存块本身就按4字节对齐
+        return sys_malloc(size);
     }
+    struct pool* mem_pool;
+    enum pool_flags PF = heap_pool(&mem_pool);
+    if(size == 0 || size >= mem_pool->pool_size){
+        return NULL;
+    }
+    // arena头之后跳到第一个对齐的地址, 页对齐时arena头独占一页
+    uint32_t offset = DIV_ROUND_UP(sizeof(struct arena), align) * align;
+    uint32_t page_cnt = DIV_ROUND_UP(size + offset, PG_SIZE);
+    lock_acquire(&mem_pool->lock);
+    struct arena* a = large_alloc(PF, page_cnt, true);
+    lock_release(&mem_pool->lock);
+    return a != NULL ? (void*)((uint32_t)a + offset) : NULL;
+}
+/****************************** vmalloc区 *********************************/
+/* 初始化vmalloc区: 整个区域作为一个空闲区域 */
+static void vmalloc_init(void) {
+    list_init(&vm_free_list);
+    list_init(&vm_busy_list);
+    vm_area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), NULL);
+    ASSERT(vm_area_cache != NULL);
+    struct vm_area* area = kmem_cache_alloc(vm_area_cache);
+    area->vaddr_start = vmalloc_start;
+    area->pg_cnt = (0xffc00000 - vmalloc_start) / PG_SIZE;
+    list_append(&vm_free_list, &area->area_tag);
 }
+
+/* 按首次适应从vmalloc区中切出pg_cnt页虚拟地址, 成功返回加入vm_busy_list的区域, 失败返回NULL, 调用者须持有内核内存池的锁 */
+static struct vm_area* vm_area_get(uint32_t pg_cnt) {
+    struct list_elem* elem = vm_free_list.head.next;
+    while (elem != &vm_free_list.tail) {
+        struct vm_area* area = elem2entry(struct vm_area, area_tag, elem);
+        if (area->pg_cnt == pg_cnt) {    // 大小正好, 整个区域拿走
+            list_remove(&area->area_tag);
+            list_append(&vm_busy_list, &area->area_tag);
+            return area;
+        }
+        if (area->pg_cnt > pg_cnt) {    // 从区域头部切下一块, 剩下的留在原位
+            struct vm_area* busy = kmem_cache_alloc(vm_area_cache);
+            if (busy == NULL) {
+                return NULL;
+            }
+            busy->vaddr_start = area->vaddr_start;
+            busy->pg_cnt = pg_cnt;
+            area->vaddr_start += pg_cnt * PG_SIZE;
+            area->pg_cnt -= pg_cnt;
+            list_append(&vm_busy_list, &busy->area_tag);
+            return busy;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+/* 把区域area从vm_busy_list归还到vm_free_list, 并与前后相邻的空闲区域合并, 调用者须持有内核内存池的锁 */
+static void vm_area_put(struct vm_area* area) {
+    list_remove(&area->area_tag);
+    // 找到第一个地址在area之后的空闲区域, 插到它前面以保持升序
+    struct list_elem* elem = vm_free_list.head.next;
+    while (elem != &vm_free_list.tail) {
+        struct vm_area* next = elem2entry(struct vm_area, area_tag, elem);
+        if (next->vaddr_start > area->vaddr_start) {
+            break;
+        }
+        elem = elem->next;
+    }
+    list_insert_before(elem, &area->area_tag);
+
+    // 与后一个区域相邻则把它并进来
+    if (elem != &vm_free_list.tail) {
+        struct vm_area* next = elem2entry(struct vm_area, area_tag, elem);
+        if (area->vaddr_start + area->pg_cnt * PG_SIZE == next->vaddr_start) {
+            area->pg_cnt += next->pg_cnt;
+            list_remove(&next->area_tag);
+            kmem_cache_free(vm_area_cache, next);
+        }
+    }
+    // 与前一个区域相邻则并到前一个区域中
+    if (area->area_tag.prev != &vm_free_list.head) {
+        struct vm_area* prev = elem2entry(struct vm_area, area_tag, area->area_tag.prev);
+        if (prev->vaddr_start + prev->pg_cnt * PG_SIZE == area->vaddr_start) {
+            prev->pg_cnt += area->pg_cnt;
+            list_remove(&area->area_tag);
+            kmem_cache_free(vm_area_cache, area);
+        }
+    }
+}
+
+/* 为vaddr起始的pg_cnt页映射内核页框, zero为true时页框已清0, 页框逐页取自内核内存池, 失败时撤销已建立的映射并返回false
+ * 调用者须持有内核内存池的锁 */
+static bool vm_pages_map(uint32_t vaddr, uint32_t pg_cnt, bool zero) {
+    uint32_t cnt;
+    for (cnt = 0; cnt < pg_cnt; cnt++) {
+        void* page_phyaddr = zero ? palloc_prezeroed(&kernel_pool) : NULL;    // 不需清0时不占用预清0的页框
+        bool need_zero = zero && page_phyaddr == NULL;
+        if (page_phyaddr == NULL) {
+            page_phyaddr = palloc(&kernel_pool);
+        }
+        if (page_phyaddr == NULL) {    // 物理内存不足, 回滚已经映射的页
+            page_range_unmap(vaddr, cnt);
+            return false;
+        }
+        page_table_add((void*)(vaddr + cnt * PG_SIZE), page_phyaddr);
+        if (need_zero) {
+            page_zero((void*)(vaddr + cnt * PG_SIZE));
+        }
+    }
+    vmalloc_pages += pg_cnt;
+    return true;
+}
+
+/* 在vmalloc区中分配pg_cnt页内核内存, zero为true时已清0 */
+static void* vm_alloc(uint32_t pg_cnt, bool zero) {
+    ASSERT(pg_cnt > 0);
+    lock_acquire(&kernel_pool.lock);    // vm_area_cache的锁总在内核内存池的锁之后获取, 与slab_grow的加锁顺序一致
+    struct vm_area* area = vm_area_get(pg_cnt + 1);    // 多要一页作保护页
+    if (area == NULL) {
+        lock_release(&kernel_pool.lock);
+        return NULL;
+    }
+    if (!vm_pages_map(area->vaddr_start, pg_cnt, zero)) {
+        vm_area_put(area);
+        lock_release(&kernel_pool.lock);
+        return NULL;
+    }
+    lock_release(&kernel_pool.lock);
+    return (void*)area->vaddr_start;
+}
+
+/* 在vmalloc区中分配pg_cnt页已清0的内核内存, 页框逐页取自内核内存池, 不要求物理连续
+ * 成功返回起始虚拟地址, 失败返回NULL */
+void* vmalloc(uint32_t pg_cnt) {
+    return vm_alloc(pg_cnt, true);
+}
+
+/* 同vmalloc, 但不将页框清0, 供马上会整块覆盖的场合使用(如fork复制虚拟地址位图) */
+void* vmalloc_nozero(uint32_t pg_cnt) {
+    return vm_alloc(pg_cnt, false);
+}
+
+/* 在vmalloc区中找到以vaddr起始的已分配区域, 调用者须持有内核内存池的锁 */
+static struct vm_area* vm_area_find(uint32_t vaddr) {
+    struct list_elem* elem = vm_busy_list.head.next;
+    while (elem != &vm_busy_list.tail) {
+        struct vm_area* area = elem2entry(struct vm_area, area_tag, elem);
+        if (area->vaddr_start == vaddr) {
+            return area;
+        }
+        elem = elem->next;
+    }
+    PANIC("vm_area_find: not a vmalloc address");    // 不是vmalloc返回的地址
+    return NULL;
+}
+
+/* 把vmalloc分配的以_vaddr起始的内存原地调整为pg_cnt页, 成功返回true, 调用者须持有内核内存池的锁
+ * 缩小总能成功; 扩大只在紧随区域之后的虚拟地址空闲时进行, 新增的页已清0 */
+static bool vresize(void* _vaddr, uint32_t pg_cnt) {
+    struct vm_area* area = vm_area_find((uint32_t)_vaddr);
+    uint32_t mapped_cnt = area->pg_cnt - 1;    // 去掉保护页
+    uint32_t area_end = area->vaddr_start + area->pg_cnt * PG_SIZE;
+
+    if (pg_cnt == mapped_cnt) {
+        return true;
+    }
+    if (pg_cnt < mapped_cnt) {
+        struct vm_area* tail = kmem_cache_alloc(vm_area_cache);
+        if (tail == NULL) {
+            return false;
+        }
+        // 解除尾部页的映射, 第pg_cnt页成为新的保护页, 其后的虚拟地址还给空闲区域
+        page_range_unmap(area->vaddr_start + pg_cnt * PG_SIZE, mapped_cnt - pg_cnt);
+        vmalloc_pages -= mapped_cnt - pg_cnt;
+        tail->vaddr_start = area->vaddr_start + (pg_cnt + 1) * PG_SIZE;
+        tail->pg_cnt = mapped_cnt - pg_cnt;
+        area->pg_cnt = pg_cnt + 1;
+        list_append(&vm_busy_list, &tail->area_tag);
+        vm_area_put(tail);
+        return true;
+    }
+
+    // 扩大: 紧随其后的须是足够大的空闲区域
+    uint32_t extra = pg_cnt - mapped_cnt;
+    struct list_elem* elem = vm_free_list.head.next;
+    struct vm_area* next = NULL;
+    while (elem != &vm_free_list.tail) {
+        next = elem2entry(struct vm_area, area_tag, elem);
+        if (next->vaddr_start >= area_end) {
+            break;
+        }
+        elem = elem->next;
+    }
+    if (elem == &vm_free_list.tail || next->vaddr_start != area_end || next->pg_cnt < extra) {
+        return false;
+    }
+    // 原来的保护页也要映射, 新的保护页落在从空闲区域借来的最后一页
+    if (!vm_pages_map(area->vaddr_start + mapped_cnt * PG_SIZE, extra, true)) {
+        return false;
+    }
+    next->vaddr_start += extra * PG_SIZE;
+    next->pg_cnt -= extra;
+    if (next->pg_cnt == 0) {
+        list_remove(&next->area_tag);
+        kmem_cache_free(vm_area_cache, next);
+    }
+    area->pg_cnt += extra;
+    return true;
+}
+
+/* 释放vmalloc分配的以_vaddr起始的内存 */
+void vfree(void* _vaddr) {
+    lock_acquire(&kernel_pool.lock);
+    struct vm_area* area = vm_area_find((uint32_t)_vaddr);
+    page_range_unmap(area->vaddr_start, area->pg_cnt - 1);    // 保护页本来就没有映射
+    vmalloc_pages -= area->pg_cnt - 1;
+    vm_area_put(area);
+    lock_release(&kernel_pool.lock);
+}
+
 /***************************** 内存释放 **********************************/
-/* 将物理地址pg_phy_addr回收到物理内存池 */
+/* 将物理地址pg_phy_addr回收到物理内存池, 伙伴系统会顺带把它与空闲的伙伴合并成更大的块
+ * 若页框还被其他进程以写时复制的方式共享着, 只减少共享计数 */
 void pfree(uint32_t pg_phy_addr) {
-    struct pool* mem_pool;
-    uint32_t bit_idx = 0;
-    if(pg_phy_addr >= user_pool.phy_addr_start) {
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - mem_pool->phy_addr_start) / PG_SIZE; // 第几个物理页
-    }else{
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - mem_pool->phy_addr_start) / PG_SIZE; // 第几个物理页
+    struct page* pg = phy2page(pg_phy_addr);
+    enum intr_status old_status = intr_disable();
+    if (pg->share_cnt > 0) {
+        pg->share_cnt--;
+        intr_set_status(old_status);
+        return;
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);    // 将位图中的该位清0
+    intr_set_status(old_status);
+    buddy_free(phy_addr2pool(pg_phy_addr), pg_phy_addr, 0);
 }
 
 /* 去掉页表中虚拟地址vaddr的映射, 注意只去掉vaddr对应的pte */
 static void page_table_pte_remove(uint32_t vaddr) {
     uint32_t* pte = pte_ptr(vaddr);    // 得到该虚拟地址vaddr对应的页表项的"虚拟地址"
     *pte &= ~PG_P_1;    // 将页表项pte的P位置0
-    asm volatile ("invlpg %0" : : "m"(vaddr) : "memory");
+    asm volatile ("invlpg %0" : : "m"(*(char*)vaddr) : "memory");    // 操作数须是vaddr处的内存, 而不是变量vaddr本身
+}
+
+/* 刷新整个tlb: 用户空间的表项重新加载cr3即可刷出, 全局页则要把cr4的PGE位清0再置1 */
+static void tlb_flush_all(bool global) {
+    if (global && kernel_pte_global != 0) {
+        asm volatile ("movl %%cr4, %%eax; andl $~0x80, %%eax; movl %%eax, %%cr4; orl $0x80, %%eax; movl %%eax, %%cr4" : : : "eax", "memory");
+    } else {
+        asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+    }
+}
+
+/* 获取大内核锁时调用: 上次同步以来别的处理器解除过内核空间的映射, 就刷新本处理器的整个tlb, *seen_gen记录本处理器已同步到的代数
+ * 内核空间的映射只在持有大内核锁时使用和修改, 所以不必发IPI立即通知其他处理器, 等它们下次进入内核时再刷新即可 */
+void kernel_tlb_sync(uint32_t* seen_gen) {
+    if (*seen_gen != kernel_tlb_gen) {
+        tlb_flush_all(true);
+        *seen_gen = kernel_tlb_gen;
+    }
+}
+
+/* 使tlb中从vaddr起连续pg_cnt页的表项失效: 页数少时逐页invlpg, 多时刷新整个tlb */
+static void tlb_flush_range(uint32_t vaddr, uint32_t pg_cnt) {
+    if (pg_cnt > TLB_FLUSH_ALL_PAGES) {
+        tlb_flush_all(vaddr >= 0xc0000000);
+        return;
+    }
+    while (pg_cnt-- > 0) {
+        asm volatile ("invlpg %0" : : "m"(*(char*)vaddr) : "memory");
+        vaddr += PG_SIZE;
+    }
+}
+
+/* 判断首个pte为pt的页表中是否已没有任何映射和换出的页 */
+static bool page_table_empty(uint32_t* pt) {
+    uint32_t pte_idx;
+    for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+        if (pt[pte_idx] & (PG_P_1 | PG_SWAP_1)) {    // 换出的页的页表项也要保留
+            return false;
+        }
+    }
+    return true;
+}
+
+/* 解除当前页表中从vaddr_start起连续pg_cnt页的映射, 并释放它们的物理页框, 不处理虚拟地址位图
+ * 以页表为单位批量处理: 没有页表的4MB区域整段跳过, 用户空间中因此变空的页表也一并释放, 最后统一刷新一次tlb.
+ * 内核空间的页表被所有进程的页目录共享, 不能释放 */
+void page_range_unmap(uint32_t vaddr_start, uint32_t pg_cnt) {
+    uint32_t vaddr = vaddr_start;
+    uint32_t vaddr_end = vaddr_start + pg_cnt * PG_SIZE;
+    bool pt_freed = false;
+    struct task_struct* cur = running_thread();
+
+    while (vaddr < vaddr_end) {
+        uint32_t pt_start = vaddr & 0xffc00000;    // 本页表所管理的4MB区域的起始地址
+        uint32_t pt_end = pt_start + 0x400000 < vaddr_end ? pt_start + 0x400000 : vaddr_end;
+        uint32_t* pde = pde_ptr(vaddr);
+        if (!(*pde & PG_P_1)) {    // 整个区域都没有页表, 自然也没有映射
+            vaddr = pt_end;
+            continue;
+        }
+        ASSERT(!(*pde & PG_PS_1));    // 直接映射区的大页不能解除映射
+        uint32_t* pte = pte_ptr(vaddr);
+        while (vaddr < pt_end) {
+            if (*pte & PG_P_1) {
+                uint32_t pg_phy_addr = *pte & 0xfffff000;
+                // 用户空间的页框只能来自用户物理内存池, 内核空间的只能来自内核物理内存池
+                // 文件映射和共享内存的页框属于页缓存或共享内存段, 来自内核物理内存池
+                ASSERT(phy_addr2pool(pg_phy_addr) == (vaddr < 0xc0000000 && !(*pte & PG_SHARED_1) ? &user_pool : &kernel_pool));
+                pfree(pg_phy_addr);
+                if (vaddr < 0xc0000000) {
+                    cur->rss_pages--;
+                }
+            } else if (*pte & PG_SWAP_1) {    // 已换出的页, 释放它的交换槽
+                swap_slot_put(*pte >> 12);
+            }
+            *pte = 0;
+            pte++;
+            vaddr += PG_SIZE;
+        }
+        if (pt_start < 0xc0000000 && page_table_empty(pte_ptr(pt_start))) {
+            pfree(*pde & 0xfffff000);
+            *pde = 0;
+            pt_freed = true;
+            cur->pt_pages--;
+        }
+    }
+    // 释放了页表时, 除了页本身的表项, 处理器可能还缓存着经由该页表的其他转换信息, 故整个刷新
+    tlb_flush_range(vaddr_start, pt_freed ? TLB_FLUSH_ALL_PAGES + 1 : pg_cnt);
+    if (vaddr_start >= 0xc0000000) {    // 内核空间为所有处理器共享, 其他处理器的tlb要等它们下次获取大内核锁时刷新
+        kernel_tlb_gen++;
+    }
 }
 
 /* 在虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址 */
 static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-    uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr, cnt = 0;
+    uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr;
 
     // 先判断一下处理哪个虚拟内存池
     if(pf == PF_KERNEL) {
         bit_idx_start = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt) {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt, 0);
-            cnt++;
-        }
+        bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 0);
     }else{    // 用户虚拟内存池
         struct task_struct* cur_thread = running_thread();
         bit_idx_start = (vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt) {
-            bitmap_set(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt, 0);
-            cnt++;
-        }
+        bitmap_set_range(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 0);
     }
 }
 
 /* 释放以虚拟地址vaddr为起始的"pg_cnt个物理页框" */
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt){
-    uint32_t vaddr = (uint32_t)_vaddr, page_cnt = 0;
+    uint32_t vaddr = (uint32_t)_vaddr;
     ASSERT(pg_cnt >= 1 && vaddr % PG_SIZE == 0);
-    // 获取虚拟地址对应的物理地址
-    uint32_t pg_phy_addr =  addr_v2p(vaddr);
-    // 确保待释放的物理内存位于(低端1MB + 1K大小的页目录+1K大小的页表)地址范围外
-    ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= 0x102000);
-
-    // 下面开始正式工作,先判断一下是从哪个物理内存池中释放页框
-    if(pg_phy_addr >= user_pool.phy_addr_start){ // 位于用户物理内存池
-        // 先减PG_SIZE以便处理while循环的边界条件
-        vaddr -= PG_SIZE;
-        while (page_cnt < pg_cnt){
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            //确保物理地址属于用户物理内存池
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= user_pool.phy_addr_start);
-            // 1. 先将对应的物理页框归还到内存池
-            pfree(pg_phy_addr);
-            // 2. 再从页表中清除此虚拟地址所在的页表项pte
-            page_table_pte_remove(vaddr);
+    ASSERT((pf == PF_USER) == (vaddr < 0xc0000000));
 
-            page_cnt++;
-        }
-        // 3. 清空虚拟地址位图中以_vaddr为起始虚拟地址的连续pg_cnt个位
-        vaddr_remove(pf, _vaddr, pg_cnt);
-    }else{  // 位于内核物理内存池
-        vaddr -= PG_SIZE;
-        while (page_cnt < pg_cnt){
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            // 确保待释放的物理内存只属于内核物理内存池
-            ASSERT((pg_phy_addr % PG_SIZE == 0) && pg_phy_addr >= kernel_pool.phy_addr_start && pg_phy_addr < user_pool.phy_addr_start);
+    // 直接映射区中的内核页: 映射是固定的, 只需把页框还给内核内存池
+    if (pf == PF_KERNEL && vaddr < kernel_vaddr.vaddr_start) {
+        uint32_t pg_phy_addr = vaddr - KERNEL_VBASE;
+        while (pg_cnt-- > 0) {
+            ASSERT(phy_addr2pool(pg_phy_addr) == &kernel_pool);    // 可能是从用户内存池借来的
             pfree(pg_phy_addr);
-            page_table_pte_remove(vaddr);
+            pg_phy_addr += PG_SIZE;
+        }
+        return;
+    }
+    // vmalloc区中的页: 区域的长度记录在vm_area中
+    if (pf == PF_KERNEL && vaddr >= vmalloc_start) {
+        vfree(_vaddr);
+        return;
+    }
+    // 1. 将页框归还到内存池并清除页表项, 按需分页下从未访问过的用户页还没有物理页框, 会被跳过
+    page_range_unmap(vaddr, pg_cnt);
+    // 2. 清空虚拟地址位图中以_vaddr为起始虚拟地址的连续pg_cnt个位
+    vaddr_remove(pf, _vaddr, pg_cnt);
+}
 
-            page_cnt++;
+/* 把物理地址phy_addr起连续pg_cnt页的设备内存(如本地APIC的寄存器)映射到内核虚拟地址, 映射不经过缓存
+ * 设备内存不属于任何物理内存池, 只建映射, 不分配页框. 成功返回起始虚拟地址, 失败返回NULL */
+void* ioremap(uint32_t phy_addr, uint32_t pg_cnt) {
+    ASSERT(pg_cnt > 0 && phy_addr % PG_SIZE == 0);
+    lock_acquire(&kernel_pool.lock);
+    void* vaddr_start = vaddr_get(PF_KERNEL, pg_cnt);
+    if (vaddr_start != NULL) {
+        uint32_t vaddr = (uint32_t)vaddr_start;
+        while (pg_cnt-- > 0) {
+            page_table_add((void*)vaddr, (void*)phy_addr);
+            *pte_ptr(vaddr) |= PG_PCD_1 | PG_PWT_1;
+            asm volatile ("invlpg %0" : : "m"(*(char*)vaddr) : "memory");
+            vaddr += PG_SIZE;
+            phy_addr += PG_SIZE;
         }
-        vaddr_remove(pf, _vaddr, pg_cnt);
     }
+    lock_release(&kernel_pool.lock);
+    return vaddr_start;
+}
+
+/* 解除ioremap建立的从vaddr起pg_cnt页的映射, 页框不是内存池的, 不能交给page_range_unmap去释放 */
+void iounmap(void* vaddr, uint32_t pg_cnt) {
+    lock_acquire(&kernel_pool.lock);
+    uint32_t page_vaddr = (uint32_t)vaddr;
+    uint32_t cnt = pg_cnt;
+    while (cnt-- > 0) {
+        *pte_ptr(page_vaddr) = 0;
+        page_vaddr += PG_SIZE;
+    }
+    tlb_flush_range((uint32_t)vaddr, pg_cnt);
+    kernel_tlb_gen++;
+    vaddr_remove(PF_KERNEL, vaddr, pg_cnt);
+    lock_release(&kernel_pool.lock);
+}
+
+/* 将弹匣mag底部的cnt个内存块归还给mem_block_desc, 调用者须持有相应内存池的锁 */
+static void magazine_drain(enum pool_flags PF, struct mem_magazine* mag, uint32_t cnt) {
+    ASSERT(cnt <= mag->cnt);
+    uint32_t idx;
+    for(idx = 0; idx < cnt; idx++){
+        block_put(PF, mag->blocks[idx]);
+    }
+    // 留下的是最近释放的内存块, 移到弹匣底部
+    for(idx = cnt; idx < mag->cnt; idx++){
+        mag->blocks[idx - cnt] = mag->blocks[idx];
+    }
+    mag->cnt -= cnt;
 }
 
 /* 回收内存ptr的统一接口 */
@@ -517,49 +1550,669 @@ void sys_free(void* ptr) {
     if(ptr != NULL){
         enum pool_flags PF;
         struct pool* mem_pool;    // 物理内存池结构体指针
+        struct mem_block_desc* descs;
+        struct task_struct* cur_thread = running_thread();
 
         // 判断调用本函数的是内核线程还是用户进程
-        if(running_thread()->pgdir == NULL){  // 线程调用的
-            ASSERT((uint32_t)ptr >= K_HEAP_START);
+        if(cur_thread->pgdir == NULL){  // 线程调用的
+            ASSERT((uint32_t)ptr >= KERNEL_VBASE);
             PF = PF_KERNEL;
             mem_pool = &kernel_pool;
+            descs = k_block_descs;
         }else{
             PF = PF_USER;
             mem_pool = &user_pool;
+            descs = cur_thread->u_block_desc;
         }
-        lock_acquire(&mem_pool->lock);    // 访问内存池资源需先加锁
         // 获取ptr所指向的内存块所在的arena指针, 进而获取arena的元信息
         struct mem_block* b = ptr;
         struct arena* a = block2arena(b);  // 获得该内存块对应的arena(b只是该arena中的某个内存块罢了)
         ASSERT(a->large == 0 || a->large == 1);
         if(a->desc == NULL && a->large == true) {  // 说明待释放的内存(也就是ptr指向的内存)并不是在arena中的小内存块，而是大于1024字节的大内存，即>=1个页框，页框数量由元信息决定
+            lock_acquire(&mem_pool->lock);    // 访问内存池资源需先加锁
             mfree_page(PF, a, a->cnt);
-        }else{  // 小于1024的小内存块
-            list_append(&a->desc->free_list, &b->free_elem);  // 先将内存块回收到arena对应的"内存块描述符“free_list中
-            (a->cnt)++;
-
-            // 再判断此arena中的内存块是否都是空闲, 如果是就释放arena
-            if(a->cnt == a->desc->blocks_per_arena) {
-                uint32_t block_idx;
-                for(block_idx = 0; block_idx < a->desc->blocks_per_arena; block_idx++) {
-                    struct mem_block* b = arena2block(a, block_idx);
-                    ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-                    list_remove(&b->free_elem);
+            lock_release(&mem_pool->lock);
+            return;
+        }
+        // 小于1024的小内存块, 先放入当前任务的弹匣
+        uint32_t desc_idx = a->desc - descs;
+        if(desc_idx >= DESC_CNT){    // arena不属于当前任务的块描述符(如fork前由父进程创建的arena), 直接归还
+            lock_acquire(&mem_pool->lock);
+            block_put(PF, b);
+            lock_release(&mem_pool->lock);
+            return;
+        }
+        struct mem_magazine* mag = &cur_thread->mags[desc_idx];
+        if(mag->cnt == MAG_SIZE){    // 弹匣满了, 加锁一次归还MAG_BATCH个内存块
+            lock_acquire(&mem_pool->lock);
+            magazine_drain(PF, mag, MAG_BATCH);
+            lock_release(&mem_pool->lock);
+        }
+        mag->blocks[mag->cnt++] = b;
+    }
+}
+
+/* 将任务pthread弹匣中的内存块全部归还给所属的块描述符
+ * 内核线程退出时调用; 用户进程在fork前调用(此时pthread须为当前进程), 其弹匣退出时随地址空间一并回收, 不需调用 */
+void mem_magazine_drain(struct task_struct* pthread) {
+    enum pool_flags PF = PF_KERNEL;
+    struct pool* mem_pool = &kernel_pool;
+    if(pthread->pgdir != NULL){    // 用户堆中的块只能在它自己的地址空间中归还
+        ASSERT(pthread == running_thread());
+        PF = PF_USER;
+        mem_pool = &user_pool;
+    }
+    uint32_t desc_idx;
+    lock_acquire(&mem_pool->lock);
+    for(desc_idx = 0; desc_idx < DESC_CNT; desc_idx++){
+        struct mem_magazine* mag = &pthread->mags[desc_idx];
+        magazine_drain(PF, mag, mag->cnt);
+    }
+    lock_release(&mem_pool->lock);
+}
+
+/* 在系统空闲时由idle线程调用: 把各内存池的预清0页框补充到ZERO_POOL_MAX个, 一旦有任务就绪就立即停下 */
+void mem_zero_pool_refill(void) {
+    struct pool* pools[2] = {&kernel_pool, &user_pool};
+    uint32_t pool_idx;
+    for (pool_idx = 0; pool_idx < 2; pool_idx++) {
+        struct pool* m_pool = pools[pool_idx];
+        // 空闲页框已降到低水位以下时不再预清0, 免得为此向另一个池借页框
+        while (m_pool->zero_cnt < ZERO_POOL_MAX && m_pool->free_pages > m_pool->low_wmark && thread_ready_empty()) {
+            // 只能关中断不能加锁, idle线程不允许阻塞
+            uint32_t page_phyaddr = (uint32_t)buddy_alloc(m_pool, 0);
+            if (page_phyaddr == 0) {
+                break;
+            }
+            // zero_window只有idle线程使用, 映射-清0-解除映射的过程即使被打断也没关系
+            page_table_add((void*)zero_window, (void*)page_phyaddr);
+            page_zero((void*)zero_window);
+            page_table_pte_remove(zero_window);
+
+            struct page* pg = phy2page(page_phyaddr);
+            enum intr_status old_status = intr_disable();
+            list_push(&m_pool->zero_list, &pg->free_elem);
+            m_pool->zero_cnt++;
+            intr_set_status(old_status);
+        }
+    }
+}
+
+/* 把内存池m_pool的计数器抄到info中 */
+static void pool_meminfo_get(struct pool* m_pool, struct pool_meminfo* info) {
+    info->total_pages = m_pool->total_pages;
+    info->free_pages = m_pool->free_pages + m_pool->zero_cnt;
+    info->zero_pages = m_pool->zero_cnt;
+    info->lent_pages = m_pool->lent_pages;
+    info->borrowed_pages = m_pool->borrowed_pages;
+}
+
+/* 填写内存使用情况info, 各项都是分配释放时随手维护的计数器, 这里只是抄出来, 不扫描位图和空闲链表
+ * 关中断进行, 使各项计数出自同一时刻 */
+void sys_meminfo(struct meminfo* info) {
+    enum intr_status old_status = intr_disable();
+    pool_meminfo_get(&kernel_pool, &info->kernel);
+    pool_meminfo_get(&user_pool, &info->user);
+    info->vmalloc_pages = vmalloc_pages;
+    info->swap_total = swap_slot_cnt;
+    info->swap_free = swap_free_slots;
+    info->swap_out_cnt = swap_out_cnt;
+    info->swap_in_cnt = swap_in_cnt;
+
+    info->slab_pages = 0;
+    struct list_elem* elem = kmem_cache_list.head.next;
+    while (elem != &kmem_cache_list.tail) {
+        struct kmem_cache* cache = elem2entry(struct kmem_cache, cache_tag, elem);
+        info->slab_pages += cache->slab_cnt;
+        elem = elem->next;
+    }
+
+    uint32_t desc_idx;
+    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+        info->blocks[desc_idx].block_size = k_block_descs[desc_idx].block_size;
+        info->blocks[desc_idx].arena_cnt = k_block_descs[desc_idx].arena_cnt;
+        info->blocks[desc_idx].free_blocks = k_block_descs[desc_idx].free_cnt;
+    }
+
+    info->task_cnt = 0;
+    elem = thread_all_list.head.next;
+    while (elem != &thread_all_list.tail && info->task_cnt < MEMINFO_TASK_MAX) {
+        struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, elem);
+        struct task_meminfo* task = &info->tasks[info->task_cnt++];
+        task->pid = pthread->pid;
+        strcpy(task->name, pthread->name);
+        task->rss_pages = pthread->rss_pages;
+        task->pt_pages = pthread->pt_pages;
+        elem = elem->next;
+    }
+    intr_set_status(old_status);
+}
+
+/* 撤销copy_page_tables_cow为子进程建立的用户空间页表: 页框和交换槽各去掉子进程的一个引用, 再释放页表本身
+ * 父进程仍映射着这些页框, 故pfree只会减少共享计数. 用于fork中途失败时回滚, 调用者须已关中断 */
+void cow_page_tables_release(uint32_t* child_pgdir) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    uint32_t pde_idx;
+    for (pde_idx = 0; pde_idx < 768; pde_idx++) {
+        if (!(child_pgdir[pde_idx] & PG_P_1)) {
+            continue;
+        }
+        uint32_t pt_phyaddr = child_pgdir[pde_idx] & 0xfffff000;
+        page_table_add((void*)cow_window, (void*)pt_phyaddr);
+        uint32_t* child_pt = (uint32_t*)cow_window;
+        uint32_t pte_idx;
+        for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+            uint32_t pte = child_pt[pte_idx];
+            if (pte & PG_P_1) {
+                pfree(pte & 0xfffff000);
+            } else if (pte & PG_SWAP_1) {
+                swap_slot_put(pte >> 12);
+            }
+        }
+        page_table_pte_remove(cow_window);
+        pfree(pt_phyaddr);
+        child_pgdir[pde_idx] = 0;
+    }
+}
+
+/* fork时调用, 当前页表须为父进程的: 为子进程复制一份用户空间的页表, 父子双方的页表项都改为只读, 页框本身不复制,
+ * 等任何一方写入时再由缺页处理程序复制(写时复制). 调用者须已关中断, 成功返回true
+ * 内存不足时撤销已为子进程复制的页表并返回false, 父进程被改为只读的页表项留着无妨, 写入时缺页处理程序会恢复可写 */
+bool copy_page_tables_cow(uint32_t* child_pgdir) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    uint32_t pde_idx = 0;
+    while (pde_idx < 768) {    // 只处理用户空间, 内核空间的pde在create_page_dir中已复制
+        uint32_t* parent_pde = pde_ptr(pde_idx * 0x400000);
+        if (*parent_pde & PG_P_1) {
+            // 为子进程申请一页页表, 临时映射到cow_window上以便填写
+            uint32_t pt_phyaddr = (uint32_t)palloc(&kernel_pool);
+            if (pt_phyaddr == 0) {
+                cow_page_tables_release(child_pgdir);
+                asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+                return false;
+            }
+            page_table_add((void*)cow_window, (void*)pt_phyaddr);
+            uint32_t* child_pt = (uint32_t*)cow_window;
+            uint32_t* parent_pt = pte_ptr(pde_idx * 0x400000);    // 父进程页表的第0个pte
+
+            uint32_t pte_idx;
+            for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+                uint32_t pte = parent_pt[pte_idx];
+                if (pte & PG_P_1) {
+                    if (!(pte & PG_SHARED_1)) {    // 文件映射和共享内存的页本来就由父子共享, 保持原有权限
+                        pte &= ~PG_RW_W;    // 父子双方都改为只读
+                        parent_pt[pte_idx] = pte;
+                    }
+                    phy2page(pte & 0xfffff000)->share_cnt++;
+                } else if (pte & PG_SWAP_1) {    // 已换出的页, 父子共用交换槽, 各自换入时各得一份
+                    swap_slot_dup(pte >> 12);
                 }
-                mfree_page(PF, a, 1);
+                child_pt[pte_idx] = pte;    // 未映射的页(含按需分页占下的)保持为0, 子进程访问时由缺页处理程序分配
+            }
+            page_table_pte_remove(cow_window);
+            child_pgdir[pde_idx] = pt_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+        }
+        pde_idx++;
+    }
+    // 父进程的页表项被改为只读, 重新加载cr3使tlb中旧的可写表项失效
+    asm volatile ("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+    return true;
+}
+
+/* 把物理地址为pg_phy_addr的内核页框共享映射到当前进程的用户页vaddr, writable为false时只读
+ * 页框归页缓存或共享内存段所有, 每个映射者使它的共享计数加1, 解除映射时pfree只减少计数 */
+void page_map_shared(uint32_t vaddr, uint32_t pg_phy_addr, bool writable) {
+    ASSERT(vaddr < 0xc0000000 && phy_addr2pool(pg_phy_addr) == &kernel_pool);
+    enum intr_status old_status = intr_disable();
+    phy2page(pg_phy_addr)->share_cnt++;
+    intr_set_status(old_status);
+    page_table_add((void*)vaddr, (void*)pg_phy_addr);
+    uint32_t* pte = pte_ptr(vaddr);
+    *pte |= PG_SHARED_1;
+    if (!writable) {
+        *pte &= ~PG_RW_W;
+    }
+}
+
+/* 若当前进程的用户页vaddr已映射且被写过, 清除其页表项的D位并返回true, 否则返回false */
+bool page_test_clear_dirty(uint32_t vaddr) {
+    if (!(*pde_ptr(vaddr) & PG_P_1)) {
+        return false;
+    }
+    uint32_t* pte = pte_ptr(vaddr);
+    if ((*pte & (PG_P_1 | PG_D_1)) != (PG_P_1 | PG_D_1)) {
+        return false;
+    }
+    *pte &= ~PG_D_1;
+    asm volatile ("invlpg %0" : : "m"(*(char*)vaddr) : "memory");    // tlb中的表项D位仍为1时处理器不会再去置位
+    return true;
+}
+
+/* 写时复制: 处理对用户页vaddr_page的写保护异常, 成功返回true */
+static bool cow_page_fault(uint32_t vaddr_page) {
+    uint32_t* pte = pte_ptr(vaddr_page);
+    uint32_t old_phyaddr = *pte & 0xfffff000;
+    ASSERT(phy_addr2pool(old_phyaddr) == &user_pool);
+    struct page* pg = phy2page(old_phyaddr);
+
+    if (pg->share_cnt == 0) {    // 其他共享者都已复制或退出, 本进程是唯一的映射者, 恢复可写即可
+        *pte |= PG_RW_W;
+        asm volatile ("invlpg %0" : : "m"(*(char*)vaddr_page) : "memory");
+        return true;
+    }
+    uint32_t new_phyaddr = (uint32_t)user_palloc();
+    if (new_phyaddr == 0) {
+        return false;
+    }
+    // user_palloc可能在直接回收时睡眠, 期间本页可能被换出, 其他共享者也可能已退出, 要重新检查
+    if ((*pte & (0xfffff000 | PG_P_1 | PG_RW_W)) != (old_phyaddr | PG_P_1)) {
+        pfree(new_phyaddr);    // 页表项已变, 返回后重新执行写指令, 仍需处理时会再次缺页
+        return true;
+    }
+    if (pg->share_cnt == 0) {
+        pfree(new_phyaddr);
+        *pte |= PG_RW_W;
+        asm volatile ("invlpg %0" : : "m"(*(char*)vaddr_page) : "memory");
+        return true;
+    }
+    // 新页框临时映射到cow_window上, 将共享页框的内容复制过去
+    page_table_add((void*)cow_window, (void*)new_phyaddr);
+    memcpy((void*)cow_window, (void*)vaddr_page, PG_SIZE);
+    page_table_pte_remove(cow_window);
+
+    *pte = new_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+    asm volatile ("invlpg %0" : : "m"(*(char*)vaddr_page) : "memory");
+    pg->share_cnt--;
+    return true;
+}
+
+/***************************** 交换 **********************************/
+/* 分配一个空闲交换槽并把引用计数置为1, 返回槽号, 交换分区已满时返回-1 */
+static int32_t swap_slot_alloc(void) {
+    enum intr_status old_status = intr_disable();
+    if (swap_free_slots == 0) {
+        intr_set_status(old_status);
+        return -1;
+    }
+    uint32_t slot = swap_hint;
+    while (swap_map[slot] != 0) {
+        slot = (slot + 1) % swap_slot_cnt;
+    }
+    swap_map[slot] = 1;
+    swap_free_slots--;
+    swap_hint = (slot + 1) % swap_slot_cnt;
+    intr_set_status(old_status);
+    return slot;
+}
+
+/* fork时子进程也引用了交换槽slot */
+static void swap_slot_dup(uint32_t slot) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(slot < swap_slot_cnt && swap_map[slot] > 0 && swap_map[slot] < 0xffff);
+    swap_map[slot]++;
+    intr_set_status(old_status);
+}
+
+/* 去掉交换槽slot的一个引用, 没有引用了就成为空闲槽 */
+static void swap_slot_put(uint32_t slot) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(slot < swap_slot_cnt && swap_map[slot] > 0);
+    if (--swap_map[slot] == 0) {
+        swap_free_slots++;
+    }
+    intr_set_status(old_status);
+}
+
+/* 在物理页框pg_phy_addr与交换槽slot之间传送一页, write为true时写入交换分区. 调用者须持有swap_lock */
+static void swap_io(uint32_t pg_phy_addr, uint32_t slot, bool write) {
+    // 用户页框可能在直接映射区之外, 临时映射到swap_window上
+    enum intr_status old_status = intr_disable();
+    page_table_add((void*)swap_window, (void*)pg_phy_addr);
+    intr_set_status(old_status);
+    uint32_t lba = swap_part->start_lba + slot * SWAP_SLOT_SECTS;
+    if (write) {
+        ide_write(swap_part->my_disk, lba, (void*)swap_window, SWAP_SLOT_SECTS);
+    } else {
+        ide_read(swap_part->my_disk, lba, (void*)swap_window, SWAP_SLOT_SECTS);
+    }
+    page_table_pte_remove(swap_window);
+}
+
+/* 返回时钟指针所在的用户进程: pid不小于clock_pid的用户进程中pid最小的一个, 没有则回绕到pid最小的用户进程, 并置*wrapped为true
+ * 没有用户进程时返回NULL. 指针移到了另一个进程时从其用户空间的起点开始. 调用者须已关中断 */
+static struct task_struct* clock_task(bool* wrapped) {
+    struct task_struct* next = NULL;
+    struct task_struct* first = NULL;
+    struct list_elem* elem = thread_all_list.head.next;
+    while (elem != &thread_all_list.tail) {
+        struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, elem);
+        elem = elem->next;
+        // 退出后挂起等待父进程回收的进程已没有用户页; 正在别的处理器上运行的进程的表项可能缓存在那个处理器的tlb中, 也跳过
+        if (pthread->pgdir == NULL || pthread->status == TASK_HANGING || pthread->status == TASK_DIED
+            || (pthread->status == TASK_RUNNING && pthread != running_thread())) {
+            continue;
+        }
+        if (first == NULL || pthread->pid < first->pid) {
+            first = pthread;
+        }
+        if (pthread->pid >= clock_pid && (next == NULL || pthread->pid < next->pid)) {
+            next = pthread;
+        }
+    }
+    if (next == NULL) {
+        next = first;
+        *wrapped = true;
+    }
+    if (next != NULL && next->pid != clock_pid) {
+        clock_pid = next->pid;
+        clock_vaddr = 0;
+    }
+    return next;
+}
+
+/* 时钟指针在进程pthread的用户空间中前进, 最多查看SWAP_SCAN_BATCH个页表项:
+ * A位为1的页最近被访问过, 清掉A位放过它这一圈(二次机会); 遇到A位为0的页就为它分配交换槽, 页表项改为交换项,
+ * 返回它原来的页框并把槽号存入*slot. 没有找到返回0. 调用者须已关中断并持有swap_lock */
+static uint32_t clock_pick(struct task_struct* pthread, uint32_t* slot) {
+    bool is_cur = pthread == running_thread();
+    uint32_t budget = SWAP_SCAN_BATCH;
+    while (budget-- > 0 && clock_vaddr < 0xc0000000) {
+        // 通过直接映射区访问该进程的页目录和页表, 它不必是当前进程
+        uint32_t pde = pthread->pgdir[PDE_IDX(clock_vaddr)];
+        if (!(pde & PG_P_1)) {    // 整个4MB区域都没有页表
+            clock_vaddr = (clock_vaddr & 0xffc00000) + 0x400000;
+            continue;
+        }
+        uint32_t* pte = (uint32_t*)((pde & 0xfffff000) + KERNEL_VBASE) + PTE_IDX(clock_vaddr);
+        uint32_t vaddr = clock_vaddr;
+        clock_vaddr += PG_SIZE;
+        // 文件映射和共享内存的页框不属于进程私有, 不换出
+        if (!(*pte & PG_P_1) || (*pte & PG_SHARED_1)) {
+            continue;
+        }
+        uint32_t pg_phy_addr = *pte & 0xfffff000;
+        // 写时复制共享着的页框被多个页表项映射着, 也不换出
+        if (phy_addr2pool(pg_phy_addr) != &user_pool || phy2page(pg_phy_addr)->share_cnt > 0) {
+            continue;
+        }
+        if (*pte & PG_A_1) {
+            *pte &= ~PG_A_1;
+            if (is_cur) {    // 其他进程的tlb在切换页表时已刷出
+                asm volatile ("invlpg %0" : : "m"(*(char*)vaddr) : "memory");
+            }
+            continue;
+        }
+        int32_t slot_idx = swap_slot_alloc();
+        if (slot_idx == -1) {
+            return 0;
+        }
+        *pte = ((uint32_t)slot_idx << 12) | PG_SWAP_1;
+        if (is_cur) {
+            asm volatile ("invlpg %0" : : "m"(*(char*)vaddr) : "memory");
+        }
+        pthread->rss_pages--;
+        *slot = slot_idx;
+        return pg_phy_addr;
+    }
+    return 0;
+}
+
+/* 时钟(二次机会)置换: 指针依次扫过各用户进程的用户页, 换出want页为止. 指针转过两整圈(所有页的A位都清过一遍)仍不够,
+ * 或交换分区已满时提前结束. 返回换出的页数, 调用者须持有swap_lock */
+static uint32_t swap_scan(uint32_t want) {
+    uint32_t swapped_cnt = 0;
+    uint32_t wraps = 0;    // 第一圈从指针当前位置开始, 只是半圈, 故要回绕3次
+    while (swapped_cnt < want && wraps < 3 && swap_free_slots > 0) {
+        // 选页和改页表项都在关中断下进行, 期间页表不会被其所属进程修改或释放
+        enum intr_status old_status = intr_disable();
+        bool wrapped = false;
+        struct task_struct* pthread = clock_task(&wrapped);
+        if (pthread == NULL) {
+            intr_set_status(old_status);
+            break;
+        }
+        wraps += wrapped;
+        uint32_t slot = 0;
+        uint32_t pg_phy_addr = clock_pick(pthread, &slot);
+        if (pg_phy_addr == 0 && clock_vaddr >= 0xc0000000) {    // 这个进程扫完了, 移到下一个
+            clock_pid++;
+        }
+        intr_set_status(old_status);
+        if (pg_phy_addr == 0) {
+            continue;
+        }
+        // 页表项已是交换项, 所属进程再访问该页会在换入时等待swap_lock, 等到写完才读回
+        swap_io(pg_phy_addr, slot, true);
+        pfree(pg_phy_addr);
+        swapped_cnt++;
+        swap_out_cnt++;
+    }
+    return swapped_cnt;
+}
+
+/* 用户内存池的空闲页框低于低水位时把kswapd加入它的工作队列, 它还没开始执行时多次加入只算一次 */
+static void kswapd_wakeup(void) {
+    if (user_pool.free_pages < user_pool.low_wmark) {
+        queue_work(&kswapd_wq, &kswapd_work);
+    }
+}
+
+/* 为用户页申请一个页框: 用户内存池耗尽时就地换出一批页再试(直接回收), 仍失败才返回NULL */
+static void* user_palloc(void) {
+    void* page_phyaddr = palloc(&user_pool);
+    if (page_phyaddr == NULL && swap_part != NULL) {
+        lock_acquire(&swap_lock);
+        swap_scan(SWAP_CLUSTER);
+        lock_release(&swap_lock);
+        page_phyaddr = palloc(&user_pool);
+    }
+    if (swap_part != NULL) {
+        kswapd_wakeup();
+    }
+    return page_phyaddr;
+}
+
+/* 把当前进程已换出的用户页vaddr_page换回内存, 成功返回true, 内存不足返回false */
+static bool swap_in(uint32_t vaddr_page) {
+    lock_acquire(&swap_lock);
+    uint32_t* pte = pte_ptr(vaddr_page);
+    ASSERT(!(*pte & PG_P_1) && (*pte & PG_SWAP_1));
+    uint32_t slot = *pte >> 12;
+    void* page_phyaddr = user_palloc();
+    if (page_phyaddr == NULL) {
+        lock_release(&swap_lock);
+        return false;
+    }
+    swap_io((uint32_t)page_phyaddr, slot, false);
+    *pte = 0;
+    page_table_add((void*)vaddr_page, page_phyaddr);
+    swap_slot_put(slot);    // fork后共用此槽的其他进程换入时各自读一份
+    swap_in_cnt++;
+    lock_release(&swap_lock);
+    return true;
+}
+
+/* kswapd: 用户内存池的空闲页框低于低水位时由名为kswapd的工作线程执行, 提前换出页直到回到高水位, 使进程申请页框时少有就地换出的等待
+ * 换出要等硬盘, 故不能放在软中断中, 而要在可以睡眠的工作线程里做 */
+static void kswapd(void* arg UNUSED) {
+    while (user_pool.free_pages < user_pool.high_wmark) {
+        lock_acquire(&swap_lock);
+        uint32_t swapped_cnt = swap_scan(SWAP_CLUSTER);
+        lock_release(&swap_lock);
+        if (swapped_cnt == 0) {    // 没有可换出的页了, 等下次低于低水位时再试
+            break;
+        }
+    }
+}
+
+/* 启用交换: 使用partition_scan找到的第一个类型为交换分区的分区, 并准备好kswapd. 没有交换分区时不换页, 内存耗尽时申请失败 */
+void swap_init(void) {
+    put_str("swap_init start\n");
+    struct partition* part = NULL;
+    struct list_elem* elem = partition_list.head.next;
+    while (elem != &partition_list.tail) {
+        struct partition* p = elem2entry(struct partition, part_tag, elem);
+        if (p->fs_type == PART_TYPE_SWAP) {
+            part = p;
+            break;
+        }
+        elem = elem->next;
+    }
+    if (part == NULL || part->sec_cnt < SWAP_SLOT_SECTS) {
+        put_str("   no swap partition, swapping disabled\n");
+        return;
+    }
+    swap_slot_cnt = part->sec_cnt / SWAP_SLOT_SECTS;
+    swap_map = vmalloc(DIV_ROUND_UP(swap_slot_cnt * sizeof(uint16_t), PG_SIZE));    // 已清0, 即所有槽都空闲
+    if (swap_map == NULL) {
+        swap_slot_cnt = 0;
+        put_str("   alloc swap_map failed, swapping disabled\n");
+        return;
+    }
+    swap_free_slots = swap_slot_cnt;
+    lock_init(&swap_lock);
+    put_str("   swap partition: ");
+    put_str(part->name);
+    put_str(", slots: ");
+    put_int(swap_slot_cnt);
+    put_char('\n');
+    workqueue_setup(&kswapd_wq, "kswapd", 16);
+    work_init(&kswapd_work, kswapd, NULL);
+    swap_part = part;    // 最后才启用, 此后用户内存池耗尽时会换页
+    put_str("swap_init done\n");
+}
+
+/* 缺页异常(0xe号中断)处理程序: 为用户进程已占下虚拟地址但还没有物理页框的页(堆、bss)以及向下增长的用户栈分配页框,
+ * 并处理fork后对共享页的写入(写时复制). 中断门进入后已关中断, 但分配页框时可能因直接回收而睡眠, 换出的页和文件映射区的页
+ * 也要从硬盘读入(分别在swap_lock和页缓存的锁下进行), 睡眠期间页表项可能被改变, 所以睡眠之后要重新检查 */
+static void page_fault_handler(uint32_t vec_nr) {
+    // 中断入口压入的中断向量号就是本函数的参数, 它所在的位置就是中断栈intr_stack的起始
+    struct intr_stack* frame = (struct intr_stack*)&vec_nr;
+    uint32_t fault_vaddr;
+    asm volatile ("movl %%cr2, %0" : "=r"(fault_vaddr));    // cr2是存放造成page fault的虚拟地址
+    struct task_struct* cur = running_thread();
+
+    // 写只读的用户页: fork后共享的页框, 复制一份
+    if ((frame->err_code & PF_ERR_P) && (frame->err_code & PF_ERR_W) && cur->pgdir != NULL && fault_vaddr >= USER_VADDR_START && fault_vaddr < 0xc0000000
+        && !(*pte_ptr(fault_vaddr) & PG_SHARED_1)) {    // 只读的文件映射页不能写
+        if (cow_page_fault(fault_vaddr & 0xfffff000)) {
+            cur->min_flt++;
+            return;
+        }
+    }
+    if (!(frame->err_code & PF_ERR_P) && cur->pgdir != NULL && fault_vaddr >= USER_VADDR_START && fault_vaddr < 0xc0000000) {
+        uint32_t vaddr_page = fault_vaddr & 0xfffff000;
+        // 被换出的页从交换分区读回
+        bool swapped = (*pde_ptr(vaddr_page) & PG_P_1) && (*pte_ptr(vaddr_page) & PG_SWAP_1);
+        if (swapped && swap_in(vaddr_page)) {
+            cur->maj_flt++;
+            return;
+        }
+        // 文件映射区中的页从页缓存映射进来, 不分配清0的页框
+        int32_t mapped = swapped ? -1 : mmap_fault(vaddr_page);
+        if (mapped == 1) {
+            cur->min_flt++;
+            return;
+        }
+        uint32_t bit_idx = (vaddr_page - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
+        bool reserved = bitmap_scan_test(&cur->userprog_vaddr.vaddr_bitmap, bit_idx);
+        // 用户栈从USER_STACK3_VADDR向下按需增长, 最多到USER_STACK_BOTTOM; 只有落在用户栈顶之上或紧挨其下(pushad一次压入32字节)的访问
+        // 才算栈的增长, 栈区中远离栈顶的访问是野指针. 内核态的缺页(系统调用访问用户缓冲区)以进入内核时的用户栈顶为准
+        struct intr_stack* user_frame = (frame->cs & 3) == RPL3 ? frame : (struct intr_stack*)((uint32_t)cur + PG_SIZE - sizeof(struct intr_stack));
+        if (!reserved && vaddr_page >= USER_STACK_BOTTOM && fault_vaddr >= (uint32_t)user_frame->esp - STACK_GROW_SLACK) {
+            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
+            reserved = true;
+        }
+        if (reserved && mapped == 0) {
+            void* page_phyaddr = palloc_prezeroed(&user_pool);
+            bool zeroed = page_phyaddr != NULL;
+            if (!zeroed) {
+                page_phyaddr = user_palloc();
+            }
+            if (page_phyaddr != NULL) {
+                page_table_add((void*)vaddr_page, page_phyaddr);
+                if (!zeroed) {
+                    page_zero((void*)vaddr_page);
+                }
+                cur->min_flt++;
+                return;
+            }
+        }
+    }
+    // 访问了未占用的地址、违反了页保护属性或内存已耗尽, 都无法恢复
+    put_str("\npage fault address is ");
+    put_int(fault_vaddr);
+    put_str(" error code is ");
+    put_int(frame->err_code);
+    if ((frame->cs & 3) != RPL3) {    // 内核自身出错, 无法继续运行
+        PANIC("page_fault_handler: unrecoverable page fault");
+    }
+    // 用户态的错误只结束出错的进程, 它不会再返回
+    put_str(", killing ");
+    put_str(cur->name);
+    put_char('\n');
+    sys_exit(-1);
+}
+
+/* 若处理器支持全局页, 把内核空间已有的页表项都标记为全局页并开启cr4的PGE位 */
+static void global_pages_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 13))) {    // cpuid功能号1返回的edx第13位为PGE
+        put_str("   global pages not supported\n");
+        return;
+    }
+    // 内核空间的页表在loader中已全部建好, 被所有进程的页目录共享
+    // loader把第768个pde的页表同时装在了第0个pde上, 用作低端1MB的恒等映射(AP的蹦床代码也靠它), 这张页表不能标记为全局页,
+    // 否则用户可访问的低端虚拟地址的tlb表项在切换页目录后仍然有效
+    identity_pt = *pde_ptr(0) & PG_P_1 ? *pde_ptr(0) & 0xfffff000 : 0;
+    uint32_t pde_idx;
+    for (pde_idx = 768; pde_idx < 1023; pde_idx++) {
+        uint32_t* pde = pde_ptr(pde_idx * 0x400000);
+        if (!(*pde & PG_P_1)) {
+            continue;
+        }
+        if (*pde & PG_PS_1) {    // 4MB大页的G位在页目录项中
+            *pde |= PG_G_1;
+            continue;
+        }
+        if ((*pde & 0xfffff000) == identity_pt) {
+            continue;
+        }
+        uint32_t* pt = pte_ptr(pde_idx * 0x400000);
+        uint32_t pte_idx;
+        for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+            if (pt[pte_idx] & PG_P_1) {
+                pt[pte_idx] |= PG_G_1;
             }
         }
-        lock_release(&mem_pool->lock);
     }
+    kernel_pte_global = PG_G_1;
+    asm volatile ("movl %%cr4, %%eax; orl $0x80, %%eax; movl %%eax, %%cr4" : : : "eax", "memory");
 }
 
 /* 内存管理部分初始化入口 */
 void mem_init() {
     put_str("mem_init start\n");
-    uint32_t mem_bytes_total = (*(uint32_t*)(0xb00));
+    struct mem_range ranges[ARDS_MAX];
+    uint32_t range_cnt = mem_ranges_get(ranges);
     // 初始化内存池
-    mem_pool_init(mem_bytes_total);
+    mem_pool_init(ranges, range_cnt);
     // 初始化mem_block_desc数组descs,为malloc做准备
     block_desc_init(k_block_descs);
+    // 初始化对象缓存, 为kmem_cache_create做准备
+    kmem_cache_init();
+    // 初始化vmalloc区, 它的区域描述符来自对象缓存
+    vmalloc_init();
+    // 为idle线程清0页框以及写时复制各预留一页内核虚拟地址
+    zero_window = (uint32_t)vaddr_get(PF_KERNEL, 1);
+    cow_window = (uint32_t)vaddr_get(PF_KERNEL, 1);
+    swap_window = (uint32_t)vaddr_get(PF_KERNEL, 1);
+    // 开启cr0的WP位, 使内核代替进程写只读的用户页(如sys_read写入用户缓冲区)时同样触发写时复制
+    asm volatile ("movl %%cr0, %%eax; orl $0x10000, %%eax; movl %%eax, %%cr0" : : : "eax", "memory");
+    // 内核映射标记为全局页, 进程切换时不再被刷出tlb
+    global_pages_init();
+    // 注册缺页异常处理程序, 实现用户空间的按需分页
+    register_handler(0x0e, page_fault_handler);
     put_str("mem_init done\n");
 }
\ No newline at end of file
@@ -16,6 +16,14 @@ enum pool_flags {
 #define PG_RW_W      2    // R/W属性位的值，可读可写可执行
 #define PG_US_S        0    // U/S属性位的值，系统级
 #define PG_US_U       4    // U/S属性位的值，用户级
+#define PG_G_1        0x100    // 页表项的G位, 全局页在重新加载cr3时不会被刷出tlb, 只用于内核空间
+#define PG_PS_1       0x80     // 页目录项的PS位, 为1时该页目录项直接映射一个4MB的大页, 不再经过页表
+#define PG_A_1        0x20     // 页表项的A位, 处理器访问该页时置1
+#define PG_D_1        0x40     // 页表项的D位, 处理器写入该页时置1
+#define PG_SHARED_1   0x200    // 页表项中留给软件的位: 映射的是文件页缓存或共享内存段的页框, 写入时不做写时复制
+#define PG_SWAP_1     0x400    // P位为0的页表项中的软件位: 该页已换出, 页表项高20位是交换槽号
+#define PG_PWT_1      0x8      // 页表项的PWT位, 写直通
+#define PG_PCD_1      0x10     // 页表项的PCD位, 为1时该页不经过缓存, 用于映射设备寄存器
 
 /* 虚拟地址池, 用于虚拟地址管理 */
 struct virtual_addr{
@@ -23,6 +31,17 @@ struct virtual_addr{
     uint32_t vaddr_start;          // 虚拟地址起始地址
 };
 
+/* 物理页框描述符, 每个物理页框对应一个, 伙伴系统用它把空闲块串到各阶链表上 */
+struct page {
+    struct list_elem free_elem;    // 若本页框是空闲块的首页框, 用此元素挂到free_area[order]上
+    uint8_t order;                 // 空闲块的阶, 块大小为2^order页, 仅在首页框中有效
+    uint8_t flags;
+    uint16_t share_cnt;            // 写时复制: 除第一个映射者外, 还有多少个页表项映射着本页框
+};
+#define PAGE_BUDDY      1    // 本页框是伙伴系统中某个空闲块的首页框
+#define PAGE_LENT       2    // 本页框已借给另一个内存池, 由它分配和回收
+#define BUDDY_ORDER_CNT 11   // 伙伴系统的阶数, 最大块为2^10页即4MB
+
 /* 内存块 */
 struct mem_block {
     struct list_elem free_elem;
@@ -33,26 +52,97 @@ struct mem_block_desc{
     uint32_t block_size;       // 内存块大小
     uint32_t blocks_per_arena; // 本arena中可容纳此mem_block的数量
     struct list free_list;     // 目前可用的mem_block链表
+    uint32_t empty_arenas;     // 所有内存块都空闲、暂不归还页框的arena数, 其内存块仍留在free_list中
+    uint32_t arena_cnt;        // 本规格当前拥有的arena数
+    uint32_t free_cnt;         // free_list中的内存块数, 弹匣中缓存的块不算
 };
 #define DESC_CNT 7    // 内存块描述符的个数
+#define ARENA_EMPTY_MAX 2    // 每种规格最多保留的空arena数, 超过时才把变空的arena的页框还给内存池
+
+/* 内存块弹匣: 每个任务为每种规格的内存块缓存一小摞空闲块, 分配和释放先在弹匣中进行, 不用加锁 */
+#define MAG_SIZE  8            // 弹匣容量
+#define MAG_BATCH (MAG_SIZE / 2)   // 弹匣空或满时, 一次从mem_block_desc补充或归还的内存块数
+struct mem_magazine {
+    uint32_t cnt;                         // 弹匣中的内存块数
+    struct mem_block* blocks[MAG_SIZE];   // 空闲内存块栈, blocks[cnt - 1]为栈顶
+};
+
+/* sys_meminfo的输出: 物理内存池、内核堆和各任务的内存使用情况, 除注明外单位均为页 */
+struct pool_meminfo {
+    uint32_t total_pages;       // 本池所辖的可用页框数(不含空洞)
+    uint32_t free_pages;        // 空闲页框数, 含预先清0的和借来的
+    uint32_t zero_pages;        // 其中idle线程预先清0的页框数
+    uint32_t lent_pages;        // 借给另一个池尚未收回的页框数
+    uint32_t borrowed_pages;    // 从另一个池借来尚未归还的页框数
+};
+struct block_meminfo {
+    uint32_t block_size;        // 内存块规格, 单位字节
+    uint32_t arena_cnt;
+    uint32_t free_blocks;
+};
+struct task_meminfo {
+    int16_t pid;
+    char name[16];
+    uint32_t rss_pages;         // 映射着的用户页框数
+    uint32_t pt_pages;          // 用户空间的页表数
+};
+#define MEMINFO_TASK_MAX 32
+struct meminfo {
+    struct pool_meminfo kernel, user;
+    uint32_t vmalloc_pages;     // vmalloc区中映射着的页数
+    uint32_t slab_pages;        // 各对象缓存的slab占用的页框数
+    uint32_t swap_total;        // 交换分区的槽数, 一槽存一页, 没有交换分区时为0
+    uint32_t swap_free;         // 空闲的交换槽数
+    uint32_t swap_out_cnt;      // 累计换出的页数
+    uint32_t swap_in_cnt;       // 累计换入的页数
+    struct block_meminfo blocks[DESC_CNT];    // 内核堆各规格内存块
+    uint32_t task_cnt;
+    struct task_meminfo tasks[MEMINFO_TASK_MAX];
+};
 
 extern struct pool kernel_pool, user_pool;
 void mem_init(void);
 void* get_kernel_pages(uint32_t pg_cnt);
+void* get_kernel_pages_contig(uint32_t pg_cnt);
+void* get_kernel_pages_nozero(uint32_t pg_cnt);
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt);
+void* vmalloc(uint32_t pg_cnt);
+void* vmalloc_nozero(uint32_t pg_cnt);
+void vfree(void* _vaddr);
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 void malloc_init(void);
 uint32_t* pte_ptr(uint32_t vaddr);
 uint32_t* pde_ptr(uint32_t vaddr);
 uint32_t addr_v2p(uint32_t vaddr);
+bool vaddr_is_mapped(uint32_t vaddr);
+void user_page_reserve(uint32_t vaddr);
+void user_heap_init(void);
+uint32_t sys_brk(uint32_t new_brk);
+bool copy_page_tables_cow(uint32_t* child_pgdir);
+void cow_page_tables_release(uint32_t* child_pgdir);
+void page_map_shared(uint32_t vaddr, uint32_t pg_phy_addr, bool writable);
+bool page_test_clear_dirty(uint32_t vaddr);
 
 void* get_a_page(enum pool_flags pf, uint32_t vaddr);
 void* get_user_pages(uint32_t pg_cnt);
+void free_user_pages(void* vaddr, uint32_t pg_cnt);
 
 void block_desc_init(struct mem_block_desc* desc_array);
 void* sys_malloc(uint32_t size);
+void* sys_realloc(void* ptr, uint32_t size);
+void* sys_malloc_aligned(uint32_t size, uint32_t align);
+void page_range_unmap(uint32_t vaddr_start, uint32_t pg_cnt);
+void* ioremap(uint32_t phy_addr, uint32_t pg_cnt);
+void iounmap(void* vaddr, uint32_t pg_cnt);
+void kernel_tlb_sync(uint32_t* seen_gen);
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
 void pfree(uint32_t pg_phy_addr);
 void sys_free(void* ptr);
 void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr);
 void free_a_phy_page(uint32_t pg_phy_addr);
+struct task_struct;
+void mem_magazine_drain(struct task_struct* pthread);
+void mem_zero_pool_refill(void);
+void swap_init(void);
+void sys_meminfo(struct meminfo* info);
 #endif
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include "slab.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "memory.h"
+#include "string.h"
+#include "sync.h"
+#include "list.h"
+#include "print.h"
+
+#define SLAB_FREE_END 0xffff    // 空闲对象链表的结束标记
+
+/* slab: 一个页框, 页首是slab描述符和空闲对象链表数组, 其后依次排布着objs_per_slab个对象
+ * 空闲对象链表不借用对象本身的空间, 这样构造过的对象在释放后仍保持构造后的状态 */
+struct slab {
+    struct kmem_cache* cache;    // 本slab所属的对象缓存
+    struct list_elem slab_tag;   // 用于加入所属缓存的partial/full/empty链表
+    uint32_t inuse;              // 已分配出去的对象数
+    uint16_t free_idx;           // 空闲对象链表的表头(对象下标)
+    uint16_t unused_idx;         // 从未分配过的第一个对象的下标, 新对象按此顺序分配, 免去建slab时遍历所有对象
+    uint16_t next_free[];        // next_free[i]为链表中第i号对象之后的空闲对象下标
+};
+
+struct list kmem_cache_list;             // 所有对象缓存, 用于统计
+static struct kmem_cache cache_cache;    // 用来分配kmem_cache结构本身的缓存
+
+/* 计算对象尺寸为obj_size的缓存中每个slab可容纳的对象数和对象区偏移, 一页容纳不下一个对象时返回false */
+static bool slab_layout(struct kmem_cache* cache) {
+    uint32_t cnt = (PG_SIZE - sizeof(struct slab)) / (cache->obj_size + sizeof(uint16_t));
+    uint32_t offset = 0;
+    while (cnt > 0) {
+        offset = DIV_ROUND_UP(sizeof(struct slab) + cnt * sizeof(uint16_t), 4) * 4;
+        if (offset + cnt * cache->obj_size <= PG_SIZE) {
+            break;
+        }
+        cnt--;    // 描述符按4字节对齐后放不下了, 少放一个
+    }
+    cache->objs_per_slab = cnt;
+    cache->objs_offset = offset;
+    return cnt > 0;
+}
+
+/* 初始化对象缓存cache的各字段 */
+static void cache_init(struct kmem_cache* cache, const char* name, uint32_t size, void (*ctor)(void*)) {
+    memset(cache, 0, sizeof(struct kmem_cache));
+    strcpy(cache->name, name);
+    cache->obj_size = DIV_ROUND_UP(size, 4) * 4;
+    cache->ctor = ctor;
+    list_init(&cache->slabs_partial);
+    list_init(&cache->slabs_full);
+    list_init(&cache->slabs_empty);
+    lock_init(&cache->lock);
+}
+
+/* 为cache新建一个slab, 失败返回NULL */
+static struct slab* slab_grow(struct kmem_cache* cache) {
+    struct slab* s = get_kernel_pages(1);    // 对象要被所有任务共享, 故slab一律来自内核内存池
+    if (s == NULL) {
+        return NULL;
+    }
+    s->cache = cache;
+    s->inuse = 0;
+    s->free_idx = SLAB_FREE_END;
+    s->unused_idx = 0;
+    cache->slab_cnt++;
+    cache->grow_cnt++;
+    return s;
+}
+
+/* 把空slab s的页框归还内核内存池 */
+static void slab_destroy(struct kmem_cache* cache, struct slab* s) {
+    ASSERT(s->inuse == 0);
+    cache->slab_cnt--;
+    free_kernel_pages(s, 1);
+}
+
+/* 返回slab s中第obj_idx个对象的地址 */
+static void* slab_obj(struct slab* s, uint32_t obj_idx) {
+    return (uint8_t*)s + s->cache->objs_offset + obj_idx * s->cache->obj_size;
+}
+
+/* 初始化对象缓存子系统 */
+void kmem_cache_init(void) {
+    put_str("   kmem_cache_init start\n");
+    list_init(&kmem_cache_list);
+    cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), NULL);
+    slab_layout(&cache_cache);
+    list_append(&kmem_cache_list, &cache_cache.cache_tag);
+    put_str("   kmem_cache_init done\n");
+}
+
+/* 创建名为name、对象尺寸为size的对象缓存, ctor为对象构造函数, 为NULL时每次分配的对象都已清0
+ * 成功返回缓存指针, 失败(对象大于一页或内存不足)返回NULL */
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void*)) {
+    ASSERT(size > 0 && strlen(name) < KMEM_NAME_LEN);
+    struct kmem_cache* cache = kmem_cache_alloc(&cache_cache);
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache_init(cache, name, size, ctor);
+    if (!slab_layout(cache)) {
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    lock_acquire(&cache_cache.lock);
+    list_append(&kmem_cache_list, &cache->cache_tag);
+    lock_release(&cache_cache.lock);
+    return cache;
+}
+
+/* 从对象缓存cache中分配一个对象, 失败返回NULL */
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+    struct slab* s;
+    lock_acquire(&cache->lock);
+
+    // 优先从部分分配的slab中取, 其次取空slab, 都没有才新建slab
+    if (!list_empty(&cache->slabs_partial)) {
+        s = elem2entry(struct slab, slab_tag, cache->slabs_partial.head.next);
+    } else if (!list_empty(&cache->slabs_empty)) {
+        s = elem2entry(struct slab, slab_tag, list_pop(&cache->slabs_empty));
+        cache->empty_cnt--;
+        list_push(&cache->slabs_partial, &s->slab_tag);
+    } else {
+        s = slab_grow(cache);
+        if (s == NULL) {
+            lock_release(&cache->lock);
+            return NULL;
+        }
+        list_push(&cache->slabs_partial, &s->slab_tag);
+    }
+
+    uint32_t obj_idx;
+    void* obj;
+    if (s->free_idx != SLAB_FREE_END) {    // 先复用释放过的对象
+        obj_idx = s->free_idx;
+        s->free_idx = s->next_free[obj_idx];
+        obj = slab_obj(s, obj_idx);
+        if (cache->ctor == NULL) {
+            memset(obj, 0, cache->obj_size);
+        }
+    } else {    // 再取从未分配过的对象, slab页来自get_kernel_pages, 已经清0
+        ASSERT(s->unused_idx < cache->objs_per_slab);
+        obj_idx = s->unused_idx++;
+        obj = slab_obj(s, obj_idx);
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+    }
+
+    if (++s->inuse == cache->objs_per_slab) {    // slab已满, 转入full链表
+        list_remove(&s->slab_tag);
+        list_push(&cache->slabs_full, &s->slab_tag);
+    }
+    cache->active_objs++;
+    cache->alloc_cnt++;
+    lock_release(&cache->lock);
+    return obj;
+}
+
+/* 将对象obj归还给对象缓存cache */
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+    ASSERT(obj != NULL);
+    struct slab* s = (struct slab*)((uint32_t)obj & 0xfffff000);    // slab只占一页, 页首即slab描述符
+    ASSERT(s->cache == cache);
+    uint32_t obj_idx = ((uint32_t)obj - (uint32_t)s - cache->objs_offset) / cache->obj_size;
+    ASSERT(obj_idx < s->unused_idx && slab_obj(s, obj_idx) == obj);
+
+    lock_acquire(&cache->lock);
+    s->next_free[obj_idx] = s->free_idx;
+    s->free_idx = obj_idx;
+    cache->active_objs--;
+
+    if (s->inuse-- == cache->objs_per_slab) {    // 原先是满的, 现在有了空闲对象
+        list_remove(&s->slab_tag);
+        list_push(&cache->slabs_partial, &s->slab_tag);
+    }
+    if (s->inuse == 0) {
+        list_remove(&s->slab_tag);
+        if (cache->empty_cnt < KMEM_EMPTY_MAX) {    // 保留少量空slab, 避免对象反复创建释放时频繁申请页框
+            list_push(&cache->slabs_empty, &s->slab_tag);
+            cache->empty_cnt++;
+        } else {
+            slab_destroy(cache, s);
+        }
+    }
+    lock_release(&cache->lock);
+}
+
+/* 释放cache中所有的空slab, 返回释放的页框数 */
+uint32_t kmem_cache_shrink(struct kmem_cache* cache) {
+    uint32_t pg_cnt = 0;
+    lock_acquire(&cache->lock);
+    while (!list_empty(&cache->slabs_empty)) {
+        struct slab* s = elem2entry(struct slab, slab_tag, list_pop(&cache->slabs_empty));
+        slab_destroy(cache, s);
+        pg_cnt++;
+    }
+    cache->empty_cnt = 0;
+    lock_release(&cache->lock);
+    return pg_cnt;
+}
\ No newline at end of file
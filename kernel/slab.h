@@ -0,0 +1,40 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+#include "stdint.h"
+#include "list.h"
+#include "sync.h"
+
+#define KMEM_NAME_LEN   16    // 对象缓存名称的最大长度
+#define KMEM_EMPTY_MAX  1     // 每个对象缓存最多保留的空slab数, 多出来的空slab立即把页框还给内核内存池
+
+/* 对象缓存: 专门分配某一固定尺寸对象的"精确尺寸"内存池, 底层以页为单位的slab组成
+ * 与sys_malloc的7种规格相比, 对象按实际尺寸排布, 不会因向上取整到2的幂而浪费空间 */
+struct kmem_cache {
+    char name[KMEM_NAME_LEN];        // 缓存名称, 用于统计输出
+    uint32_t obj_size;               // 对象尺寸(已按4字节对齐)
+    uint32_t objs_per_slab;          // 每个slab可容纳的对象数
+    uint32_t objs_offset;            // 对象区相对slab页首的偏移
+    void (*ctor)(void*);             // 对象构造函数, 对象第一次被分配出去之前调用, 释放的对象须保持构造后的状态
+
+    struct list slabs_partial;       // 部分对象已分配的slab
+    struct list slabs_full;          // 全部对象都已分配的slab
+    struct list slabs_empty;         // 没有对象被分配的slab
+    uint32_t empty_cnt;              // slabs_empty中slab的个数
+
+    /* 统计信息 */
+    uint32_t slab_cnt;               // 当前拥有的slab数(即占用的页框数)
+    uint32_t active_objs;            // 当前已分配出去的对象数
+    uint32_t alloc_cnt;              // 累计分配次数
+    uint32_t grow_cnt;               // 累计因没有空闲对象而新建slab的次数
+
+    struct lock lock;                // 分配和释放时互斥
+    struct list_elem cache_tag;      // 用于加入全局的kmem_cache_list
+};
+
+extern struct list kmem_cache_list;
+void kmem_cache_init(void);
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void*));
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+uint32_t kmem_cache_shrink(struct kmem_cache* cache);
+#endif
\ No newline at end of file
@@ -0,0 +1,473 @@
+#include "smp.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "print.h"
+#include "string.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "thread.h"
+#include "timer.h"
+#include "tss.h"
+
+#define KERNEL_VBASE   0xc0000000
+#define AP_TRAMPOLINE  0x70000    // AP启动代码被复制到的物理地址, 须4KB对齐且在1MB以内; 原是loader暂存kernel.bin的缓冲区, 内核加载完后已空闲
+#define KERNEL_PGDIR   0x100000   // 内核页目录表的物理地址, 其中第0个pde恒等映射了低端1MB(蹦床代码就在其中), AP开启分页的那条指令要靠它
+
+/* 本地APIC寄存器的偏移 */
+#define LAPIC_ID          0x20
+#define LAPIC_TPR         0x80
+#define LAPIC_EOI         0xb0
+#define LAPIC_SVR         0xf0
+#define LAPIC_ICR_LOW     0x300
+#define LAPIC_ICR_HIGH    0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_CUR   0x390
+#define LAPIC_TIMER_DIV   0x3e0
+
+#define LAPIC_SVR_ENABLE  0x100      // SVR中的软件使能位
+#define LVT_MASKED        0x10000
+#define LVT_PERIODIC      0x20000
+#define TIMER_DIV_16      0x3
+#define ICR_FIXED         0x4000     // 固定投递, 电平有效
+#define ICR_INIT          0x4500
+#define ICR_STARTUP       0x4600
+#define ICR_PENDING       0x1000     // 投递状态位, 为1表示IPI还没发出去
+
+#define MSR_APIC_BASE     0x1b
+
+/* ACPI表的公共表头 */
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+/* MP配置表表头, 其后紧跟entry_cnt个表项 */
+struct mp_config {
+    char signature[4];
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_size;
+    uint16_t entry_cnt;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed));
+
+/* 蹦床代码末尾的参数区, 由BSP在启动每个AP之前填写, 布局须与trampoline.S一致 */
+struct trampoline_args {
+    uint16_t gdt_limit;
+    uint32_t gdt_base;    // 实模式下lgdt用的是物理地址
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;       // AP的idle线程的栈顶
+    uint32_t entry;       // 开启分页后跳转到的内核入口
+} __attribute__((packed));
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern struct trampoline_args ap_trampoline_args;
+
+struct cpu cpus[NR_CPUS];
+uint32_t cpu_cnt = 1;                  // 已启动的处理器数, 至少有BSP
+
+static volatile uint32_t* lapic;       // 本地APIC寄存器的映射地址, 为NULL表示以单处理器方式运行
+static uint32_t lapic_timer_count;     // 本地APIC定时器一个tick的计数初值
+
+/* 大内核锁: 同一时刻只有一个处理器在内核中运行. 从用户态或idle进入内核时获取, 返回用户态或回到idle时释放,
+ * 内核原有的关中断互斥在单个处理器上仍然成立, 有了它在多处理器上也不会被并发执行. 开机时只有BSP在运行, 由它持有 */
+static struct spinlock kernel_spin = {1};
+static volatile int32_t kernel_owner = 0;    // 持有大内核锁的处理器编号, -1表示无人持有
+
+/* 获取自旋锁lock */
+void spin_lock(struct spinlock* lock) {
+    uint32_t old = 1;
+    while (1) {
+        asm volatile ("xchgl %0, %1" : "+r"(old), "+m"(lock->locked) : : "memory");
+        if (old == 0) {
+            return;
+        }
+        while (lock->locked) {    // 只读地等待, 免得反复xchg锁住总线
+            asm volatile ("pause");
+        }
+        old = 1;
+    }
+}
+
+/* 释放自旋锁lock, x86的写操作不会越过之前的读写, 只需阻止编译器重排 */
+void spin_unlock(struct spinlock* lock) {
+    asm volatile ("" : : : "memory");
+    lock->locked = 0;
+}
+
+/* 返回当前处理器的私有数据, 任务被换上处理器时会记下该处理器的编号 */
+struct cpu* this_cpu(void) {
+    return &cpus[running_thread()->cpu];
+}
+
+/* 获取大内核锁, 并补上别的处理器解除内核映射后本处理器欠下的tlb刷新. 须关中断调用 */
+void kernel_lock(void) {
+    struct cpu* c = this_cpu();
+    spin_lock(&kernel_spin);
+    kernel_owner = c->id;
+    kernel_tlb_sync(&c->tlb_gen);
+}
+
+/* 释放大内核锁, 须关中断调用 */
+void kernel_unlock(void) {
+    ASSERT(kernel_owner == this_cpu()->id);
+    kernel_owner = -1;
+    spin_unlock(&kernel_spin);
+}
+
+/* 本处理器是否持有大内核锁, 供只靠大内核锁保护的代码断言 */
+bool kernel_lock_held(void) {
+    return kernel_owner == this_cpu()->id;
+}
+
+/* 中断入口调用: 本处理器还没持有大内核锁(从用户态或idle进入)时获取它并返回true, 由中断出口负责释放 */
+bool kernel_lock_enter(void) {
+    if (kernel_owner == this_cpu()->id) {
+        return false;
+    }
+    kernel_lock();
+    return true;
+}
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void)lapic[LAPIC_ID / 4];    // 读一次, 等写操作生效
+}
+
+static void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/* 初始化本处理器的本地APIC: 软件使能并设置伪中断向量, 接收所有优先级的中断, 定时器先屏蔽 */
+static void lapic_init(void) {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_TIMER_VECTOR);
+}
+
+/* 开启或停止本处理器的本地APIC定时器: AP运行任务时靠它按tick计时间片, 空闲时停掉. BSP用PIT, 不用它 */
+void lapic_timer_enable(bool enable) {
+    if (lapic == NULL || this_cpu()->id == 0) {
+        return;
+    }
+    if (enable) {
+        lapic_write(LAPIC_LVT_TIMER, LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+    } else {
+        lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INIT, 0);
+    }
+}
+
+/* 忙等us微秒 */
+static void udelay(uint32_t us) {
+    uint64_t end = clock_ns() + (uint64_t)us * 1000;
+    while (clock_ns() < end) {
+        asm volatile ("pause");
+    }
+}
+
+/* 以单调时钟为准, 数出本地APIC定时器一个tick(10毫秒)减去的计数, 各处理器的总线频率相同, 在BSP上测一次即可 */
+static void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+    udelay(10000);
+    lapic_timer_count = 0xffffffff - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+/* 向本地APIC id为apic_id的处理器发送IPI, 等它发出去再返回 */
+static void lapic_send_ipi(uint8_t apic_id, uint32_t icr_low) {
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr_low);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+        asm volatile ("pause");
+    }
+}
+
+/* 让空闲的处理器target醒来调度: hlt中的idle被IPI唤醒后会自己进入schedule */
+void smp_send_resched(struct cpu* target) {
+    if (lapic == NULL || target == this_cpu()) {
+        return;
+    }
+    lapic_send_ipi(target->apic_id, ICR_FIXED | RESCHED_VECTOR);
+}
+
+/* AP的本地APIC定时器中断 */
+static void lapic_timer_handler(uint8_t vec_nr UNUSED) {
+    lapic_eoi();
+    thread_tick(1);
+}
+
+/* 调度IPI, 它的作用只是把处理器从hlt中唤醒 */
+static void resched_handler(uint8_t vec_nr UNUSED) {
+    lapic_eoi();
+}
+
+/* 本地APIC的伪中断不需要EOI */
+static void spurious_handler(uint8_t vec_nr UNUSED) {
+}
+
+/* 计算从p起len字节的校验和, 固件表的校验和为0才有效 */
+static uint8_t checksum(const uint8_t* p, uint32_t len) {
+    uint8_t sum = 0;
+    while (len-- > 0) {
+        sum += *p++;
+    }
+    return sum;
+}
+
+/* 在低端1MB的物理地址[start, start + len)中按16字节对齐查找长len_chk字节、以sig开头且校验和为0的结构, 返回其虚拟地址 */
+static uint8_t* low_mem_scan(uint32_t start, uint32_t len, const char* sig, uint32_t len_chk) {
+    uint8_t* p = (uint8_t*)(start + KERNEL_VBASE);
+    uint8_t* end = p + len;
+    for (; p + len_chk <= end; p += 16) {
+        if (memcmp(p, sig, strlen(sig)) == 0 && checksum(p, len_chk) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* 在BIOS约定的区域(EBDA的第1KB, 基本内存的最后1KB, BIOS只读区)中查找结构 */
+static uint8_t* bios_scan(const char* sig, uint32_t len_chk, uint32_t rom_start) {
+    uint32_t ebda = (uint32_t)(*(uint16_t*)(0x40e + KERNEL_VBASE)) << 4;
+    uint8_t* p = NULL;
+    if (ebda != 0) {
+        p = low_mem_scan(ebda, 1024, sig, len_chk);
+    }
+    if (p == NULL) {
+        p = low_mem_scan(0x9fc00, 1024, sig, len_chk);
+    }
+    if (p == NULL) {
+        p = low_mem_scan(rom_start, 0x100000 - rom_start, sig, len_chk);
+    }
+    return p;
+}
+
+/* 把物理地址phy_addr起len字节的固件表映射到内核空间, 低端1MB直接用直接映射区 */
+static void* table_map(uint32_t phy_addr, uint32_t len) {
+    if (phy_addr + len <= 0x100000) {
+        return (void*)(phy_addr + KERNEL_VBASE);
+    }
+    uint32_t pg_start = phy_addr & 0xfffff000;
+    uint8_t* vaddr = ioremap(pg_start, DIV_ROUND_UP(phy_addr + len - pg_start, PG_SIZE));
+    return vaddr == NULL ? NULL : vaddr + (phy_addr - pg_start);
+}
+
+/* 解除table_map建立的映射 */
+static void table_unmap(void* vaddr, uint32_t phy_addr, uint32_t len) {
+    if (phy_addr + len <= 0x100000) {
+        return;
+    }
+    uint32_t pg_start = phy_addr & 0xfffff000;
+    iounmap((void*)((uint32_t)vaddr & 0xfffff000), DIV_ROUND_UP(phy_addr + len - pg_start, PG_SIZE));
+}
+
+/* 从ACPI的MADT中找出所有已启用的处理器, 把本地APIC id存入apic_ids, 返回处理器数, 没有MADT返回0 */
+static uint32_t acpi_cpu_scan(uint8_t* apic_ids) {
+    uint8_t* rsdp = bios_scan("RSD PTR ", 20, 0xe0000);
+    if (rsdp == NULL) {
+        return 0;
+    }
+    uint32_t rsdt_phy = *(uint32_t*)(rsdp + 16);
+    struct acpi_header* rsdt = table_map(rsdt_phy, sizeof(struct acpi_header));
+    if (rsdt == NULL) {
+        return 0;
+    }
+    uint32_t rsdt_len = rsdt->length;
+    table_unmap(rsdt, rsdt_phy, sizeof(struct acpi_header));
+    rsdt = table_map(rsdt_phy, rsdt_len);
+    if (rsdt == NULL) {
+        return 0;
+    }
+
+    uint32_t cnt = 0;
+    uint32_t* entries = (uint32_t*)(rsdt + 1);
+    uint32_t entry_idx;
+    for (entry_idx = 0; entry_idx < (rsdt_len - sizeof(struct acpi_header)) / 4 && cnt == 0; entry_idx++) {
+        uint32_t table_phy = entries[entry_idx];
+        struct acpi_header* hdr = table_map(table_phy, sizeof(struct acpi_header));
+        if (hdr == NULL) {
+            continue;
+        }
+        uint32_t table_len = hdr->length;
+        bool is_madt = memcmp(hdr->signature, "APIC", 4) == 0;
+        table_unmap(hdr, table_phy, sizeof(struct acpi_header));
+        if (!is_madt) {
+            continue;
+        }
+        uint8_t* madt = table_map(table_phy, table_len);
+        if (madt == NULL) {
+            break;
+        }
+        // 表头之后是本地APIC地址和标志各4字节, 再往后是变长的中断控制器结构, 类型0描述一个处理器
+        uint8_t* p = madt + sizeof(struct acpi_header) + 8;
+        while (p + 2 <= madt + table_len && p[1] >= 2) {
+            if (p[0] == 0 && (*(uint32_t*)(p + 4) & 1) && cnt < NR_CPUS) {
+                apic_ids[cnt++] = p[3];
+            }
+            p += p[1];
+        }
+        table_unmap(madt, table_phy, table_len);
+    }
+    table_unmap(rsdt, rsdt_phy, rsdt_len);
+    return cnt;
+}
+
+/* 没有ACPI时从MP配置表中找处理器, 返回处理器数 */
+static uint32_t mp_cpu_scan(uint8_t* apic_ids) {
+    uint8_t* mpf = bios_scan("_MP_", 16, 0xf0000);
+    if (mpf == NULL || *(uint32_t*)(mpf + 4) == 0) {    // 配置表地址为0表示采用默认配置, 只有两个处理器且没有表可读
+        return 0;
+    }
+    uint32_t config_phy = *(uint32_t*)(mpf + 4);
+    struct mp_config* config = table_map(config_phy, sizeof(struct mp_config));
+    if (config == NULL) {
+        return 0;
+    }
+    uint32_t config_len = config->length;
+    table_unmap(config, config_phy, sizeof(struct mp_config));
+    config = table_map(config_phy, config_len);
+    if (config == NULL || memcmp(config->signature, "PCMP", 4) != 0) {
+        return 0;
+    }
+
+    uint32_t cnt = 0;
+    uint8_t* p = (uint8_t*)(config + 1);
+    uint32_t entry_idx;
+    for (entry_idx = 0; entry_idx < config->entry_cnt && p < (uint8_t*)config + config_len; entry_idx++) {
+        if (p[0] == 0) {    // 处理器表项20字节, 第1字节是本地APIC id, 第3字节的位0表示已启用
+            if ((p[3] & 1) && cnt < NR_CPUS) {
+                apic_ids[cnt++] = p[1];
+            }
+            p += 20;
+        } else {            // 其余表项都是8字节
+            p += 8;
+        }
+    }
+    table_unmap(config, config_phy, config_len);
+    return cnt;
+}
+
+/* AP从蹦床代码跳到这里: 已开启分页, 栈在它自己的idle线程的pcb页中 */
+static void ap_main(void) {
+    struct task_struct* idle = running_thread();
+    struct cpu* c = &cpus[idle->cpu];
+    idle->status = TASK_RUNNING;
+    tss_ap_init(c->id);    // 换用完整的gdt, 加载本处理器的tss
+    idt_load();
+    lapic_init();
+    c->started = true;
+    kernel_lock();
+    cpu_idle();
+}
+
+/* 通过INIT-SIPI-SIPI序列启动处理器c, 它以c->idle的pcb页为栈进入内核, 成功返回true */
+static bool ap_start(struct cpu* c) {
+    struct trampoline_args* args = (struct trampoline_args*)(AP_TRAMPOLINE + KERNEL_VBASE + ((uint32_t)&ap_trampoline_args - (uint32_t)ap_trampoline_start));
+    args->stack = (uint32_t)c->idle + PG_SIZE;
+
+    lapic_send_ipi(c->apic_id, ICR_INIT);
+    udelay(10000);
+    uint32_t sipi;
+    for (sipi = 0; sipi < 2 && !c->started; sipi++) {    // 按Intel的规定发两次, 第一次就启动了的AP会忽略第二次
+        lapic_send_ipi(c->apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        udelay(200);
+    }
+    uint32_t wait_ms;
+    for (wait_ms = 0; wait_ms < 1000 && !c->started; wait_ms++) {
+        udelay(1000);
+    }
+    return c->started;
+}
+
+/* 找出所有处理器并启动AP, 每个AP运行自己的idle线程, 之后通过负载均衡分到任务 */
+void smp_init(void) {
+    put_str("smp_init start\n");
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 9))) {    // CPUID.1:EDX第9位为0, 没有本地APIC
+        put_str("   no local APIC\n");
+        return;
+    }
+    uint8_t apic_ids[NR_CPUS];
+    uint32_t found = acpi_cpu_scan(apic_ids);
+    if (found == 0) {
+        found = mp_cpu_scan(apic_ids);
+    }
+    if (found <= 1) {
+        put_str("   single processor\n");
+        return;
+    }
+
+    uint32_t msr_low, msr_high;
+    asm volatile ("rdmsr" : "=a"(msr_low), "=d"(msr_high) : "c"(MSR_APIC_BASE));
+    lapic = ioremap(msr_low & 0xfffff000, 1);
+    if (lapic == NULL) {
+        return;
+    }
+    lapic_init();
+    cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+    lapic_timer_calibrate();
+    register_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+    register_handler(RESCHED_VECTOR, resched_handler);
+    register_handler(SPURIOUS_VECTOR, spurious_handler);
+
+    // 复制蹦床代码并填好各AP共用的参数
+    memcpy((void*)(AP_TRAMPOLINE + KERNEL_VBASE), ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    struct trampoline_args* args = (struct trampoline_args*)(AP_TRAMPOLINE + KERNEL_VBASE + ((uint32_t)&ap_trampoline_args - (uint32_t)ap_trampoline_start));
+    args->gdt_limit = 8 * 4 - 1;    // 只用到内核代码段和数据段, AP进入内核后再换用完整的gdt
+    args->gdt_base = 0x900;
+    args->cr3 = KERNEL_PGDIR;
+    asm volatile ("movl %%cr0, %0" : "=r"(args->cr0));    // 与BSP相同的分页、写保护等设置
+    asm volatile ("movl %%cr4, %0" : "=r"(args->cr4));
+    args->entry = (uint32_t)ap_main;
+
+    uint32_t idx;
+    for (idx = 0; idx < found && cpu_cnt < NR_CPUS; idx++) {
+        if (apic_ids[idx] == cpus[0].apic_id) {
+            continue;
+        }
+        struct cpu* c = &cpus[cpu_cnt];
+        c->id = cpu_cnt;
+        c->apic_id = apic_ids[idx];
+        c->started = false;
+        c->idle = thread_idle_create(c->id);
+        if (c->idle == NULL) {
+            break;
+        }
+        c->curr = c->idle;
+        if (ap_start(c)) {
+            cpu_cnt++;
+        } else {
+            put_str("   AP failed to start, apic id:");put_int(c->apic_id);put_str("\n");
+            break;    // 它也许只是启动得慢, 随后还会用这个编号和idle的栈进入内核, 都不能再给别的AP用
+        }
+    }
+    put_str("   cpus:");put_int(cpu_cnt);put_str("\n");
+    put_str("smp_init done\n");
+}
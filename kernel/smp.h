@@ -0,0 +1,42 @@
+#ifndef __KERNEL_SMP_H
+#define __KERNEL_SMP_H
+#include "stdint.h"
+#include "global.h"
+
+#define NR_CPUS 8    // 最多支持的处理器数, 每个处理器在gdt中要占一个tss描述符
+
+#define LAPIC_TIMER_VECTOR   0x30    // 各AP的本地APIC定时器, 用于按时间片调度
+#define RESCHED_VECTOR       0x31    // 调度IPI: 叫醒空闲的处理器来运行新就绪的任务
+#define SPURIOUS_VECTOR      0x3f    // 本地APIC的伪中断
+
+/* 自旋锁: 用于多个处理器之间的互斥, 持有者不能睡眠, 须在关中断时使用 */
+struct spinlock {
+    volatile uint32_t locked;
+};
+
+/* 每个处理器的私有数据 */
+struct cpu {
+    uint8_t id;                     // 逻辑编号, BSP为0, 也是cpus数组的下标
+    uint8_t apic_id;                // 本地APIC的id, 发IPI时用
+    volatile bool started;          // AP已完成初始化, 进入调度
+    struct task_struct* idle;       // 本处理器的idle线程
+    struct task_struct* curr;       // 本处理器上正在运行的任务
+    uint32_t tlb_gen;               // 本处理器tlb中的内核映射对应的kernel_tlb_gen
+    uint32_t balance_ticks;         // 自上次负载均衡以来经过的tick数
+    bool need_resched;              // 当前任务的时间片已用完, 在中断返回前调度
+};
+
+extern struct cpu cpus[NR_CPUS];
+extern uint32_t cpu_cnt;
+
+void spin_lock(struct spinlock* lock);
+void spin_unlock(struct spinlock* lock);
+struct cpu* this_cpu(void);
+bool kernel_lock_enter(void);
+void kernel_lock(void);
+void kernel_unlock(void);
+bool kernel_lock_held(void);
+void lapic_timer_enable(bool enable);
+void smp_send_resched(struct cpu* target);
+void smp_init(void);
+#endif
@@ -0,0 +1,77 @@
+#include "softirq.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "thread.h"
+#include "smp.h"
+
+/* 软中断: 中断处理函数只做必须关中断完成的部分(读端口、应答设备), 其余工作挂起为软中断,
+ * 在中断返回前开着中断处理, 这样关中断的时间更短, 多次中断挂起的同一软中断也只需处理一次 */
+/* 以下状态没有自己的锁, 多处理器下靠大内核锁互斥: 中断入口会获取它, 关中断只挡住本处理器 */
+static softirq_action* softirq_vec[NR_SOFTIRQS];
+static volatile uint32_t softirq_pending;    // 第i位为1表示第i号软中断已挂起, 等待处理
+static bool softirq_running;                 // 正在处理软中断; 处理期间持有大内核锁且不会调度, 所以同一时刻最多只有一个处理器在处理
+
+/* 注册第nr号软中断的处理函数action, 它在开中断的状态下执行, 不能睡眠 */
+void open_softirq(enum softirq_nr nr, softirq_action* action) {
+    ASSERT(nr < NR_SOFTIRQS);
+    softirq_vec[nr] = action;
+}
+
+/* 挂起第nr号软中断, 它将在本次(或下次)中断返回前被处理, 供中断处理函数调用 */
+void raise_softirq(enum softirq_nr nr) {
+    ASSERT(kernel_lock_held());
+    enum intr_status old_status = intr_disable();
+    softirq_pending |= 1 << nr;
+    intr_set_status(old_status);
+}
+
+/* 当前是否在处理软中断, 软中断处理函数中不能睡眠 */
+bool in_softirq(void) {
+    return softirq_running;
+}
+
+/* 处理所有挂起的软中断, 须关中断调用, 返回时仍是关中断的 */
+static void do_softirq(void) {
+    ASSERT(kernel_lock_held());
+    uint32_t restart = SOFTIRQ_RESTART_MAX;
+    softirq_running = true;
+    while (softirq_pending != 0 && restart-- > 0) {
+        // 先取走当前挂起的全部软中断再开中断, 处理期间新挂起的留到下一轮
+        uint32_t pending = softirq_pending;
+        softirq_pending = 0;
+        intr_enable();
+        uint32_t nr;
+        for (nr = 0; nr < NR_SOFTIRQS; nr++) {
+            if ((pending & (1 << nr)) && softirq_vec[nr] != NULL) {
+                softirq_vec[nr]();
+            }
+        }
+        intr_disable();
+    }
+    softirq_running = false;
+}
+
+/* 处理挂起的软中断, 须关中断调用; 正在处理软中断时(即嵌套在其中的中断)什么也不做, 留给外层处理
+ * 除了中断返回时, idle线程在hlt之前也要调用: 中断返回时处理轮数到了上限而留下的软中断,
+ * 不能等到下一次中断, 只剩idle时单次定时的时钟中断可能在很久以后才来 */
+void softirq_run_pending(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    if (!softirq_running && softirq_pending != 0) {
+        do_softirq();
+    }
+}
+
+/* 外部中断的处理函数返回后由kernel.S调用: 先处理挂起的软中断, 再处理时钟中断提出的调度请求
+ * 嵌套在软中断处理中的中断两者都不做, 留给外层的中断在软中断处理完后去做 */
+void irq_exit(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    if (softirq_running) {
+        return;
+    }
+    softirq_run_pending();
+    if (this_cpu()->need_resched) {
+        schedule();
+    }
+}
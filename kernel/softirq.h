@@ -0,0 +1,23 @@
+#ifndef __KERNEL_SOFTIRQ_H
+#define __KERNEL_SOFTIRQ_H
+#include "stdint.h"
+#include "global.h"
+
+#define SOFTIRQ_RESTART_MAX 10    // 一次中断返回时最多处理几轮软中断, 处理期间又不断有新挂起的就留到下次中断返回, 免得饿死被中断的任务
+
+/* 软中断号, 号小的先处理 */
+enum softirq_nr {
+    SOFTIRQ_TIMER,    // 执行时间轮中到期的定时器
+    SOFTIRQ_BLOCK,    // 唤醒等待硬盘操作完成的驱动程序
+    SOFTIRQ_KBD,      // 解码键盘扫描码并放入键盘缓冲区
+    NR_SOFTIRQS
+};
+
+typedef void softirq_action(void);
+
+void open_softirq(enum softirq_nr nr, softirq_action* action);
+void raise_softirq(enum softirq_nr nr);
+bool in_softirq(void);
+void softirq_run_pending(void);
+void irq_exit(void);
+#endif
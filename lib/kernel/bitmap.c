@@ -5,10 +5,86 @@
 #include "interrupt.h"
 #include "debug.h"
 
+#define WORD_BITS 32    // 一次扫描的位数, 即一个32位字
+
+/* 返回word中最高的1所在的位(word不能为0) */
+static inline uint32_t bit_scan_reverse(uint32_t word) {
+    uint32_t idx;
+    asm ("bsrl %1, %0" : "=r"(idx) : "rm"(word) : "cc");
+    return idx;
+}
+
+/* 读出位图中第word_idx个32位字, 超出位图末尾的字节一律视为已占用(全1), 这样扫描时就不会越界分配 */
+static uint32_t bitmap_word(struct bitmap* btmp, uint32_t word_idx) {
+    uint32_t byte_idx = word_idx * 4;
+    if (byte_idx + 4 <= btmp->btmp_bytes_len) {
+        return *(uint32_t*)(btmp->bits + byte_idx);    // x86允许非对齐访问, bits不必按4字节对齐
+    }
+    // 位图长度不是4的倍数时, 最后一个字只有部分字节有效
+    uint32_t word = 0xffffffff;
+    uint32_t byte_odd = 0;
+    while (byte_idx + byte_odd < btmp->btmp_bytes_len) {
+        word &= ~((uint32_t)0xff << (byte_odd * 8));
+        word |= (uint32_t)btmp->bits[byte_idx + byte_odd] << (byte_odd * 8);
+        byte_odd++;
+    }
+    return word;
+}
+
+/* 在[from, end)内查找第一个为0的位, 找不到则返回end */
+static uint32_t find_zero_bit(struct bitmap* btmp, uint32_t from, uint32_t end) {
+    while (from < end) {
+        uint32_t word_idx = from / WORD_BITS;
+        // 取反后1代表空闲位, 再屏蔽掉from之前的位
+        uint32_t free_bits = ~bitmap_word(btmp, word_idx) & (0xffffffff << (from % WORD_BITS));
+        if (free_bits != 0) {
+            uint32_t bit_idx = word_idx * WORD_BITS + bit_scan_forward(free_bits);
+            return bit_idx < end ? bit_idx : end;
+        }
+        from = (word_idx + 1) * WORD_BITS;    // 整个字都被占用, 跳到下一个字
+    }
+    return end;
+}
+
+/* 检查[start, end)是否全为0, 是则返回-1;
+ * 否则返回第一个含有1的字中(落在区间内的)最后一个1的下标, 调用者可直接从它的下一位重新开始找 */
+static int32_t find_busy_bit(struct bitmap* btmp, uint32_t start, uint32_t end) {
+    uint32_t pos = start;
+    while (pos < end) {
+        uint32_t word_idx = pos / WORD_BITS;
+        uint32_t word_end = (word_idx + 1) * WORD_BITS;
+        uint32_t mask = 0xffffffff << (pos % WORD_BITS);
+        if (end < word_end) {    // 区间在本字内结束, 屏蔽掉end及其后的位
+            mask &= 0xffffffff >> (word_end - end);
+        }
+        uint32_t used_bits = bitmap_word(btmp, word_idx) & mask;
+        if (used_bits != 0) {
+            return word_idx * WORD_BITS + bit_scan_reverse(used_bits);
+        }
+        pos = word_end;
+    }
+    return -1;
+}
+
+/* 在[from, end)内查找连续cnt个0位, 成功返回起始下标, 失败返回-1 */
+static int32_t scan_range(struct bitmap* btmp, uint32_t cnt, uint32_t from, uint32_t end) {
+    uint32_t start = find_zero_bit(btmp, from, end);
+    while (start + cnt <= end) {
+        int32_t busy = find_busy_bit(btmp, start, start + cnt);
+        if (busy == -1) {    // [start, start + cnt)全部空闲
+            return start;
+        }
+        // 窗口内有被占用的位, 它之前的位都不可能成为起点, 从它之后的第一个空闲位继续
+        start = find_zero_bit(btmp, busy + 1, end);
+    }
+    return -1;
+}
+
 /* 将位图bitmap初始化 */
 void bitmap_init(struct bitmap* btmp){
     // 根据位图的字节大小btmp_bytes_len将位图的每一个字节用0填充
     memset(btmp->bits, 0, btmp->btmp_bytes_len);
+    btmp->hint = 0;
 }
 
 /* 判断bit_idx位是否为1, 若为1则返回true, 否则返回false */
@@ -18,49 +94,25 @@ bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx){
     return (btmp->bits[byte_idx]) & (BITMAP_MASK << bit_odd);
 }
 
-/* 在位图中申请连续cnt个位, 成功, 则返回其起始下标, 失败返回-1 */
+/* 在位图中申请连续cnt个位, 成功, 则返回其起始下标, 失败返回-1
+ * 采用next-fit策略: 从上次分配结束的位置(hint)开始按字扫描, 到末尾后再从头找一遍 */
 int bitmap_scan(struct bitmap* btmp, uint32_t cnt){
-    uint32_t idx_byte = 0;    // 记录空闲位所在的字节
-    /* 先才用暴力法：逐字节比较 */
-    while ((0xff == btmp->bits[idx_byte]) && (idx_byte < btmp->btmp_bytes_len)){
-        // 0xff表示该字节内的位对应的资源都已分配完毕, 已无空闲位, 向下一字节继续寻找
-        idx_byte++;
-    }
-    ASSERT(idx_byte < btmp->btmp_bytes_len);
-    if(idx_byte == btmp->btmp_bytes_len){    // 若内存池中已找不到可用空间
+    uint32_t bits_len = btmp->btmp_bytes_len * 8;
+    if (cnt == 0 || cnt > bits_len) {
         return -1;
     }
+    // hint可能来自未调用bitmap_init的位图(如从硬盘读入的块位图), 越界时从头开始
+    uint32_t hint = btmp->hint < bits_len ? btmp->hint : 0;
 
-    // 若在位图数组范围内的某字节内找到了空闲位, 便在该字节内逐位比对, 返回空闲位的索引
-    int idx_bit = 0;
-    while (btmp->bits[idx_byte] & (uint8_t)(BITMAP_MASK << idx_bit)){    // 一旦在bits[idx_byte]中遇到0位, 则退出循环
-        idx_bit++;
+    int32_t bit_idx_start = scan_range(btmp, cnt, hint, bits_len);
+    if (bit_idx_start == -1 && hint != 0) {
+        // 回绕: 起点在hint之前的连续空闲区最多延伸到hint + cnt - 1
+        uint32_t end = hint + cnt - 1 < bits_len ? hint + cnt - 1 : bits_len;
+        bit_idx_start = scan_range(btmp, cnt, 0, end);
     }
-
-    int bit_idx_start = idx_byte * 8 + idx_bit;    // 空闲位在位图内的下标
-    if(cnt == 1){
-        return bit_idx_start;
-    }
-    uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start);    // 从bit_idx_start开始直到位图末位还有多少个位可供判断
-    uint32_t next_bit = bit_idx_start + 1;
-    uint32_t count = 1;    // 记录已找到的空闲位的个数
-
-    bit_idx_start = -1;    // 要返回的起始位图索引, 先假设找不到cnt连续空闲位
-    // 避免访问位图外的内存
-    while (bit_left-- > 0){
-        if(!(bitmap_scan_test(btmp, next_bit))){    // 若next_bit为0
-            count++;
-        }else{
-            // 重置count为0
-            count = 0;
-        }
-        if(count == cnt){    // 若找到连续的cnt个空位
-            bit_idx_start = next_bit - cnt + 1;
-            break;
-        }
-        next_bit++;
+    if (bit_idx_start != -1) {
+        btmp->hint = (bit_idx_start + cnt) % bits_len;
     }
-
     return bit_idx_start;
 }
 
@@ -75,4 +127,30 @@ void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value){
     }else{
         btmp->bits[byte_idx] &= ~(BITMAP_MASK << bit_odd);
     }
+}
+
+/* 将位图btmp中从bit_idx开始的连续cnt个位设置为value: 首尾不足一字节的部分逐位设置, 中间整字节批量填充 */
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value) {
+    ASSERT((value == 0) || (value == 1));
+    ASSERT(bit_idx + cnt <= btmp->btmp_bytes_len * 8);
+
+    // 1. 起始位不在字节边界上, 先逐位处理到字节边界
+    while (cnt > 0 && (bit_idx % 8) != 0) {
+        bitmap_set(btmp, bit_idx, value);
+        bit_idx++;
+        cnt--;
+    }
+    // 2. 中间的整字节直接填充
+    uint32_t byte_cnt = cnt / 8;
+    if (byte_cnt > 0) {
+        memset(btmp->bits + bit_idx / 8, value ? 0xff : 0, byte_cnt);
+        bit_idx += byte_cnt * 8;
+        cnt -= byte_cnt * 8;
+    }
+    // 3. 剩下不足一字节的尾部
+    while (cnt > 0) {
+        bitmap_set(btmp, bit_idx, value);
+        bit_idx++;
+        cnt--;
+    }
 }
\ No newline at end of file
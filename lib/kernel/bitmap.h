@@ -4,13 +4,22 @@
 #define BITMAP_MASK 1
 struct bitmap{
     uint32_t btmp_bytes_len;
-    /*在遍历位图时，整体上以字节为单位，细节上是以位为单位，所以此处位图的指针必须是单字节*/
+    /*在遍历位图时，整体上以字(32位)为单位，细节上是以位为单位; bits仍按字节寻址, 以兼容已有的按字节操作位图的代码*/
     uint8_t* bits;
+    uint32_t hint;    // next-fit提示: 下次bitmap_scan从此位开始查找, 找到末尾后再回绕到0
 };
 
+/* 返回word中最低的1所在的位(word不能为0) */
+static inline uint32_t bit_scan_forward(uint32_t word) {
+    uint32_t idx;
+    asm ("bsfl %1, %0" : "=r"(idx) : "rm"(word) : "cc");
+    return idx;
+}
+
 void bitmap_init(struct bitmap* btmp);
 bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx);
 int bitmap_scan(struct bitmap* btmp, uint32_t cnt);
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value);
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value);
 
 #endif
\ No newline at end of file
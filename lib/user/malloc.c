@@ -0,0 +1,234 @@
+#include "syscall.h"
+#include "stdint.h"
+#include "global.h"
+#include "process.h"
+#include "assert.h"
+
+/* 用户态的堆内存分配器: 内存取自本进程的brk堆, malloc/free本身不陷入内核, 只有堆不够用或堆顶空闲太多时才调用brk
+ * 堆中的内存划分为首尾相接的块, 块首4字节为块头(块大小 | 标志), 返回给用户的地址紧随块头之后, 按8字节对齐
+ * 空闲块末尾4字节再存一份块大小(块尾), 释放时据此找到前一个块, 与前后相邻的空闲块合并
+ * 空闲块按大小分到若干个链表中, 分配时从能容纳所需大小的最小链表开始找
+ * 管理结构放在堆的第一页, 它位于每个进程各自的地址空间中, 所以fork后父子进程各有一份, 内核镜像中的shell也能使用 */
+
+#define HEAP_MAGIC     0x48454150        // "HEAP", 管理结构已初始化的标志, 预留页初始全0
+#define CHUNK_ALIGN    8                 // 用户地址和块大小的对齐字节数
+#define CHUNK_MIN      16                // 最小块: 块头 + 两个链表指针 + 块尾
+#define CHUNK_INUSE    1                 // 本块已分配
+#define CHUNK_PREV_INUSE 2               // 前一个块已分配, 为0时本块之前4字节是前一个空闲块的块尾
+#define CHUNK_FLAGS    7
+#define BIN_CNT        15                // 空闲链表个数, 第i个链表存放大小在[16 << i, 32 << i)的块, 最后一个存放更大的块
+#define HEAP_GROW_MIN  (16 * PG_SIZE)    // 堆每次至少扩大64KB, 减少brk次数
+#define HEAP_TRIM      (32 * PG_SIZE)    // 堆顶的空闲块达到128KB时缩小堆, 只留下HEAP_GROW_MIN
+
+/* 块, next和prev只在空闲块中有效, 已分配的块中这里是用户数据 */
+struct chunk {
+    uint32_t head;              // 块大小 | 标志
+    struct chunk* next;         // 同一空闲链表中的下一个块
+    struct chunk* prev;         // 同一空闲链表中的上一个块
+};
+
+/* 堆的管理结构, 位于USER_HEAP_START */
+struct heap {
+    uint32_t magic;
+    uint32_t brk;                    // 当前堆顶, 记下来免得每次都向内核查询, 堆顶之前4字节是结束标记块的块头
+    struct chunk* bins[BIN_CNT];     // 各空闲链表的表头
+};
+
+/* 返回块c的大小 */
+static uint32_t chunk_size(struct chunk* c) {
+    return c->head & ~CHUNK_FLAGS;
+}
+
+/* 返回块c之后紧邻的块 */
+static struct chunk* chunk_next(struct chunk* c) {
+    return (struct chunk*)((uint32_t)c + chunk_size(c));
+}
+
+/* 把空闲块c的大小设为size, 同时写好块头和块尾, 空闲块之前的块一定已分配(否则早已合并) */
+static void chunk_set_free(struct chunk* c, uint32_t size) {
+    c->head = size | CHUNK_PREV_INUSE;
+    *(uint32_t*)((uint32_t)c + size - 4) = size;
+}
+
+/* 返回大小为size的空闲块所在的链表 */
+static uint32_t bin_index(uint32_t size) {
+    uint32_t idx = 0;
+    size >>= 5;
+    while (size != 0 && idx < BIN_CNT - 1) {
+        size >>= 1;
+        idx++;
+    }
+    return idx;
+}
+
+/* 把空闲块c插入相应链表的表头 */
+static void bin_insert(struct heap* h, struct chunk* c) {
+    struct chunk** bin = &h->bins[bin_index(chunk_size(c))];
+    c->prev = NULL;
+    c->next = *bin;
+    if (*bin != NULL) {
+        (*bin)->prev = c;
+    }
+    *bin = c;
+}
+
+/* 把空闲块c从所在链表中摘下 */
+static void bin_remove(struct heap* h, struct chunk* c) {
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        h->bins[bin_index(chunk_size(c))] = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+}
+
+/* 找一个不小于size的空闲块, 没有则返回NULL
+ * 只有起始链表中的块需要逐个比较大小, 之后的链表中任何一块都足够大 */
+static struct chunk* bin_find(struct heap* h, uint32_t size) {
+    uint32_t idx = bin_index(size);
+    struct chunk* c = h->bins[idx];
+    while (c != NULL) {
+        if (chunk_size(c) >= size) {
+            return c;
+        }
+        c = c->next;
+    }
+    for (idx++; idx < BIN_CNT; idx++) {
+        if (h->bins[idx] != NULL) {
+            return h->bins[idx];
+        }
+    }
+    return NULL;
+}
+
+/* 把刚变为空闲、大小为size的块c与前后相邻的空闲块合并, 再挂到空闲链表上, 返回合并后的块 */
+static struct chunk* chunk_merge(struct heap* h, struct chunk* c, uint32_t size) {
+    bool prev_inuse = c->head & CHUNK_PREV_INUSE;
+    struct chunk* next = (struct chunk*)((uint32_t)c + size);
+    if (!(next->head & CHUNK_INUSE)) {
+        bin_remove(h, next);
+        size += chunk_size(next);
+    }
+    if (!prev_inuse) {
+        uint32_t prev_size = *(uint32_t*)((uint32_t)c - 4);
+        c = (struct chunk*)((uint32_t)c - prev_size);
+        bin_remove(h, c);
+        size += prev_size;
+    }
+    chunk_set_free(c, size);
+    chunk_next(c)->head &= ~CHUNK_PREV_INUSE;
+    bin_insert(h, c);
+    return c;
+}
+
+/* 返回本进程的堆, 第一次调用时初始化管理结构: 预留页中管理结构之后的部分作为第一个空闲块 */
+static struct heap* heap_get(void) {
+    struct heap* h = (struct heap*)USER_HEAP_START;
+    if (h->magic == HEAP_MAGIC) {
+        return h;
+    }
+    h->brk = (uint32_t)brk(NULL);
+    uint32_t idx;
+    for (idx = 0; idx < BIN_CNT; idx++) {
+        h->bins[idx] = NULL;
+    }
+    // 块头按"8的倍数 + 4"对齐, 用户地址就按8字节对齐; 堆顶按页对齐, 结束标记块的块头正好也满足这一点
+    uint32_t first = DIV_ROUND_UP(USER_HEAP_START + sizeof(struct heap) + 4, CHUNK_ALIGN) * CHUNK_ALIGN - 4;
+    struct chunk* end = (struct chunk*)(h->brk - 4);
+    end->head = CHUNK_INUSE;    // 结束标记块: 大小为0, 总是已分配, 合并到此为止
+    if ((uint32_t)end - first >= CHUNK_MIN) {
+        chunk_set_free((struct chunk*)first, (uint32_t)end - first);
+        bin_insert(h, (struct chunk*)first);
+    } else {
+        end->head |= CHUNK_PREV_INUSE;
+    }
+    h->magic = HEAP_MAGIC;
+    return h;
+}
+
+/* 扩大堆, 使堆顶的空闲块至少有size字节, 成功返回该空闲块(已在空闲链表中), 失败返回NULL */
+static struct chunk* heap_grow(struct heap* h, uint32_t size) {
+    struct chunk* end = (struct chunk*)(h->brk - 4);
+    uint32_t grow = size;
+    if (!(end->head & CHUNK_PREV_INUSE)) {    // 堆顶本来就有空闲块, 只需补上差额
+        grow -= *(uint32_t*)(h->brk - 8);
+    }
+    grow = DIV_ROUND_UP(grow, PG_SIZE) * PG_SIZE;
+    if (grow < HEAP_GROW_MIN) {
+        grow = HEAP_GROW_MIN;
+    }
+    uint32_t new_brk = h->brk + grow;
+    if (new_brk < h->brk || (uint32_t)brk((void*)new_brk) != new_brk) {
+        return NULL;
+    }
+    h->brk = new_brk;
+    // 原来的结束标记块变成新空闲块的块头, 新的结束标记块放在新堆顶之前
+    ((struct chunk*)(new_brk - 4))->head = CHUNK_INUSE;
+    end->head = (end->head & CHUNK_PREV_INUSE) | CHUNK_INUSE;    // 先当作已分配的块, 再按释放处理以便合并
+    return chunk_merge(h, end, grow);
+}
+
+/* 堆顶的空闲块c过大时缩小堆, c此时不在空闲链表中 */
+static void heap_trim(struct heap* h, struct chunk* c) {
+    uint32_t size = chunk_size(c);
+    uint32_t release = (size - HEAP_GROW_MIN) / PG_SIZE * PG_SIZE;
+    uint32_t new_brk = h->brk - release;
+    if ((uint32_t)brk((void*)new_brk) != new_brk) {
+        return;
+    }
+    h->brk = new_brk;
+    chunk_set_free(c, size - release);
+    ((struct chunk*)(new_brk - 4))->head = CHUNK_INUSE;
+}
+
+/* 在堆中申请size字节内存, 失败返回NULL, 返回的内存不保证清0 */
+void* malloc(uint32_t size) {
+    if (size == 0 || size > 0x7ffff000) {
+        return NULL;
+    }
+    struct heap* h = heap_get();
+    uint32_t need = DIV_ROUND_UP(size + 4, CHUNK_ALIGN) * CHUNK_ALIGN;    // 加上块头
+    if (need < CHUNK_MIN) {
+        need = CHUNK_MIN;
+    }
+    struct chunk* c = bin_find(h, need);
+    if (c == NULL) {
+        c = heap_grow(h, need);
+        if (c == NULL) {
+            return NULL;
+        }
+    }
+    bin_remove(h, c);
+
+    uint32_t size_left = chunk_size(c) - need;
+    if (size_left >= CHUNK_MIN) {    // 剩下的部分足够成为一个块, 切下来放回空闲链表
+        struct chunk* rest = (struct chunk*)((uint32_t)c + need);
+        chunk_set_free(rest, size_left);
+        bin_insert(h, rest);
+    } else {    // 整块分出去
+        need = chunk_size(c);
+        chunk_next(c)->head |= CHUNK_PREV_INUSE;
+    }
+    c->head = need | CHUNK_INUSE | (c->head & CHUNK_PREV_INUSE);
+    return (void*)((uint32_t)c + 4);
+}
+
+/* 释放ptr指向的内存 */
+void free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    struct heap* h = heap_get();
+    struct chunk* c = (struct chunk*)((uint32_t)ptr - 4);
+    assert((c->head & CHUNK_INUSE) && (uint32_t)c > USER_HEAP_START && (uint32_t)c < h->brk);
+    c = chunk_merge(h, c, chunk_size(c));
+
+    // 合并后位于堆顶且过大, 把多出的页还给内核
+    if (chunk_next(c) == (struct chunk*)(h->brk - 4) && chunk_size(c) >= HEAP_TRIM) {
+        bin_remove(h, c);
+        heap_trim(h, c);
+        bin_insert(h, c);
+    }
+}
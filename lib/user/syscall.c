@@ -57,14 +57,6 @@ uint32_t getpid() {
 uint32_t write(int32_t fd, const void* buf, uint32_t count) {
    return _syscall3(SYS_WRITE, fd, buf, count);
 }
-void* malloc(uint32_t size){
-    return (void*) _syscall1(SYS_MALLOC, size);
-}
-
-/* 释放ptr指向的内存 */
-void free(void* ptr) {
-    _syscall1(SYS_FREE, ptr);
-}
 
 /* 克隆父进程 */
 pid_t fork(void) {
@@ -156,6 +148,28 @@ void ps(void) {
     _syscall0(SYS_PS);
 }
 
+/* 把堆顶设为end, 返回设置后的堆顶, 失败时堆顶不变; end为NULL时只查询当前堆顶 */
+void* brk(void* end) {
+    return (void*)_syscall1(SYS_BRK, end);
+}
+
+/* 把堆顶移动increment字节, 成功返回原来的堆顶, 失败返回(void*)-1 */
+void* sbrk(int32_t increment) {
+    uint32_t old_brk = (uint32_t)brk(NULL);
+    if (increment == 0) {
+        return (void*)old_brk;
+    }
+    if ((uint32_t)brk((void*)(old_brk + increment)) != old_brk + increment) {
+        return (void*)-1;
+    }
+    return (void*)old_brk;
+}
+
+/* 获取内存使用情况到info中 */
+void meminfo(struct meminfo* info) {
+    _syscall1(SYS_MEMINFO, info);
+}
+
 /* 执行pathname */
 int32_t execv(const char* pathname, char** argv) {
    return _syscall2(SYS_EXECV, pathname, argv);
@@ -185,3 +199,48 @@ void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd) {
 void help(void) {
    _syscall0(SYS_HELP);
 }
+
+/* 把已打开的文件fd从offset(按页对齐)起的length字节映射到内存, 返回映射的起始地址, 失败返回NULL */
+void* mmap(int32_t fd, uint32_t offset, uint32_t length) {
+   return (void*)_syscall3(SYS_MMAP, fd, offset, length);
+}
+
+/* 解除mmap返回的以addr起始的映射, 成功返回0, 失败返回-1 */
+int32_t munmap(void* addr) {
+   return _syscall1(SYS_MUNMAP, addr);
+}
+
+/* 把映射中[addr, addr + length)内修改过的页写回文件, 成功返回0, 失败返回-1 */
+int32_t msync(void* addr, uint32_t length) {
+   return _syscall2(SYS_MSYNC, addr, length);
+}
+
+/* 获取键为key、至少size字节的共享内存段, 不存在则新建, 成功返回段号, 失败返回-1 */
+int32_t shmget(uint32_t key, uint32_t size) {
+   return _syscall2(SYS_SHMGET, key, size);
+}
+
+/* 把共享内存段shmid映射到本进程, 返回映射的起始地址, 失败返回NULL */
+void* shmat(int32_t shmid) {
+   return (void*)_syscall1(SYS_SHMAT, shmid);
+}
+
+/* 解除shmat返回的以addr起始的映射, 成功返回0, 失败返回-1 */
+int32_t shmdt(void* addr) {
+   return _syscall1(SYS_SHMDT, addr);
+}
+
+/* 睡眠req指定的时间, 成功返回0, 失败返回-1 */
+int32_t nanosleep(const struct timespec* req, struct timespec* rem) {
+   return _syscall2(SYS_NANOSLEEP, req, rem);
+}
+
+/* 读取时钟clock_id的当前时间到tp, 成功返回0, 失败返回-1 */
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp) {
+   return _syscall2(SYS_CLOCK_GETTIME, clock_id, tp);
+}
+
+/* 删除共享内存段shmid, 还有映射者时等最后一个映射者解除映射后才释放, 成功返回0, 失败返回-1 */
+int32_t shmrm(int32_t shmid) {
+   return _syscall1(SYS_SHMRM, shmid);
+}
@@ -3,6 +3,7 @@
 #include "stdint.h"
 #include "fs.h"
 #include "thread.h"
+#include "timer.h"
 
 enum SYSCALL_NR {
    SYS_GETPID,
@@ -32,7 +33,18 @@ enum SYSCALL_NR {
    SYS_WAIT,
    SYS_PIPE,
    SYS_FD_REDIRECT,
-   SYS_HELP
+   SYS_HELP,
+   SYS_MEMINFO,
+   SYS_BRK,
+   SYS_MMAP,
+   SYS_MUNMAP,
+   SYS_MSYNC,
+   SYS_SHMGET,
+   SYS_SHMAT,
+   SYS_SHMDT,
+   SYS_NANOSLEEP,
+   SYS_CLOCK_GETTIME,
+   SYS_SHMRM
 };
 uint32_t getpid(void);
 uint32_t write(int32_t fd, const void* buf, uint32_t count);
@@ -62,4 +74,16 @@ pid_t wait(int32_t* status);
 int32_t pipe(int32_t pipefd[2]);
 void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd);
 void help(void);
+void meminfo(struct meminfo* info);
+void* brk(void* end);
+void* sbrk(int32_t increment);
+void* mmap(int32_t fd, uint32_t offset, uint32_t length);
+int32_t munmap(void* addr);
+int32_t msync(void* addr, uint32_t length);
+int32_t shmget(uint32_t key, uint32_t size);
+void* shmat(int32_t shmid);
+int32_t shmdt(void* addr);
+int32_t nanosleep(const struct timespec* req, struct timespec* rem);
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp);
+int32_t shmrm(int32_t shmid);
 #endif
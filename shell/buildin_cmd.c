@@ -204,6 +204,40 @@ void buildin_ps(uint32_t argc, char** argv UNUSED) {
     ps();
 }
 
+/* 打印一个内存池的使用情况, 单位为页 */
+static void pool_meminfo_print(const char* name, struct pool_meminfo* pool) {
+    uint32_t owned = pool->total_pages - pool->lent_pages + pool->borrowed_pages;
+    printf("%s  %d  %d  %d  %d  %d  %d\n", name, pool->total_pages, owned - pool->free_pages,
+           pool->free_pages, pool->zero_pages, pool->lent_pages, pool->borrowed_pages);
+}
+
+/* meminfo命令内建函数 */
+void buildin_meminfo(uint32_t argc, char** argv UNUSED) {
+    if (argc != 1) {
+        printf("meminfo: no argument support!\n");
+        return;
+    }
+    struct meminfo info;
+    meminfo(&info);
+
+    printf("POOL  TOTAL  USED  FREE  ZEROED  LENT  BORROWED\n");
+    pool_meminfo_print("kernel", &info.kernel);
+    pool_meminfo_print("user", &info.user);
+    printf("vmalloc: %d pages  slab: %d pages\n", info.vmalloc_pages, info.slab_pages);
+    printf("swap: %d/%d slots free  out: %d  in: %d\n", info.swap_free, info.swap_total, info.swap_out_cnt, info.swap_in_cnt);
+
+    printf("BLOCK  ARENAS  FREE_BLOCKS\n");
+    uint32_t idx;
+    for (idx = 0; idx < DESC_CNT; idx++) {
+        printf("%d  %d  %d\n", info.blocks[idx].block_size, info.blocks[idx].arena_cnt, info.blocks[idx].free_blocks);
+    }
+
+    printf("PID  RSS  PT  COMMAND\n");
+    for (idx = 0; idx < info.task_cnt; idx++) {
+        printf("%d  %d  %d  %s\n", info.tasks[idx].pid, info.tasks[idx].rss_pages, info.tasks[idx].pt_pages, info.tasks[idx].name);
+    }
+}
+
 /* clear命令内建函数 */
 void buildin_clear(uint32_t argc, char** argv UNUSED) {
     if (argc != 1) {
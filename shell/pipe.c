@@ -14,8 +14,8 @@ bool is_pipe(uint32_t local_fd) {
 /* 创建管道, 成功返回0, 失败返回-1 */
 int32_t sys_pipe(int32_t pipefd[2]) {
     int32_t global_fd = get_free_slot_in_global();
-    // 申请一页内核内存作为环形缓冲区, 并进行初始化
-    file_table[global_fd].fd_inode = get_kernel_pages(1);
+    // 申请一页内核内存作为环形缓冲区, 并进行初始化(缓冲区内容由读写指针界定, 无需清0)
+    file_table[global_fd].fd_inode = get_kernel_pages_nozero(1);
     if(file_table[global_fd].fd_inode == NULL){
         return -1;
     }
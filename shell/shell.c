@@ -126,6 +126,8 @@ static void cmd_execute(uint32_t argc, char** argv){
         buildin_pwd(argc, argv);
     } else if (!strcmp("ps", argv[0])) {
         buildin_ps(argc, argv);
+    } else if (!strcmp("meminfo", argv[0])) {
+        buildin_meminfo(argc, argv);
     } else if (!strcmp("clear", argv[0])) {
         buildin_clear(argc, argv);
     } else if (!strcmp("mkdir", argv[0])){
@@ -0,0 +1,219 @@
+#include "shm.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "memory.h"
+#include "slab.h"
+#include "sync.h"
+#include "thread.h"
+
+static struct shm_seg shm_segs[SHM_MAX_SEGS];
+static struct lock shm_lock;                   // 段表和各进程shm_list的互斥
+static struct kmem_cache* shm_attach_cache;
+
+/* 初始化共享内存 */
+void shm_init(void) {
+    lock_init(&shm_lock);
+    shm_attach_cache = kmem_cache_create("shm_attach", sizeof(struct shm_attach), NULL);
+    if (shm_attach_cache == NULL) {
+        PANIC("shm_init: create kmem_cache failed!");
+    }
+}
+
+/* 释放段seg的页框和页框表, 调用者须持有shm_lock, 段此时不能再有映射者 */
+static void shm_seg_destroy(struct shm_seg* seg) {
+    ASSERT(seg->attach_cnt == 0);
+    uint32_t pg_idx;
+    for (pg_idx = 0; pg_idx < seg->pg_cnt; pg_idx++) {
+        if (seg->pages[pg_idx] != NULL) {
+            free_kernel_pages(seg->pages[pg_idx], 1);
+        }
+    }
+    free_kernel_pages(seg->pages, 1);
+    seg->in_use = false;
+}
+
+/* 获取键为key、大小至少为size字节的共享内存段, 不存在则新建, key为IPC_PRIVATE时总是新建
+ * 成功返回段号shmid, 失败返回-1 */
+int32_t sys_shmget(uint32_t key, uint32_t size) {
+    if (size == 0 || size > SHM_MAX_PAGES * PG_SIZE) {
+        return -1;
+    }
+    lock_acquire(&shm_lock);
+    int32_t shmid;
+    int32_t free_id = -1;
+    for (shmid = 0; shmid < SHM_MAX_SEGS; shmid++) {
+        struct shm_seg* seg = &shm_segs[shmid];
+        if (!seg->in_use) {
+            if (free_id == -1) {
+                free_id = shmid;
+            }
+        } else if (key != IPC_PRIVATE && seg->key == key && !seg->removed) {
+            lock_release(&shm_lock);
+            return size <= seg->size ? shmid : -1;
+        }
+    }
+    if (free_id == -1) {
+        lock_release(&shm_lock);
+        return -1;
+    }
+
+    // 页框逐页申请, 段不必物理连续, 大段也不受伙伴系统碎片的影响
+    struct shm_seg* seg = &shm_segs[free_id];
+    seg->pg_cnt = DIV_ROUND_UP(size, PG_SIZE);
+    // 页框表要被所有进程访问, 不能用sys_malloc(用户进程调用时分配在它自己的用户空间), 最大的段的页框表正好一页
+    seg->pages = get_kernel_pages(1);    // 已清0
+    if (seg->pages == NULL) {
+        lock_release(&shm_lock);
+        return -1;
+    }
+    seg->attach_cnt = 0;
+    seg->removed = false;
+    uint32_t pg_idx;
+    for (pg_idx = 0; pg_idx < seg->pg_cnt; pg_idx++) {
+        seg->pages[pg_idx] = get_kernel_pages(1);    // 已清0, 进程之间不会借此看到彼此遗留的数据
+        if (seg->pages[pg_idx] == NULL) {
+            shm_seg_destroy(seg);
+            lock_release(&shm_lock);
+            return -1;
+        }
+    }
+    seg->key = key;
+    seg->size = size;
+    seg->in_use = true;
+    lock_release(&shm_lock);
+    return free_id;
+}
+
+/* 把段shmid映射到当前进程的用户空间, 成功返回映射的起始地址, 失败返回NULL
+ * 所有映射者的页表项指向同一组页框, 数据交换不经过内核复制 */
+void* sys_shmat(int32_t shmid) {
+    struct task_struct* cur = running_thread();
+    if (cur->pgdir == NULL || shmid < 0 || shmid >= SHM_MAX_SEGS) {
+        return NULL;
+    }
+    lock_acquire(&shm_lock);
+    struct shm_seg* seg = &shm_segs[shmid];
+    if (!seg->in_use || seg->removed) {
+        lock_release(&shm_lock);
+        return NULL;
+    }
+    struct shm_attach* attach = kmem_cache_alloc(shm_attach_cache);
+    if (attach == NULL) {
+        lock_release(&shm_lock);
+        return NULL;
+    }
+    void* vaddr = get_user_pages(seg->pg_cnt);    // 只占下虚拟地址
+    if (vaddr == NULL) {
+        kmem_cache_free(shm_attach_cache, attach);
+        lock_release(&shm_lock);
+        return NULL;
+    }
+    // 整段一次映射好, 以后访问不再缺页
+    uint32_t pg_idx;
+    for (pg_idx = 0; pg_idx < seg->pg_cnt; pg_idx++) {
+        page_map_shared((uint32_t)vaddr + pg_idx * PG_SIZE, addr_v2p((uint32_t)seg->pages[pg_idx]), true);
+    }
+    seg->attach_cnt++;
+    attach->vaddr_start = (uint32_t)vaddr;
+    attach->shmid = shmid;
+    list_append(&cur->shm_list, &attach->attach_tag);
+    lock_release(&shm_lock);
+    return vaddr;
+}
+
+/* 解除映射attach, 段没有映射者了就销毁它, 调用者须持有shm_lock */
+static void shm_detach(struct shm_attach* attach) {
+    struct shm_seg* seg = &shm_segs[attach->shmid];
+    list_remove(&attach->attach_tag);
+    free_user_pages((void*)attach->vaddr_start, seg->pg_cnt);    // 每个页表项只减少页框的共享计数
+    if (--seg->attach_cnt == 0) {
+        shm_seg_destroy(seg);
+    }
+    kmem_cache_free(shm_attach_cache, attach);
+}
+
+/* 解除sys_shmat返回的以addr起始的映射, 成功返回0, 失败返回-1 */
+int32_t sys_shmdt(void* addr) {
+    struct task_struct* cur = running_thread();
+    lock_acquire(&shm_lock);
+    struct list_elem* elem = cur->shm_list.head.next;
+    while (elem != &cur->shm_list.tail) {
+        struct shm_attach* attach = elem2entry(struct shm_attach, attach_tag, elem);
+        if (attach->vaddr_start == (uint32_t)addr) {
+            shm_detach(attach);
+            lock_release(&shm_lock);
+            return 0;
+        }
+        elem = elem->next;
+    }
+    lock_release(&shm_lock);
+    return -1;
+}
+
+/* 删除段shmid: 没有映射者时立即销毁, 否则不再允许新的查找和映射, 等最后一个映射者解除映射时销毁
+ * 从未被映射过的段只能靠它释放, 成功返回0, 失败返回-1 */
+int32_t sys_shmrm(int32_t shmid) {
+    if (shmid < 0 || shmid >= SHM_MAX_SEGS) {
+        return -1;
+    }
+    lock_acquire(&shm_lock);
+    struct shm_seg* seg = &shm_segs[shmid];
+    if (!seg->in_use || seg->removed) {
+        lock_release(&shm_lock);
+        return -1;
+    }
+    seg->removed = true;
+    if (seg->attach_cnt == 0) {
+        shm_seg_destroy(seg);
+    }
+    lock_release(&shm_lock);
+    return 0;
+}
+
+/* fork时调用: 子进程继承父进程所有的映射, 页表项已由copy_page_tables_cow复制, 这里补上映射记录和段的映射计数
+ * 成功返回0, 内存不足返回-1 */
+int32_t shm_fork(struct task_struct* child) {
+    struct task_struct* parent = running_thread();
+    list_init(&child->shm_list);
+    lock_acquire(&shm_lock);
+    struct list_elem* elem = parent->shm_list.head.next;
+    while (elem != &parent->shm_list.tail) {
+        struct shm_attach* attach = elem2entry(struct shm_attach, attach_tag, elem);
+        struct shm_attach* child_attach = kmem_cache_alloc(shm_attach_cache);
+        if (child_attach == NULL) {
+            lock_release(&shm_lock);
+            return -1;
+        }
+        child_attach->vaddr_start = attach->vaddr_start;
+        child_attach->shmid = attach->shmid;
+        shm_segs[attach->shmid].attach_cnt++;
+        list_append(&child->shm_list, &child_attach->attach_tag);
+        elem = elem->next;
+    }
+    lock_release(&shm_lock);
+    return 0;
+}
+
+/* fork失败时调用: 释放shm_fork为子进程复制的映射记录(可能只复制了一部分), 页表项由调用者另行撤销
+ * 父进程仍映射着这些段, 段的映射计数不会降到0 */
+void shm_fork_abort(struct task_struct* child) {
+    lock_acquire(&shm_lock);
+    while (!list_empty(&child->shm_list)) {
+        struct shm_attach* attach = elem2entry(struct shm_attach, attach_tag, list_pop(&child->shm_list));
+        ASSERT(shm_segs[attach->shmid].attach_cnt > 1);
+        shm_segs[attach->shmid].attach_cnt--;
+        kmem_cache_free(shm_attach_cache, attach);
+    }
+    lock_release(&shm_lock);
+}
+
+/* 进程退出或exec时调用: 解除当前进程所有的共享内存映射 */
+void shm_release(void) {
+    struct task_struct* cur = running_thread();
+    lock_acquire(&shm_lock);
+    while (!list_empty(&cur->shm_list)) {
+        shm_detach(elem2entry(struct shm_attach, attach_tag, cur->shm_list.head.next));
+    }
+    lock_release(&shm_lock);
+}
@@ -0,0 +1,39 @@
+#ifndef __SHELL_SHM_H
+#define __SHELL_SHM_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+
+#define SHM_MAX_SEGS   16             // 系统中最多同时存在的共享内存段数
+#define SHM_MAX_PAGES  1024           // 一个段最多的页数, 即4MB, 此时页框表正好占一页
+#define IPC_PRIVATE    0              // 以此为键时总是新建一个段, 只能经fork共享给子进程
+
+struct task_struct;
+
+/* 共享内存段: 一组页框, 可以同时映射到多个进程的用户空间 */
+struct shm_seg {
+    bool in_use;
+    uint32_t key;                     // 进程间约定的键, 用于shmget找到同一个段
+    uint32_t size;                    // 创建时请求的字节数
+    uint32_t pg_cnt;
+    void** pages;                     // 各页框在直接映射区中的虚拟地址, 页框来自内核内存池
+    uint32_t attach_cnt;              // 映射着本段的次数, 降为0时段被销毁
+    bool removed;                     // 已被shmrm删除, 不能再被shmget找到和映射, 等现有的映射者都解除映射后销毁
+};
+
+/* 进程对共享内存段的一次映射 */
+struct shm_attach {
+    struct list_elem attach_tag;      // 用于加入进程的shm_list
+    uint32_t vaddr_start;             // 映射到的用户虚拟地址
+    int32_t shmid;
+};
+
+void shm_init(void);
+int32_t sys_shmget(uint32_t key, uint32_t size);
+void* sys_shmat(int32_t shmid);
+int32_t sys_shmdt(void* addr);
+int32_t sys_shmrm(int32_t shmid);
+int32_t shm_fork(struct task_struct* child);
+void shm_fork_abort(struct task_struct* child);
+void shm_release(void);
+#endif
@@ -11,6 +11,10 @@
 #include "console.h"
 #include "fs.h"
 #include "file.h"
+#include "timer.h"
+#include "smp.h"
+#include "bitmap.h"
+#include "softirq.h"
 
 /* pid的位图, 最大支持1024个pid */
 uint8_t pid_bitmap_bits[128] = {0};
@@ -23,24 +27,58 @@ struct pid_pool {
 } pid_pool;
 
 struct task_struct* main_thread;    // 主线程PCB
-struct task_struct* idle_thread;    // idle线程(系统空闲时运行的线程)
 
-struct list thread_ready_list;	    // 就绪队列
+/* 一组就绪队列: 每个调度级别一个队列, 位图的第i位为1表示第i级的队列非空 */
+struct run_queue {
+    uint32_t bitmap;
+    struct list queue[SCHED_LEVELS];
+};
+
+/* 每个处理器一份就绪队列, 两组轮换使用: 用完时间片的任务转入过期组, 活动组空了再与过期组互换,
+ * 这样每一轮中低级别的任务也都能运行, 不会被高级别的任务饿死 */
+struct cpu_rq {
+    struct run_queue arrays[2];
+    uint8_t active_idx;             // 活动组在arrays中的下标, 另一组为过期组
+    uint32_t ready_cnt;             // 两组就绪队列中的任务总数
+};
+
+static struct cpu_rq cpu_rqs[NR_CPUS];
+
 struct list thread_all_list;	    // 所有任务队列
-static struct list_elem* thread_tag;// 用于保存队列中的线程结点
 
 extern void switch_to(struct task_struct* cur, struct task_struct* next);
 extern void init(void);
 
-/* 系统空闲时运行的线程 */
-static void idle(void* arg UNUSED){
-    while (1){
-        thread_block(TASK_BLOCKED);  // 先阻塞自己
-        // 执行到这的时候，说明已被唤醒,再次执行hlt
-        asm volatile ("sti; hlt" : : : "memory"); // 处理器需要被唤醒，必须要保证在开中断的情况下执行hlt
+/* 处理器空闲时运行的循环, 每个处理器都有自己的idle线程在其中运行 */
+void cpu_idle(void) {
+    struct cpu* c = this_cpu();
+    while (1) {
+        // 先趁空闲补充预清0的页框, 有任务就绪时它会立即返回; 清0用的临时映射窗口只有一个, 只让BSP来做
+        if (c->id == 0) {
+            mem_zero_pool_refill();
+        }
+        intr_disable();
+        softirq_run_pending();    // 软中断可能唤醒任务, 要在判断有无就绪任务之前处理
+        if (thread_ready_empty()) {
+            // 睡眠期间放开大内核锁, 别的处理器才能进入内核, 唤醒本处理器的中断会在入口处自己获取
+            lapic_timer_enable(false);
+            kernel_unlock();
+            // 执行hlt, 处理器需要被唤醒，必须要保证在开中断的情况下执行hlt(sti后的一条指令执行完才响应中断, 不会错过唤醒)
+            asm volatile ("sti; hlt" : : : "memory");
+            intr_disable();
+            kernel_lock();
+        }
+        // 本处理器有就绪任务或能从别的处理器取来任务时换上它, 否则schedule直接返回
+        schedule();
+        intr_enable();
     }
 }
 
+/* BSP的idle线程第一次被换上处理器时从这里进入, AP的idle线程由ap_main直接进入cpu_idle */
+static void idle(void* arg UNUSED){
+    cpu_idle();
+}
+
 /* 获取当前线程的pcb指针 */
 struct task_struct* running_thread(){
     uint32_t esp;
@@ -121,6 +159,112 @@ void thread_create(struct task_struct* pthread, thread_func function, void* func
     kthread_stack->ebp = kthread_stack->ebx = kthread_stack->esi = kthread_stack->edi = 0;
 }
 
+/* 计算pthread的调度级别: 优先级越高基础级别越小(越先调度), 再加上动态降级数 */
+static uint8_t sched_level(struct task_struct* pthread) {
+    uint32_t level = pthread->priority >= SCHED_LEVELS - 1 ? 0 : SCHED_LEVELS - 1 - pthread->priority;
+    level += pthread->penalty;
+    return level < SCHED_LEVELS ? level : SCHED_LEVELS - 1;
+}
+
+/* 将pthread加入处理器cpu_id的活动组(expired为true时是过期组)中其调度级别的队列尾部, 须关中断调用 */
+static void rq_enqueue(struct task_struct* pthread, uint8_t cpu_id, bool expired) {
+    struct cpu_rq* crq = &cpu_rqs[cpu_id];
+    uint8_t rq_idx = expired ? crq->active_idx ^ 1 : crq->active_idx;
+    struct run_queue* rq = &crq->arrays[rq_idx];
+    uint8_t level = sched_level(pthread);
+    list_append(&rq->queue[level], &pthread->general_tag);
+    rq->bitmap |= 1 << level;
+    pthread->cpu = cpu_id;
+    pthread->rq_idx = rq_idx;
+    pthread->rq_level = level;
+    pthread->status = TASK_READY;
+    crq->ready_cnt++;
+}
+
+/* 将就绪的pthread从所在队列中摘下, 须关中断调用 */
+static void rq_dequeue(struct task_struct* pthread) {
+    ASSERT(pthread->status == TASK_READY);
+    struct cpu_rq* crq = &cpu_rqs[pthread->cpu];
+    struct run_queue* rq = &crq->arrays[pthread->rq_idx];
+    list_remove(&pthread->general_tag);
+    if (list_empty(&rq->queue[pthread->rq_level])) {
+        rq->bitmap &= ~(1 << pthread->rq_level);
+    }
+    crq->ready_cnt--;
+}
+
+/* 取出rq中级别最高的就绪任务并摘下, rq须非空, 须关中断调用 */
+static struct task_struct* rq_take(struct run_queue* rq) {
+    ASSERT(rq->bitmap != 0);
+    uint32_t level = bit_scan_forward(rq->bitmap);
+    struct task_struct* next = elem2entry(struct task_struct, general_tag, rq->queue[level].head.next);
+    rq_dequeue(next);
+    return next;
+}
+
+/* 取出处理器cpu_id上级别最高的就绪任务, 活动组为空时先与过期组互换, 没有就绪任务返回NULL, 须关中断调用 */
+static struct task_struct* rq_pick_next(uint8_t cpu_id) {
+    struct cpu_rq* crq = &cpu_rqs[cpu_id];
+    if (crq->ready_cnt == 0) {
+        return NULL;
+    }
+    if (crq->arrays[crq->active_idx].bitmap == 0) {
+        crq->active_idx ^= 1;
+    }
+    return rq_take(&crq->arrays[crq->active_idx]);
+}
+
+/* 从就绪任务最多的处理器上摘下一个任务给处理器cpu_id, 那个处理器的就绪任务数须比本处理器至少多min_diff个, 否则返回NULL
+ * 优先取过期组中的任务: 它们近期不会在原处理器上运行, 缓存中的数据也多半已经冷了. 须关中断调用 */
+static struct task_struct* rq_steal(uint8_t cpu_id, uint32_t min_diff) {
+    uint8_t busiest = cpu_id;
+    uint32_t idx;
+    for (idx = 0; idx < cpu_cnt; idx++) {
+        if (cpu_rqs[idx].ready_cnt > cpu_rqs[busiest].ready_cnt) {
+            busiest = idx;
+        }
+    }
+    struct cpu_rq* crq = &cpu_rqs[busiest];
+    if (busiest == cpu_id || crq->ready_cnt < cpu_rqs[cpu_id].ready_cnt + min_diff) {
+        return NULL;
+    }
+    struct run_queue* expired = &crq->arrays[crq->active_idx ^ 1];
+    return rq_take(expired->bitmap != 0 ? expired : &crq->arrays[crq->active_idx]);
+}
+
+/* 处理器cpu_id的负载: 就绪任务数加上正在运行的任务(idle不算) */
+static uint32_t cpu_load(uint8_t cpu_id) {
+    return cpu_rqs[cpu_id].ready_cnt + (cpus[cpu_id].curr != cpus[cpu_id].idle ? 1 : 0);
+}
+
+/* 刚往处理器cpu_id的就绪队列中加了任务, 若它正在hlt中空闲, 发IPI叫醒它来调度 */
+static void cpu_kick(uint8_t cpu_id) {
+    if (cpus[cpu_id].curr == cpus[cpu_id].idle) {
+        smp_send_resched(&cpus[cpu_id]);
+    }
+}
+
+/* 将新建的任务pthread加入负载最轻的处理器的就绪队列 */
+void thread_ready_add(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(pthread->status == TASK_READY);
+    uint8_t target = 0;
+    uint32_t idx;
+    for (idx = 1; idx < cpu_cnt; idx++) {
+        if (cpu_load(idx) < cpu_load(target)) {
+            target = idx;
+        }
+    }
+    rq_enqueue(pthread, target, false);
+    cpu_kick(target);
+    intr_set_status(old_status);
+}
+
+/* 当前处理器的就绪队列中是否没有任务 */
+bool thread_ready_empty(void) {
+    return cpu_rqs[this_cpu()->id].ready_cnt == 0;
+}
+
 /* 初始化线程的基本信息 */
 void init_thread(struct task_struct* pthread, char* name, int prio){
     memset(pthread, 0, sizeof(*pthread));
@@ -150,6 +294,8 @@ void init_thread(struct task_struct* pthread, char* name, int prio){
         pthread->fd_table[fd_idx] = -1;
     }
 
+    list_init(&pthread->mmap_list);
+    list_init(&pthread->shm_list);
     pthread->cwd_inode_nr = 0;            // 以根目录作为默认的工作路径
 
     pthread->parent_pid = -1;              // -1 表示没有父进程
@@ -166,9 +312,7 @@ struct task_struct* thread_start(char* name, int prio, thread_func function, voi
     init_thread(thread, name, prio);
     thread_create(thread, function, func_arg);
 
-    // 确保要加入的线程所属的那个tag不在队列中, 才可往队列中加入
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready_add(thread);
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
 
@@ -184,7 +328,7 @@ static void make_main_thread(void){
     main_thread = running_thread();
     init_thread(main_thread, "main", 31);
 
-    // main函数是当前线程, 当前线程不在thread_ready_list中, 但是要将其加在thread_all_list中
+    // main函数是当前线程, 当前线程不在就绪队列中, 但是要将其加在thread_all_list中
     ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag));
     list_append(&thread_all_list, &main_thread->all_list_tag);
 }
@@ -194,27 +338,38 @@ void schedule(){
     ASSERT(intr_get_status() == INTR_OFF);
     // 获取当前运行线程的PCB, 将其存入PCB指针cur中
     struct task_struct* cur = running_thread();
-    if(cur->status == TASK_RUNNING) {  // 如果此线程只是cpu时间片到了, 将其加入就绪队列尾部
-        ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-        list_append(&thread_ready_list, &cur->general_tag);
+    struct cpu* c = this_cpu();
+    c->need_resched = false;
+    if (cur == c->idle) {    // idle线程不进就绪队列, 换下后视为阻塞
+        cur->status = TASK_BLOCKED;
+    } else if(cur->status == TASK_RUNNING) {  // 如果此线程只是cpu时间片到了, 说明它是计算密集型的, 降一级后放入本处理器的过期组
+        if (cur->penalty < SCHED_PENALTY_MAX) {
+            cur->penalty++;
+        }
         cur->ticks = cur->priority;    // 重新将优先级作为可运行的时间片数量赋值给该线程的ticks
-        cur->status = TASK_READY;
+        rq_enqueue(cur, c->id, true);
     }else{    // 如果当前线程需要某事件发生后才能继续上cpu运行(阻塞),则不需要将其加入队列,因为当前线程不在就绪队列中
 
     }
 
-    // 如果就绪队列中没有可运行的任务,就唤醒idle
-    if (list_empty(&thread_ready_list)) {
-        thread_unblock(idle_thread);
+    // 用bsf找出本处理器级别最高的非空队列, 弹出其队首的线程; 本处理器没有就绪任务时从最忙的处理器取一个, 都没有就换上idle
+    struct task_struct* next = rq_pick_next(c->id);
+    if (next == NULL) {
+        next = rq_steal(c->id, 1);
+    }
+    if (next == NULL) {
+        next = c->idle;
     }
-
-    ASSERT(!list_empty(&thread_ready_list));
-    // 将就绪队列中的第一个线程(的general_tag)弹出, 准备将其调度上cpu
-    thread_tag = NULL;
-    thread_tag = list_pop(&thread_ready_list);
-
-    struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
     next->status = TASK_RUNNING;
+    next->cpu = c->id;
+    c->curr = next;
+    if (next == cur) {
+        return;
+    }
+    // idle期间时钟中断可能被推迟或停掉了, 换上别的任务时要恢复按tick计时间片
+    if (cur == c->idle) {
+        timer_resume_tick();
+    }
 
     // 激活任务页表等
     process_activate(next);
@@ -225,11 +380,16 @@ void schedule(){
 void thread_block(enum task_status stat) {
     // stat取值为TASK_BLOCKED、TASK_WAITING、TASK_HANGING这三种状态才不会被调度
     ASSERT(((stat == TASK_BLOCKED) || (stat == TASK_WAITING) || (stat == TASK_HANGING)));
+    ASSERT(!in_softirq());    // 软中断借用被中断任务的上下文执行, 不能让它阻塞; 需要睡眠的工作应交给工作队列
     // 关中断
     enum intr_status old_status = intr_disable();
     // 获取当前的线程，并将其状态设置为stat
     struct task_struct* cur_thread = running_thread();
     cur_thread->status = stat;
+    // 时间片没用完就阻塞等待事件, 多半是I/O密集型任务, 升一级使其被唤醒后能尽快得到调度
+    if (cur_thread->ticks > 0 && cur_thread->penalty > 0) {
+        cur_thread->penalty--;
+    }
     // 将当前线程换下处理器
     schedule();
     // 待当前线程被解除阻塞后才继续运行下面的intr_set_status设置为之前关中断前的"中断状态"
@@ -243,13 +403,17 @@ void thread_unblock(struct task_struct* pthread) {
     ASSERT(((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING)));
 
     if(pthread->status != TASK_READY){
-        ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-        if(elem_find(&thread_ready_list, &pthread->general_tag)) {
-            PANIC("thread_unblock: blocked thread in ready_list\n");
+        // 优先回到上次运行它的处理器, 那里的缓存中可能还留着它的数据; 那个处理器在忙而有别的处理器空闲时, 改去空闲的处理器
+        uint8_t target = pthread->cpu;
+        uint32_t idx;
+        for (idx = 0; idx < cpu_cnt && cpu_load(target) > 0; idx++) {
+            if (cpu_load(idx) == 0) {
+                target = idx;
+            }
         }
-        // 将之前阻塞的线程放到“就绪队列”中(队首！)，使其能够尽快得到调度
-        list_push(&thread_ready_list, &pthread->general_tag);
-        pthread->status = TASK_READY;
+        // 放入活动组中其级别的队列尾部: 级别高的I/O密集型任务很快就能得到调度, 同级别的任务也不会因被插队而饿死
+        rq_enqueue(pthread, target, false);
+        cpu_kick(target);
     }
     // 恢复之前的中断状态
     intr_set_status(old_status);
@@ -259,13 +423,59 @@ void thread_unblock(struct task_struct* pthread) {
 void thread_yield(void) {
     struct task_struct* cur = running_thread();
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-    list_append(&thread_ready_list, &cur->general_tag);
-    cur->status = TASK_READY;
+    ASSERT(cur->status == TASK_RUNNING);
+    rq_enqueue(cur, cur->cpu, false);    // 剩余的时间片保留, 仍放在本处理器的活动组
     schedule();
     intr_set_status(old_status);
 }
 
+/* 处理器cpu_id定期调用: 最忙的处理器比本处理器多出至少两个就绪任务时, 拉一个过来, 须关中断调用 */
+static void sched_balance(uint8_t cpu_id) {
+    struct task_struct* pthread = rq_steal(cpu_id, 2);
+    if (pthread != NULL) {
+        rq_enqueue(pthread, cpu_id, false);
+    }
+}
+
+/* 在时钟中断中调用, 当前处理器又过了elapsed个tick: 记账并扣减当前任务的时间片, 用完就调度; 每隔一段时间做一次负载均衡 */
+void thread_tick(uint32_t elapsed) {
+    // 先获取当前正在运行的线程的pcb
+    struct task_struct* cur_thread = running_thread();
+    // 检查栈是否溢出, 破坏了线程信息
+    ASSERT(cur_thread->stack_magic == 0x19980924);
+    cur_thread->elapsed_ticks += elapsed;    // 记录此线程占用的cpu时间
+
+    // idle线程只在没有就绪任务时运行, 有任务就绪后它会自己调度, 无需按时间片调度
+    struct cpu* c = this_cpu();
+    if (cur_thread == c->idle) {
+        return;
+    }
+    c->balance_ticks += elapsed;
+    if (c->balance_ticks >= SCHED_BALANCE_TICKS) {
+        c->balance_ticks = 0;
+        sched_balance(c->id);
+    }
+    if(cur_thread->ticks == 0) {    // 若进程时间片用完, 就在中断返回前(软中断处理完之后)调度新的进程上cpu
+        c->need_resched = true;
+    }else{
+        cur_thread->ticks -= elapsed < cur_thread->ticks ? elapsed : cur_thread->ticks;
+    }
+}
+
+/* 为处理器cpu_id创建idle线程: 它不进就绪队列, 本处理器没有就绪任务时由schedule直接换上, 失败返回NULL */
+struct task_struct* thread_idle_create(uint8_t cpu_id) {
+    struct task_struct* idle_pcb = get_kernel_pages(1);
+    if (idle_pcb == NULL) {
+        return NULL;
+    }
+    init_thread(idle_pcb, "idle", 10);
+    thread_create(idle_pcb, idle, NULL);
+    idle_pcb->cpu = cpu_id;
+    idle_pcb->status = TASK_BLOCKED;
+    list_append(&thread_all_list, &idle_pcb->all_list_tag);
+    return idle_pcb;
+}
+
 /* 用于对齐输出, 以填充空格的方式输出buf, 目的就是无聊ptr指向的字符串多长，最后都统一成buf_len长度的字符串 */
 static void pad_print(char* buf, int32_t buf_len, void* ptr, char format) {
     memset(buf, 0, buf_len);
@@ -341,14 +551,17 @@ void sys_ps(void) {
 
 /* 回收"待退出进程"thread_over的pcb和页表, 并将其从调度队列中移除 */
 void thread_exit(struct task_struct* thread_over, bool need_schedule) {
+    // 内核线程弹匣中的内存块属于所有线程共用的内核堆, 要在关中断前(归还时需要加锁)先还回去
+    if (thread_over->pgdir == NULL) {
+        mem_magazine_drain(thread_over);
+    }
     // 先将thread_over的状态设置为TASK_DIED, 表示该任务即将结束生命周期
     intr_disable();  // 调用schedule函数调度进程/线程之前要关中断
-    thread_over->status = TASK_DIED;
-
     // 判断thread_over是否为当前线程, 不是的话有可能还在就绪队列中, 将其从就绪队列中删除
-    if (elem_find(&thread_ready_list, &thread_over->general_tag)) {
-        list_remove(&thread_over->general_tag);
+    if (thread_over->status == TASK_READY) {
+        rq_dequeue(thread_over);
     }
+    thread_over->status = TASK_DIED;
     // 若是用户进程, 则回收进程的页表
     if (thread_over->pgdir) {
         mfree_page(PF_KERNEL, thread_over->pgdir, 1);    // 回收其页目录表所占用的一页框
@@ -373,7 +586,14 @@ void thread_exit(struct task_struct* thread_over, bool need_schedule) {
 /* 初始化"线程环境" */
 void thread_init(void) {
     put_str("thread_init start\n");
-    list_init(&thread_ready_list);
+    uint32_t cpu_id, rq_idx, level;
+    for (cpu_id = 0; cpu_id < NR_CPUS; cpu_id++) {
+        for (rq_idx = 0; rq_idx < 2; rq_idx++) {
+            for (level = 0; level < SCHED_LEVELS; level++) {
+                list_init(&cpu_rqs[cpu_id].arrays[rq_idx].queue[level]);
+            }
+        }
+    }
     list_init(&thread_all_list);
     pid_pool_init();
 
@@ -383,7 +603,8 @@ void thread_init(void) {
     // 将当前main函数创建为线程
     make_main_thread();
 
-    // 创建idle线程
-    idle_thread = thread_start("idle", 10, idle, NULL);
+    // 创建BSP的idle线程, AP的由smp_init在启动它们时创建
+    cpus[0].idle = thread_idle_create(0);
+    cpus[0].curr = main_thread;
     put_str("thread_init done!\n");
 }
\ No newline at end of file
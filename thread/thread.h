@@ -7,6 +7,9 @@
 
 #define TASK_NAME_LEN 16
 #define MAX_FILES_OPEN_PER_PROC 8
+#define SCHED_LEVELS 32         // 调度级别数, 0级最先调度; 每级一个就绪队列, 用一个32位位图标记哪些级别的队列非空
+#define SCHED_PENALTY_MAX 4     // 计算密集型任务最多被降低的级别数
+#define SCHED_BALANCE_TICKS 10  // 每个处理器每隔多少个tick检查一次负载是否均衡
 
 typedef int16_t pid_t;
 /*自定义通用函数类型, 它将在很多线程函数中作为形参类型*/
@@ -74,10 +77,19 @@ struct task_struct {
     pid_t pid;
     enum task_status status;
     char name[TASK_NAME_LEN];
-    uint8_t priority;         // 线程优先级
+    uint8_t priority;         // 线程优先级, 既是时间片长度, 也决定了基础调度级别
     uint8_t ticks;            // 每次在处理器上执行的时间嘀嗒数
+    uint8_t penalty;          // 动态降级数: 用完时间片加1, 时间片没用完就阻塞减1, 调度级别为基础级别加上它
+    uint8_t rq_idx;           // 就绪时所在的就绪队列组
+    uint8_t rq_level;         // 就绪时所在的调度级别
+    uint8_t cpu;              // 正在或最近一次运行它的处理器, 就绪时为它所在就绪队列的处理器
 
     uint32_t elapsed_ticks;   // 此任务自上cpu运行后至今已占用的cpu嘀嗒数
+    uint32_t min_flt;         // 缺页时现分配页框即可解决的缺页(次缺页)次数
+    uint32_t maj_flt;         // 缺页时要从交换分区读回的缺页(主缺页)次数
+    uint32_t rss_pages;       // 用户空间映射着的页框数(驻留集), fork时随pcb一起复制, 子进程的页表与父进程的一一对应
+    uint32_t pt_pages;        // 用户空间的页表数
+    uint32_t brk;             // 用户堆的堆顶(program break), 堆为[USER_HEAP_START, brk)
 
     struct list_elem general_tag; // 用于线程在一般的队列中的结点
 
@@ -86,8 +98,11 @@ struct task_struct {
     uint32_t* pgdir;                                // 该进程自己的页表的虚拟地址
 	struct virtual_addr userprog_vaddr;             // 用户进程的虚拟地址池
 	struct mem_block_desc u_block_desc[DESC_CNT];   // 用户进程内存块描述符
+    struct mem_magazine mags[DESC_CNT];             // 各规格内存块的弹匣, 内核线程缓存内核堆的块, 用户进程缓存自己堆中的块
 
 	int32_t fd_table[MAX_FILES_OPEN_PER_PROC];      // 文件描述符数组
+    struct list mmap_list;                          // 文件映射区(struct mmap_area)链表
+    struct list shm_list;                           // 共享内存段的映射(struct shm_attach)链表
     uint32_t cwd_inode_nr;	                        // 进程所在的工作目录的inode编号
 
     pid_t parent_pid;                              // 父进程的pid
@@ -98,7 +113,6 @@ struct task_struct {
 };
 
 
-extern struct list thread_ready_list;
 extern struct list thread_all_list;
 
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
@@ -110,6 +124,11 @@ void thread_init(void);
 void thread_block(enum task_status stat);
 void thread_unblock(struct task_struct* pthread);
 void thread_yield(void);
+void thread_ready_add(struct task_struct* pthread);
+bool thread_ready_empty(void);
+void thread_tick(uint32_t elapsed);
+struct task_struct* thread_idle_create(uint8_t cpu_id);
+void cpu_idle(void);
 pid_t fork_pid(void);
 void sys_ps(void);
 void thread_exit(struct task_struct* thread_over, bool need_schedule);
@@ -0,0 +1,86 @@
+#include "workqueue.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "list.h"
+#include "thread.h"
+#include "print.h"
+
+#define SYSTEM_WQ_PRIO 16    // 默认工作队列工作线程的优先级
+
+static struct workqueue events_wq;
+struct workqueue* system_wq;    // 默认工作队列, 没有特别要求的工作都放在这里
+
+/* 初始化工作w, 执行时调用func(arg) */
+void work_init(struct work* w, void (*func)(void*), void* arg) {
+    w->func = func;
+    w->arg = arg;
+    w->pending = false;
+}
+
+/* 工作线程: 队列为空时阻塞, 被唤醒后一次取走队列中所有的工作再逐个执行 */
+static void worker_thread(void* arg) {
+    struct workqueue* wq = arg;
+    struct list batch;
+    while (true) {
+        enum intr_status old_status = intr_disable();
+        while (list_empty(&wq->works)) {
+            wq->worker_sleeping = true;
+            thread_block(TASK_BLOCKED);
+        }
+        // 整个队列一次摘下, 执行期间新加入的工作等下一批, 其间不必唤醒本线程
+        list_init(&batch);
+        while (!list_empty(&wq->works)) {
+            list_append(&batch, list_pop(&wq->works));
+        }
+        wq->batch_cnt++;
+        intr_set_status(old_status);
+
+        while (!list_empty(&batch)) {
+            struct work* w = elem2entry(struct work, work_tag, list_pop(&batch));
+            // 执行前才清除pending, 工作在执行中可以把自己重新加入队列
+            old_status = intr_disable();
+            w->pending = false;
+            intr_set_status(old_status);
+            void (*func)(void*) = w->func;
+            func(w->arg);
+            wq->work_cnt++;
+        }
+    }
+}
+
+/* 初始化工作队列wq并启动名为name、优先级为prio的工作线程 */
+void workqueue_setup(struct workqueue* wq, char* name, int prio) {
+    list_init(&wq->works);
+    wq->worker_sleeping = false;
+    wq->batch_cnt = 0;
+    wq->work_cnt = 0;
+    wq->worker = thread_start(name, prio, worker_thread, wq);
+}
+
+/* 把工作w加入工作队列wq, 可在中断和软中断中调用; w已在队列中尚未执行时返回false */
+bool queue_work(struct workqueue* wq, struct work* w) {
+    enum intr_status old_status = intr_disable();
+    if (w->pending) {
+        intr_set_status(old_status);
+        return false;
+    }
+    w->pending = true;
+    list_append(&wq->works, &w->work_tag);
+    // 工作线程正在执行上一批时不去唤醒它, 它执行完会自己回来取
+    if (wq->worker_sleeping) {
+        wq->worker_sleeping = false;
+        thread_unblock(wq->worker);
+    }
+    intr_set_status(old_status);
+    return true;
+}
+
+/* 初始化工作队列子系统, 创建默认工作队列 */
+void workqueue_init(void) {
+    put_str("workqueue_init start\n");
+    workqueue_setup(&events_wq, "events", SYSTEM_WQ_PRIO);
+    system_wq = &events_wq;
+    put_str("workqueue_init done\n");
+}
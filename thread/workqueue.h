@@ -0,0 +1,30 @@
+#ifndef __THREAD_WORKQUEUE_H
+#define __THREAD_WORKQUEUE_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "thread.h"
+
+/* 工作: 推迟到工作线程中执行的一次函数调用, 与软中断不同, func在进程上下文中执行, 可以睡眠 */
+struct work {
+    struct list_elem work_tag;    // 用于加入工作队列
+    void (*func)(void*);
+    void* arg;
+    bool pending;                 // 已加入队列尚未开始执行, 此时再次加入队列会被忽略
+};
+
+/* 工作队列: 由一个专门的内核线程按加入顺序执行其中的工作 */
+struct workqueue {
+    struct list works;                // 等待执行的工作
+    struct task_struct* worker;       // 工作线程
+    bool worker_sleeping;             // 工作线程因队列为空而阻塞, 加入工作时才需要唤醒它
+    uint32_t batch_cnt;               // 工作线程被唤醒后一次取走整个队列的次数
+    uint32_t work_cnt;                // 累计执行的工作数
+};
+
+extern struct workqueue* system_wq;
+void work_init(struct work* w, void (*func)(void*), void* arg);
+void workqueue_setup(struct workqueue* wq, char* name, int prio);
+bool queue_work(struct workqueue* wq, struct work* w);
+void workqueue_init(void);
+#endif
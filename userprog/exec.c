@@ -5,8 +5,10 @@
 #include "string.h"
 #include "global.h"
 #include "memory.h"
+#include "mmap.h"
+#include "shm.h"
 
-extern void intr_exit(void);
+extern void intr_exit_unlock(void);
 typedef uint32_t Elf32_Word, Elf32_Addr, Elf32_Off;
 typedef uint16_t Elf32_Half;
 
@@ -51,8 +53,9 @@ enum segment_type {
     PT_PHDR             // 程序头表
 };
 
-/* 将文件描述符fd指向的文件中, 偏移量为offset, 大小为filesz的段加载到虚拟地址为vaddr的内存, 成功返回1, 失败返回0 */
-static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t vaddr) {
+/* 将文件描述符fd指向的文件中, 偏移量为offset, 大小为filesz的段加载到虚拟地址为vaddr的内存, 成功返回1, 失败返回0
+ * 段在内存中的大小memsz超出filesz的部分(bss)要清0, 其中整页的部分只占下虚拟地址, 由缺页处理程序按需分配 */
+static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t memsz, uint32_t vaddr) {
     uint32_t vaddr_first_page = vaddr & 0xfffff000;                  // vaddr地址所在的页框的起始地址
     uint32_t size_in_first_page = PG_SIZE - (vaddr & 0x00000fff);    // 加载到内存后, 文件在第一个页框中占用的字节大小
     // 若一个页框容不下该段
@@ -68,10 +71,8 @@ static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t
     uint32_t vaddr_page = vaddr_first_page;
     while (page_idx < occupy_pages) {
         // 试图申请对应的虚拟页框
-        uint32_t* pde = pde_ptr(vaddr_page);
-        uint32_t* pte = pte_ptr(vaddr_page);
-        // 如果pde 或 pte不存在就从虚拟内存池中分配内存(pde的判断要在pte之前, 0x00000001指的是 存在位P)
-        if(!(*pde & 0x00000001) || !(*pte & 0x00000001)) {
+        // 如果pde 或 pte不存在就从虚拟内存池中分配内存
+        if(!vaddr_is_mapped(vaddr_page)) {
             if(get_a_page(PF_USER, vaddr_page) == NULL) {
                 return false;
             }
@@ -85,6 +86,21 @@ static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t
     // 将该段读入到虚拟地址vaddr处， 自此一个段就被加载到内存中了
     sys_read(fd, (void*)vaddr, filesz);
 
+    if (memsz > filesz) {
+        // bss落在最后一个文件页内的部分: 该页可能是原进程的旧页框, 必须清0
+        uint32_t bss_start = vaddr + filesz, bss_end = vaddr + memsz;
+        uint32_t first_page_end = vaddr_page < bss_end ? vaddr_page : bss_end;
+        memset((void*)bss_start, 0, first_page_end - bss_start);
+        // 其余整页的bss: 原进程已映射的页清0, 未映射的只占下虚拟地址
+        while (vaddr_page < bss_end) {
+            if (vaddr_is_mapped(vaddr_page)) {
+                memset((void*)vaddr_page, 0, PG_SIZE);
+            } else {
+                user_page_reserve(vaddr_page);
+            }
+            vaddr_page += PG_SIZE;
+        }
+    }
     return true;
 }
 
@@ -128,7 +144,7 @@ static int32_t load(const char* pathname) {
         }
         // 如果是可加载段， 就调用segment_load加载到内存
         if (prog_header.p_type == PT_LOAD) {
-            if(!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_vaddr)) {
+            if(!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_memsz, prog_header.p_vaddr)) {
                 ret = -1;
                 goto done;
             }
@@ -156,6 +172,10 @@ int32_t sys_execv(const char* path, const char* argv[]) {
     if(entry_point == -1) {
         return -1;    // 加载失败返回-1
     }
+    // 旧程序的文件映射区写回后解除, 共享内存也一并分离, 新程序从空堆开始
+    mmap_release();
+    shm_release();
+    user_heap_init();
     // 修改进程名
     struct task_struct* cur = running_thread();
     memcpy(cur->name, path, TASK_NAME_LEN);
@@ -169,6 +189,7 @@ int32_t sys_execv(const char* path, const char* argv[]) {
     intr_0_stack->esp = (void*)0xc0000000;
 
     // 将新进程的内核栈地址赋给esp, exec不同于fork, 为使得新进程更快被执行, 直接立即从中断返回
-    asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g"(intr_0_stack) : "memory");
+    // 这样就跳过了syscall_handler中释放大内核锁的那一步, 改由intr_exit_unlock释放
+    asm volatile ("movl %0, %%esp; jmp intr_exit_unlock" : : "g"(intr_0_stack) : "memory");
     return 0;
 }
\ No newline at end of file
@@ -9,7 +9,7 @@
 #include "string.h"
 #include "console.h"
 
-extern void intr_exit(void);
+extern void intr_exit_unlock(void);
 
 /* 构建用户进程初始化上下文信息 */
 void start_process(void* filename) {
@@ -31,10 +31,11 @@ void start_process(void* filename) {
     proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
     // 为用户进程分配3特权级下的栈, 也就是需要指向从用户内存池中分配的地址
     proc_stack->esp = (void*)((uint32_t)get_a_page(PF_USER, USER_STACK3_VADDR) + PG_SIZE);
+    user_heap_init();
     proc_stack->ss = SELECTOR_U_DATA;
-    // 将当前栈顶esp替换为刚刚填充完的proc_stack, 然后通过jmp intr_exit使程序流程跳转到中断出口地址Intr_exit, 通过那里的一系列pop指令和iretd指令
+    // 将当前栈顶esp替换为刚刚填充完的proc_stack, 然后通过jmp intr_exit_unlock使程序流程跳转到中断出口地址, 释放大内核锁后通过那里的一系列pop指令和iretd指令
     // 将proc_stack中的数据载入CPU各寄存器中, 从而使程序“假装”退出中断, 进入特权级3
-    asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g"(proc_stack) : "memory");
+    asm volatile ("movl %0, %%esp; jmp intr_exit_unlock" : : "g"(proc_stack) : "memory");
 }
 
 /* 激活页表 */
@@ -46,6 +47,12 @@ void page_dir_activate(struct task_struct* p_thread) {
     if (p_thread->pgdir != NULL) {    // 用户态进程有自己的页目录表
         pagedir_phy_addr = addr_v2p((uint32_t)p_thread->pgdir);
     }
+    // 在同一页目录的任务间切换时(如两个内核线程之间), 不重新加载cr3, 免得无谓地刷新tlb
+    uint32_t cur_pagedir_phy_addr;
+    asm volatile ("movl %%cr3, %0" : "=r"(cur_pagedir_phy_addr));
+    if (cur_pagedir_phy_addr == pagedir_phy_addr) {
+        return;
+    }
     // 更新页目录寄存器cr3, 使得新页表生效
     asm volatile ("movl %0, %%cr3" : : "r"(pagedir_phy_addr) : "memory");
 }
@@ -87,7 +94,7 @@ uint32_t* create_page_dir(void) {
 void create_user_vaddr_bitmap(struct task_struct* user_prog) {
     user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;    // 0x8048000
     uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE);    // 记录位图需要的内存页框数(1 bit 表示 一页, 故/8表示的是位图占用多少字节)
-    user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt);    // 为位图分配内存
+    user_prog->userprog_vaddr.vaddr_bitmap.bits = vmalloc(bitmap_pg_cnt);    // 为位图分配内存, 位图较大, 从vmalloc区分配
     user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;
     bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap);   // 位图初始化
 }
@@ -104,8 +111,7 @@ void process_execute(void* filename, char* name) {
 
     // 下面部分跟thread_start相同
     enum intr_status old_status = intr_disable();    // 关中断
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready_add(thread);
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
     intr_set_status(old_status);    // 恢复之前的中断状态
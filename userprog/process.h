@@ -5,6 +5,9 @@
 #define default_prio 31
 #define USER_STACK3_VADDR  (0xc0000000 - 0x1000)
 #define USER_VADDR_START 0x8048000
+#define USER_STACK_BOTTOM  (0xc0000000 - 0x800000)    // 用户栈按需向下增长的下限, 即栈最大8MB
+#define USER_HEAP_START 0x40000000    // 用户堆的起始地址, 堆从这里向上增长到USER_STACK_BOTTOM为止
+                                      // 第一页由内核预留(初始全0), 用户态的malloc把自己的管理结构放在这里
 void process_execute(void* filename, char* name);
 void start_process(void* filename_);
 void process_activate(struct task_struct* p_thread);
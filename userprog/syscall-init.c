@@ -11,8 +11,11 @@
 #include "exec.h"
 #include "wait_exit.h"
 #include "pipe.h"
+#include "mmap.h"
+#include "shm.h"
+#include "timer.h"
 
-#define syscall_nr 32 
+#define syscall_nr 64 
 typedef void* syscall;
 syscall syscall_table[syscall_nr];
 
@@ -52,5 +55,16 @@ void syscall_init(void) {
    syscall_table[SYS_PIPE]	    = sys_pipe;
    syscall_table[SYS_FD_REDIRECT]   = sys_fd_redirect;
    syscall_table[SYS_HELP]	    = sys_help;
+   syscall_table[SYS_MEMINFO]	    = sys_meminfo;
+   syscall_table[SYS_BRK]	    = sys_brk;
+   syscall_table[SYS_MMAP]	    = sys_mmap;
+   syscall_table[SYS_MUNMAP]	    = sys_munmap;
+   syscall_table[SYS_MSYNC]	    = sys_msync;
+   syscall_table[SYS_SHMGET]	    = sys_shmget;
+   syscall_table[SYS_SHMAT]	    = sys_shmat;
+   syscall_table[SYS_SHMDT]	    = sys_shmdt;
+   syscall_table[SYS_NANOSLEEP]	    = sys_nanosleep;
+   syscall_table[SYS_CLOCK_GETTIME] = sys_clock_gettime;
+   syscall_table[SYS_SHMRM]	    = sys_shmrm;
    put_str("syscall_init done\n");
 }
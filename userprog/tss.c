@@ -3,6 +3,9 @@
 #include "global.h"
 #include "string.h"
 #include "print.h"
+#include "smp.h"
+
+#define TSS_AP_DESC_IDX 7    // AP的tss描述符从gdt的第7项起依次排放, 第4项仍是BSP的
 
 struct tss {
     uint32_t backlink;
@@ -33,12 +36,24 @@ struct tss {
     uint32_t trace;
     uint32_t io_base;
 };
-// 实例化一个tss, 一会儿就将此实例交给CPU
-static struct tss tss;
+// 每个处理器一个tss, 各自记录在本处理器上运行的任务的0级栈
+static struct tss tss[NR_CPUS];
 
-/* 更新tss中esp0字段的值为"传入参数pthread"的0级栈 */
+/* 更新当前处理器的tss中esp0字段的值为"传入参数pthread"的0级栈 */
 void update_tss_esp(struct task_struct* pthread) {
-    tss.esp0 = (uint32_t*) ((uint32_t)pthread + PG_SIZE);
+    tss[this_cpu()->id].esp0 = (uint32_t*) ((uint32_t)pthread + PG_SIZE);
+}
+
+/* 第cpu_id个处理器的tss的选择子 */
+static uint16_t tss_selector(uint8_t cpu_id) {
+    return cpu_id == 0 ? SELECTOR_TSS : (uint16_t)((TSS_AP_DESC_IDX + cpu_id - 1) << 3);
+}
+
+/* 加载包含所有tss描述符的gdt */
+static void gdt_load(void) {
+    // lgdt 48位内存数据, 因此需要重新定义这48位内存数据
+    uint64_t gdt_operand = ((8 * (TSS_AP_DESC_IDX + NR_CPUS - 1) - 1) | ((uint64_t)(uint32_t)0xc0000900 << 16)); // 16位GDT界限 + 32位GDT起始地址
+    asm volatile ("lgdt %0" : : "m"(gdt_operand));
 }
 
 /* 创建gdt描述符 */
@@ -57,23 +72,31 @@ static struct gdt_desc make_gdt_desc(uint32_t* desc_addr, uint32_t limit, uint8_
 /* 在gdt中创建tss并重新加载gdt */
 void tss_init() {
     put_str("tss_init start\n");
-    uint32_t tss_size = sizeof(tss);
-    memset(&tss, 0, tss_size);
-    tss.ss0 = SELECTOR_K_STACK;
-    tss.io_base = tss_size;      // 将tss的io位图的偏移地址设置为tss的大小tss_size, 这表示此TSS中并没有IO位图
+    uint32_t tss_size = sizeof(struct tss);
+    uint8_t cpu_id;
+    for (cpu_id = 0; cpu_id < NR_CPUS; cpu_id++) {
+        memset(&tss[cpu_id], 0, tss_size);
+        tss[cpu_id].ss0 = SELECTOR_K_STACK;
+        tss[cpu_id].io_base = tss_size;      // 将tss的io位图的偏移地址设置为tss的大小tss_size, 这表示此TSS中并没有IO位图
 
-    // gdt段基址为0x900, 把tss描述符放在第4个位置, 也就是0x900 + 0x20的位置
-    *((struct gdt_desc*)0xc0000920) = make_gdt_desc((uint32_t*)&tss, tss_size-1, TSS_ATTR_LOW, TSS_ATTR_HIGH); //tss描述符的dpl为0
+        // gdt段基址为0x900, BSP的tss描述符放在第4个位置, 也就是0x900 + 0x20的位置, AP的在用户段描述符之后
+        *((struct gdt_desc*)(0xc0000900 + tss_selector(cpu_id))) = make_gdt_desc((uint32_t*)&tss[cpu_id], tss_size-1, TSS_ATTR_LOW, TSS_ATTR_HIGH); //tss描述符的dpl为0
+    }
 
     //在gdt中添加DPL为3的用户代码段和用户数据段 描述符
     *((struct gdt_desc*)0xc0000928) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_CODE_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
     *((struct gdt_desc*)0xc0000930) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_DATA_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
 
-    // 重新加载gdt, lgdt 48位内存数据, 因此需要重新定义这48位内存数据
-    uint64_t gdt_operand = ((8*7-1) | ((uint64_t)(uint32_t)0xc0000900 << 16)); // 16位GDT界限 + 32位GDT起始地址
-    asm volatile ("lgdt %0" : : "m"(gdt_operand));
+    // 重新加载gdt
+    gdt_load();
 
     // 加载tss选择子到TR寄存器
     asm volatile ("ltr %w0" : : "r"(SELECTOR_TSS));
     put_str("tss_init and ltr done!\n");
+}
+
+/* AP启动时调用: 换用完整的gdt, 并加载本处理器的tss, 描述符已由BSP在tss_init中建好 */
+void tss_ap_init(uint8_t cpu_id) {
+    gdt_load();
+    asm volatile ("ltr %w0" : : "r"(tss_selector(cpu_id)));
 }
\ No newline at end of file
@@ -9,49 +9,23 @@
 #include "fs.h"
 #include "file.h"
 #include "pipe.h"
+#include "mmap.h"
+#include "shm.h"
 
 /* 回收用户进程的资源：1. 页表中对应的物理页 2. 虚拟内存池所占物理页框 3. 关闭打开的文件 */
 static void release_prog_resource(struct task_struct* release_thread) {
-    uint32_t* pgdir_vaddr = release_thread->pgdir;
-    uint16_t user_pde_nr = 768, pde_idx = 0;         // 分别表示用户空间中的pde数量, 以及pde的初始索引值
-    uint32_t pde = 0;                                // 用来接收每个页目录项的“内容”
-    uint32_t* v_pde_ptr = NULL;
+    ASSERT(release_thread == running_thread());    // 下面通过当前页表遍历用户空间, 只能由进程自己调用
 
-    uint16_t user_pte_nr = 1024, pte_idx = 0;        // 分别表示用户每个页表中pte的数量, 以及pte的初始索引值
-    uint32_t pte = 0;                                // 用来接收每个页表项的“内容”
-    uint32_t* v_pte_ptr = NULL;
+    /*** (0) 把文件映射区中写过的页写回文件并解除映射, 再分离共享内存段(最后一个映射者分离时段被释放), 这要在页表被回收之前 ***/
+    mmap_release();
+    shm_release();
 
-    uint32_t* first_pte_vaddr_in_pde = NULL;         // 表示pde中第0个pte的地址, 用它来遍历页表中的所有pte
-    uint32_t pg_phy_addr = 0;
-
-    /*** (1) 开始回收页表中用户空间的页框  ***/
-    while (pde_idx < user_pde_nr){
-        v_pde_ptr = pgdir_vaddr + pde_idx;
-        pde = *v_pde_ptr;
-        if (pde & 0x00000001) {  // 如果页目录项的p位为1, 说明该页目录项表示的页表中“可能”存在页表项
-            first_pte_vaddr_in_pde = pte_ptr(pde_idx * 0x400000);  // 一个页表所能表示的内存容量为0x400000字节
-            pte_idx = 0;
-            while (pte_idx < user_pte_nr) {
-                v_pte_ptr = first_pte_vaddr_in_pde + pte_idx;
-                pte = *v_pte_ptr;
-                if(pte & 0x00000001) {    // 如果页表项的P位为1, 表明确实分配了物理地址给该虚拟页
-                    // 将pte中记录的物理页框直接在相应的物理内存池位图中清0
-                    pg_phy_addr = pte & 0xfffff000;
-                    free_a_phy_page(pg_phy_addr);
-                }
-                pte_idx++;
-            }
-            // 将pde中记录的物理页框直接在相应物理内存池的位图中清0
-            pg_phy_addr = pde & 0xfffff000;
-            free_a_phy_page(pg_phy_addr);
-        }
-        pde_idx++;
-    }
+    /*** (1) 回收用户空间的页框以及页表本身, 整个用户空间只在最后刷新一次tlb ***/
+    page_range_unmap(0, 0xc0000000 / PG_SIZE);
 
     /*** (2) 回收用户虚拟地址池所占的物理内存 ***/
-    uint32_t bitmap_pg_cnt = (release_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len) / PG_SIZE;   // 用户虚拟地址池所占的页数量
     uint8_t* user_vaddr_pool_bitmap = release_thread->userprog_vaddr.vaddr_bitmap.bits;                // 获得用户虚拟地址池的起始虚拟地址
-    mfree_page(PF_KERNEL, user_vaddr_pool_bitmap, bitmap_pg_cnt);                                      // 从内核物理内存池中删除用户虚拟地址池
+    vfree(user_vaddr_pool_bitmap);                                                                     // 位图来自vmalloc区, 页数记录在区域中
 
     /*** （3） 关闭用户进程打开的文件  ***/
     uint8_t local_fd = 3;